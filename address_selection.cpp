@@ -0,0 +1,348 @@
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "address_selection.h"
+#include "async_log.h"
+
+// the kernel answers within the request. This only bounds a lost answer
+static const int lookup_timeout_ms = 1000;
+
+// the default policy table of RFC 6724 section 2.1, longest prefixes first
+struct PolicyEntry {
+    std::uint8_t prefix[16];
+    unsigned prefix_len;
+    int precedence;
+    int label;
+};
+
+static const PolicyEntry policy_table[] = {
+    // ::1/128
+    { { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 }, 128, 50, 0 },
+    // ::ffff:0:0/96, IPv4
+    { { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff }, 96, 35, 4 },
+    // ::/96, IPv4 compatible
+    { {}, 96, 1, 3 },
+    // 2001::/32, Teredo
+    { { 0x20, 0x01, 0, 0 }, 32, 5, 5 },
+    // 2002::/16, 6to4
+    { { 0x20, 0x02 }, 16, 30, 2 },
+    // 3ffe::/16, 6bone
+    { { 0x3f, 0xfe }, 16, 1, 12 },
+    // fec0::/10, site local
+    { { 0xfe, 0xc0 }, 10, 1, 11 },
+    // fc00::/7, ULA
+    { { 0xfc }, 7, 3, 13 },
+    // ::/0
+    { {}, 0, 40, 1 },
+};
+
+// what the rules compare of a destination
+struct Candidate {
+    std::size_t order;
+    int family;
+    bool usable;
+    // Scope(D) = Scope(Source(D)), and the same of the labels
+    bool scope_matches;
+    bool label_matches;
+    int precedence;
+    int scope;
+    int common_prefix_len;
+};
+
+// IPv4 as ::ffff:a.b.c.d, as the policy table has it
+static void to_v6(const sockaddr_storage &addr, std::uint8_t out[16])
+{
+    if (addr.ss_family == AF_INET) {
+        std::memset(out, 0, 10);
+        out[10] = 0xff;
+        out[11] = 0xff;
+        std::memcpy(out + 12, &reinterpret_cast<const sockaddr_in &>(addr).sin_addr, 4);
+    } else {
+        std::memcpy(out, &reinterpret_cast<const sockaddr_in6 &>(addr).sin6_addr, 16);
+    }
+}
+
+static unsigned common_prefix_len(const std::uint8_t a[16], const std::uint8_t b[16])
+{
+    unsigned len = 0;
+    for (std::size_t i = 0; i < 16; ++i) {
+        std::uint8_t diff = a[i] ^ b[i];
+        if (diff) {
+            return len + __builtin_clz(diff) - 24;
+        }
+        len += 8;
+    }
+    return len;
+}
+
+static const PolicyEntry &policy_of(const std::uint8_t addr[16])
+{
+    for (const PolicyEntry &entry : policy_table) {
+        if (common_prefix_len(addr, entry.prefix) >= entry.prefix_len) {
+            return entry;
+        }
+    }
+    // ::/0 matches anything
+    return policy_table[sizeof(policy_table) / sizeof(policy_table[0]) - 1];
+}
+
+// RFC 6724 section 3.1 and 3.2: 2 for link local, including loopback, 5 site local, 14 global
+static int scope_of(const std::uint8_t addr[16])
+{
+    if (addr[10] == 0xff && addr[11] == 0xff && !std::memcmp(addr, policy_table[1].prefix, 10)) {
+        // IPv4 loopback and link local. Private addresses are global
+        return addr[12] == 127 || (addr[12] == 169 && addr[13] == 254) ? 2 : 14;
+    }
+    if (addr[0] == 0xff) {
+        return addr[1] & 0x0f;
+    }
+    if (addr[0] == 0xfe && (addr[1] & 0xc0) == 0x80) {
+        return 2;
+    }
+    if (addr[0] == 0xfe && (addr[1] & 0xc0) == 0xc0) {
+        return 5;
+    }
+    return common_prefix_len(addr, policy_table[0].prefix) == 128 ? 2 : 14;
+}
+
+/// @return true if a is to be tried before b
+static bool is_preferred(const Candidate &a, const Candidate &b)
+{
+    // rule 1: avoid unusable destinations
+    if (a.usable != b.usable) {
+        return a.usable;
+    }
+    // rule 2: prefer matching scope
+    if (a.scope_matches != b.scope_matches) {
+        return a.scope_matches;
+    }
+    // rule 5: prefer matching label
+    if (a.label_matches != b.label_matches) {
+        return a.label_matches;
+    }
+    // rule 6: prefer higher precedence
+    if (a.precedence != b.precedence) {
+        return a.precedence > b.precedence;
+    }
+    // rule 8: prefer smaller scope
+    if (a.scope != b.scope) {
+        return a.scope < b.scope;
+    }
+    // rule 9: use longest matching prefix. Only between IPv6 addresses, as for IPv4 it would rank by
+    // the numbering of the provider, see RFC 6724 section 10.3
+    if (a.family == AF_INET6 && b.family == AF_INET6 && a.common_prefix_len != b.common_prefix_len) {
+        return a.common_prefix_len > b.common_prefix_len;
+    }
+    // rule 10: otherwise, leave the order unchanged
+    return a.order < b.order;
+}
+
+static void put_attr(nlmsghdr *nlh, unsigned short type, const void *data, std::size_t len)
+{
+    rtattr *rta = reinterpret_cast<rtattr *>(reinterpret_cast<char *>(nlh) + NLMSG_ALIGN(nlh->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    std::memcpy(RTA_DATA(rta), data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+DestinationSelector::DestinationSelector()
+    : sock(-1)
+    , seq(0)
+    , buffer(8192)
+    , lookup_count(0)
+{
+}
+
+DestinationSelector::~DestinationSelector()
+{
+    if (sock >= 0) {
+        close(sock);
+    }
+}
+
+int DestinationSelector::open()
+{
+    sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0) {
+        return -errno;
+    }
+    sockaddr_nl addr = {};
+    addr.nl_family = AF_NETLINK;
+    if (bind(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        return -errno;
+    }
+    timeval timeout = { lookup_timeout_ms / 1000, (lookup_timeout_ms % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return 0;
+}
+
+int DestinationSelector::get_route(const sockaddr_storage &destination, std::uint32_t fwmark, Route &route)
+{
+    route.usable = false;
+    std::memset(&route.source, 0, sizeof(route.source));
+    ++lookup_count;
+
+    struct {
+        nlmsghdr nlh;
+        rtmsg rtm;
+        char attrs[RTA_SPACE(16) + 2 * RTA_SPACE(sizeof(std::uint32_t))];
+    } request;
+    std::memset(&request, 0, sizeof(request));
+    request.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(rtmsg));
+    request.nlh.nlmsg_type = RTM_GETROUTE;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST;
+    request.nlh.nlmsg_seq = ++seq;
+    request.rtm.rtm_family = destination.ss_family;
+    if (destination.ss_family == AF_INET) {
+        const sockaddr_in &addr4 = reinterpret_cast<const sockaddr_in &>(destination);
+        request.rtm.rtm_dst_len = 32;
+        put_attr(&request.nlh, RTA_DST, &addr4.sin_addr, sizeof(addr4.sin_addr));
+    } else {
+        const sockaddr_in6 &addr6 = reinterpret_cast<const sockaddr_in6 &>(destination);
+        request.rtm.rtm_dst_len = 128;
+        put_attr(&request.nlh, RTA_DST, &addr6.sin6_addr, sizeof(addr6.sin6_addr));
+        if (addr6.sin6_scope_id) {
+            // a link local address is only reachable over its link
+            std::uint32_t oif = addr6.sin6_scope_id;
+            put_attr(&request.nlh, RTA_OIF, &oif, sizeof(oif));
+        }
+    }
+    if (fwmark) {
+        put_attr(&request.nlh, RTA_MARK, &fwmark, sizeof(fwmark));
+    }
+    if (send(sock, &request, request.nlh.nlmsg_len, 0) < 0) {
+        return -errno;
+    }
+
+    while (true) {
+        ssize_t len = recv(sock, buffer.data(), buffer.size(), 0);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        int remaining = static_cast<int>(len);
+        for (const nlmsghdr *nlh = reinterpret_cast<const nlmsghdr *>(buffer.data()); NLMSG_OK(nlh, remaining); nlh = NLMSG_NEXT(nlh, remaining)) {
+            if (nlh->nlmsg_seq != seq) {
+                // the answer to an earlier request that timed out
+                continue;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                // ENETUNREACH without a route, EHOSTUNREACH, EACCES and EINVAL for unreachable, prohibit and blackhole ones
+                const nlmsgerr *err = static_cast<const nlmsgerr *>(NLMSG_DATA(nlh));
+                return err->error ? err->error : -EPROTO;
+            }
+            if (nlh->nlmsg_type != RTM_NEWROUTE || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(rtmsg))) {
+                continue;
+            }
+            const rtmsg *rtm = static_cast<const rtmsg *>(NLMSG_DATA(nlh));
+            bool has_source = false;
+            int attr_len = RTM_PAYLOAD(nlh);
+            for (const rtattr *rta = RTM_RTA(rtm); RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len)) {
+                if (rta->rta_type != RTA_PREFSRC) {
+                    continue;
+                }
+                if (rtm->rtm_family == AF_INET && RTA_PAYLOAD(rta) == sizeof(in_addr)) {
+                    sockaddr_in &source4 = reinterpret_cast<sockaddr_in &>(route.source);
+                    source4.sin_family = AF_INET;
+                    std::memcpy(&source4.sin_addr, RTA_DATA(rta), sizeof(in_addr));
+                    has_source = true;
+                } else if (rtm->rtm_family == AF_INET6 && RTA_PAYLOAD(rta) == sizeof(in6_addr)) {
+                    sockaddr_in6 &source6 = reinterpret_cast<sockaddr_in6 &>(route.source);
+                    source6.sin6_family = AF_INET6;
+                    std::memcpy(&source6.sin6_addr, RTA_DATA(rta), sizeof(in6_addr));
+                    has_source = true;
+                }
+            }
+            // rule 1 also counts a destination without a source as unusable
+            route.usable = (rtm->rtm_type == RTN_UNICAST || rtm->rtm_type == RTN_LOCAL) && has_source;
+            return 0;
+        }
+    }
+}
+
+DestinationSelector::Route DestinationSelector::route_to(const sockaddr_storage &destination, std::uint32_t fwmark)
+{
+    std::uint8_t addr[16];
+    to_v6(destination, addr);
+    std::string key(reinterpret_cast<const char *>(addr), sizeof(addr));
+    key.append(reinterpret_cast<const char *>(&fwmark), sizeof(fwmark));
+    if (destination.ss_family == AF_INET6) {
+        // the same link local address on another link
+        std::uint32_t scope_id = reinterpret_cast<const sockaddr_in6 &>(destination).sin6_scope_id;
+        key.append(reinterpret_cast<const char *>(&scope_id), sizeof(scope_id));
+    }
+    auto it = routes.find(key);
+    if (it != routes.end()) {
+        return it->second;
+    }
+
+    Route route;
+    int rc = get_route(destination, fwmark, route);
+    if (rc < 0) {
+        async_log(LOG_DEBUG, "No route to %s: %s", reinterpret_cast<const sockaddr *>(&destination), std::strerror(-rc));
+        if (rc == -EAGAIN || rc == -EWOULDBLOCK || rc == -ENOBUFS) {
+            // the socket failed, not the lookup. Ask again next time
+            return route;
+        }
+    }
+    return routes.emplace(key, route).first->second;
+}
+
+void DestinationSelector::sort(std::vector<sockaddr_storage> &addresses, std::uint32_t fwmark)
+{
+    std::vector<Candidate> candidates;
+    candidates.reserve(addresses.size());
+    bool any_usable = false;
+    for (std::size_t i = 0; i < addresses.size(); ++i) {
+        Candidate candidate = { i, addresses[i].ss_family, false, false, false, 0, 0, 0 };
+        Route route = route_to(addresses[i], fwmark);
+        std::uint8_t dst[16];
+        to_v6(addresses[i], dst);
+        const PolicyEntry &dst_policy = policy_of(dst);
+        candidate.precedence = dst_policy.precedence;
+        candidate.scope = scope_of(dst);
+        if (route.usable) {
+            std::uint8_t src[16];
+            to_v6(route.source, src);
+            candidate.usable = true;
+            candidate.scope_matches = scope_of(src) == candidate.scope;
+            candidate.label_matches = policy_of(src).label == dst_policy.label;
+            // the prefix part of the source, assumed /64 as SLAAC has it
+            candidate.common_prefix_len = std::min(common_prefix_len(dst, src), 64U);
+            any_usable = true;
+        }
+        candidates.push_back(candidate);
+    }
+
+    // insertion sort: answers are short, and rule 9 only compares within a family, so the rules aren't
+    // a strict weak ordering std::sort could take
+    for (std::size_t i = 1; i < candidates.size(); ++i) {
+        Candidate candidate = candidates[i];
+        std::size_t j = i;
+        while (j > 0 && is_preferred(candidate, candidates[j - 1])) {
+            candidates[j] = candidates[j - 1];
+            --j;
+        }
+        candidates[j] = candidate;
+    }
+
+    std::vector<sockaddr_storage> sorted;
+    sorted.reserve(addresses.size());
+    for (const Candidate &candidate : candidates) {
+        if (candidate.usable || !any_usable) {
+            sorted.push_back(addresses[candidate.order]);
+        }
+    }
+    addresses.swap(sorted);
+}
@@ -0,0 +1,55 @@
+#ifndef ADDRESS_SELECTION_H
+#define ADDRESS_SELECTION_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Destination address selection of RFC 6724, as getaddrinfo does it, from the route and the source
+// address the kernel picks for each destination. Lookups are RTM_GETROUTE requests over rtnetlink,
+// answered synchronously, and are cached until clear(): call it when routes, rules or addresses change.
+class DestinationSelector {
+public:
+    DestinationSelector();
+    ~DestinationSelector();
+    DestinationSelector(const DestinationSelector &) = delete;
+    DestinationSelector &operator=(const DestinationSelector &) = delete;
+
+    /// @return 0 or negative errno
+    int open();
+
+    /// @brief order addresses best first by the rules of RFC 6724 section 6. Those without a route are
+    ///        dropped, unless none has one. Rules 3, 4 and 7 (deprecated, home and tunnelled sources) aren't applied
+    /// @param fwmark of the packets sent to them, 0 if none. With policy routing, e.g. a full tunnel through
+    ///        WireGuard, the lookup sees the routes the packets of the device take
+    void sort(std::vector<sockaddr_storage> &addresses, std::uint32_t fwmark);
+    // forget the routes looked up
+    void clear() { routes.clear(); }
+    // lookups sent to the kernel, i.e. cache misses
+    std::uint64_t lookups() const { return lookup_count; }
+
+private:
+    struct Route {
+        // the kernel has a unicast route to it, and a source address
+        bool usable;
+        sockaddr_storage source;
+    };
+
+    Route route_to(const sockaddr_storage &destination, std::uint32_t fwmark);
+    int get_route(const sockaddr_storage &destination, std::uint32_t fwmark, Route &route);
+
+    int sock;
+    std::uint32_t seq;
+    std::vector<char> buffer;
+    // by the address bytes, the mark and the IPv6 scope id
+    std::map<std::string, Route> routes;
+    std::uint64_t lookup_count;
+};
+
+#endif
@@ -0,0 +1,390 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+
+#include <algorithm>
+#include <system_error>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "async_log.h"
+
+// records queued at once. More are dropped, and counted
+static const std::size_t ring_size = 1024;
+// longest formatted message
+static const std::size_t line_size = 1024;
+
+std::atomic<int> async_log_mask(LOG_UPTO(LOG_DEBUG));
+
+// Bounded multi-producer single-consumer ring. Each slot carries a sequence number telling
+// whose turn it is: pos when free for the producer claiming pos, pos + 1 once committed
+namespace {
+struct Slot {
+    std::atomic<std::size_t> sequence;
+    LogRecord record;
+};
+
+struct Ring {
+    Slot slots[ring_size];
+    std::atomic<std::size_t> tail;
+    std::size_t head;
+    std::atomic<std::uint64_t> dropped;
+    // the writer blocks on it while the ring is empty
+    int wake_fd;
+    std::atomic<bool> sleeping;
+    std::atomic<bool> stopping;
+    std::thread writer;
+    // only flipped while the main thread is the only producer
+    std::atomic<bool> running;
+};
+}
+
+static Ring ring;
+// records of a caller while no writer runs
+static const std::size_t direct_slot = static_cast<std::size_t>(-1);
+static thread_local LogRecord direct_record;
+
+void LogRecordWriter::put_string(const char *str)
+{
+    if (!str) {
+        str = "(null)";
+    }
+    std::size_t len = std::strlen(str);
+    // tag and length first, then as much of the string as fits
+    if (sizeof(record.args) - record.length < 3) {
+        return;
+    }
+    len = std::min(len, sizeof(record.args) - record.length - 3);
+    std::uint16_t len16 = len;
+    put_tag('s') && put(&len16, sizeof(len16)) && put(str, len);
+}
+
+void LogRecordWriter::put_address(const sockaddr *addr)
+{
+    unsigned char family = addr ? addr->sa_family : AF_UNSPEC;
+    unsigned char bytes[16] = {};
+    if (family == AF_INET) {
+        std::memcpy(bytes, &reinterpret_cast<const sockaddr_in *>(addr)->sin_addr, sizeof(in_addr));
+    } else if (family == AF_INET6) {
+        std::memcpy(bytes, &reinterpret_cast<const sockaddr_in6 *>(addr)->sin6_addr, sizeof(in6_addr));
+    }
+    put_tag('a') && put(&family, 1) && put(bytes, sizeof(bytes));
+}
+
+void encode_log_arg(LogRecordWriter &writer, const LogAddresses &value)
+{
+    std::uint16_t count = value.addresses.size();
+    if (!writer.put_tag('l') || !writer.put(&count, sizeof(count))) {
+        return;
+    }
+    for (std::size_t i = 0; i < value.addresses.size() && i < log_max_addresses; ++i) {
+        writer.put_address(reinterpret_cast<const sockaddr *>(&value.addresses[i]));
+    }
+}
+
+LogRecord *async_log_claim(std::size_t &slot)
+{
+    if (!ring.running.load(std::memory_order_relaxed)) {
+        slot = direct_slot;
+        return &direct_record;
+    }
+
+    std::size_t pos = ring.tail.load(std::memory_order_relaxed);
+    while (true) {
+        Slot &s = ring.slots[pos % ring_size];
+        std::size_t sequence = s.sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence - pos);
+        if (diff == 0) {
+            if (ring.tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot = pos;
+                return &s.record;
+            }
+        } else if (diff < 0) {
+            // the writer is a lap behind
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        } else {
+            pos = ring.tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void async_log_commit(std::size_t slot)
+{
+    if (slot == direct_slot) {
+        async_log_write(direct_record);
+        return;
+    }
+    // seq_cst, like the sleep announcement of the writer, so one of the two sees the other
+    ring.slots[slot % ring_size].sequence.store(slot + 1);
+    if (ring.sleeping.exchange(false)) {
+        std::uint64_t one = 1;
+        ssize_t rc = write(ring.wake_fd, &one, sizeof(one));
+        (void)rc;
+    }
+}
+
+// reads the arguments of a record in order
+namespace {
+struct LogArgReader {
+    const LogRecord &record;
+    std::size_t pos;
+
+    bool get(void *data, std::size_t len)
+    {
+        if (len > record.length - pos) {
+            return false;
+        }
+        std::memcpy(data, record.args + pos, len);
+        pos += len;
+        return true;
+    }
+};
+}
+
+static bool read_address(LogArgReader &reader, std::string &out)
+{
+    char tag;
+    unsigned char family;
+    unsigned char bytes[16];
+    if (!reader.get(&tag, 1) || !reader.get(&family, 1) || !reader.get(bytes, sizeof(bytes))) {
+        return false;
+    }
+    char buf[INET6_ADDRSTRLEN];
+    if ((family == AF_INET || family == AF_INET6) && inet_ntop(family, bytes, buf, sizeof(buf))) {
+        out += buf;
+    } else if (family == AF_UNSPEC) {
+        // e.g. a peer without an endpoint yet
+        out += "(N/A)";
+    } else {
+        out += "(invalid)";
+    }
+    return true;
+}
+
+// the text of a string, address or address list argument
+static bool read_text(LogArgReader &reader, char tag, std::string &out)
+{
+    switch (tag) {
+    case 's': {
+        std::uint16_t len;
+        if (!reader.get(&len, sizeof(len)) || len > reader.record.length - reader.pos) {
+            return false;
+        }
+        out.assign(reader.record.args + reader.pos, len);
+        reader.pos += len;
+        return true;
+    }
+    case 'a':
+        // put back the tag read_address expects
+        --reader.pos;
+        return read_address(reader, out);
+    case 'l': {
+        std::uint16_t count;
+        if (!reader.get(&count, sizeof(count))) {
+            return false;
+        }
+        for (std::size_t i = 0; i < count && i < log_max_addresses; ++i) {
+            if (i) {
+                out += ' ';
+            }
+            if (!read_address(reader, out)) {
+                return false;
+            }
+        }
+        if (count > log_max_addresses) {
+            out += " ...";
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// one conversion of the format, with the argument as recorded. Length modifiers of the format
+// are replaced by those of the recorded type
+static bool format_arg(LogArgReader &reader, const std::string &spec, char conversion, char *out, std::size_t size)
+{
+    char tag;
+    if (!reader.get(&tag, 1)) {
+        return false;
+    }
+
+    bool integer_conversion = std::strchr("diouxXc", conversion) != nullptr;
+    bool float_conversion = std::strchr("fFeEgGaA", conversion) != nullptr;
+    std::string fmt = spec;
+    switch (tag) {
+    case 'i':
+    case 'u': {
+        std::uint64_t bits;
+        if (!reader.get(&bits, sizeof(bits))) {
+            return false;
+        }
+        std::int64_t value;
+        std::memcpy(&value, &bits, sizeof(value));
+        if (float_conversion) {
+            std::snprintf(out, size, (fmt + conversion).c_str(), tag == 'i' ? static_cast<double>(value) : static_cast<double>(bits));
+        } else if (conversion == 'c') {
+            std::snprintf(out, size, (fmt + 'c').c_str(), static_cast<int>(value));
+        } else if (integer_conversion && conversion != 'd' && conversion != 'i') {
+            std::snprintf(out, size, (fmt + "ll" + conversion).c_str(), static_cast<unsigned long long>(bits));
+        } else if (tag == 'i') {
+            std::snprintf(out, size, (fmt + "lld").c_str(), static_cast<long long>(value));
+        } else {
+            std::snprintf(out, size, (fmt + "llu").c_str(), static_cast<unsigned long long>(bits));
+        }
+        return true;
+    }
+    case 'f': {
+        double value;
+        if (!reader.get(&value, sizeof(value))) {
+            return false;
+        }
+        std::snprintf(out, size, (fmt + (float_conversion ? conversion : 'g')).c_str(), value);
+        return true;
+    }
+    default: {
+        std::string text;
+        if (!read_text(reader, tag, text)) {
+            return false;
+        }
+        std::snprintf(out, size, (fmt + 's').c_str(), text.c_str());
+        return true;
+    }
+    }
+}
+
+void async_log_write(const LogRecord &record)
+{
+    char line[line_size];
+    std::size_t len = 0;
+    LogArgReader reader { record, 0 };
+    for (const char *p = record.format; *p && len < sizeof(line) - 1;) {
+        if (*p != '%') {
+            line[len++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            line[len++] = '%';
+            p += 2;
+            continue;
+        }
+
+        // flags, width and precision are kept
+        const char *start = p++;
+        while (*p && std::strchr("-+ #0123456789.", *p)) {
+            ++p;
+        }
+        std::string spec(start, p);
+        while (*p && std::strchr("hlLqjzt", *p)) {
+            ++p;
+        }
+        if (!*p) {
+            break;
+        }
+        char conversion = *p++;
+        if (!format_arg(reader, spec, conversion, line + len, sizeof(line) - len)) {
+            // truncated record
+            break;
+        }
+        len += std::strlen(line + len);
+    }
+    line[std::min(len, sizeof(line) - 1)] = '\0';
+    syslog(record.priority, "%s", line);
+}
+
+static void writer_main()
+{
+    std::uint64_t reported_drops = 0;
+    bool final_pass = false;
+    while (true) {
+        Slot &s = ring.slots[ring.head % ring_size];
+        if (s.sequence.load(std::memory_order_acquire) == ring.head + 1) {
+            async_log_write(s.record);
+            s.sequence.store(ring.head + ring_size, std::memory_order_release);
+            ++ring.head;
+            continue;
+        }
+
+        std::uint64_t dropped = ring.dropped.load(std::memory_order_relaxed);
+        if (dropped != reported_drops) {
+            syslog(LOG_WARNING, "%llu log record(s) dropped, the log writer fell behind", static_cast<unsigned long long>(dropped - reported_drops));
+            reported_drops = dropped;
+        }
+        if (final_pass) {
+            return;
+        }
+        if (ring.stopping.load()) {
+            // every commit happened before the stop. Drain them
+            final_pass = true;
+            continue;
+        }
+
+        // announce the sleep, then look again: a commit in between either is seen or wakes us
+        ring.sleeping.store(true);
+        if (ring.slots[ring.head % ring_size].sequence.load() == ring.head + 1 || ring.stopping.load()) {
+            ring.sleeping.store(false);
+            continue;
+        }
+        std::uint64_t count;
+        ssize_t rc = read(ring.wake_fd, &count, sizeof(count));
+        (void)rc;
+    }
+}
+
+int async_log_start()
+{
+    ring.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (ring.wake_fd < 0) {
+        return -errno;
+    }
+    for (std::size_t i = 0; i < ring_size; ++i) {
+        ring.slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    ring.tail.store(0);
+    ring.head = 0;
+    ring.dropped.store(0);
+    ring.sleeping.store(false);
+    ring.stopping.store(false);
+
+    // the writer must never take a signal meant for the main loop
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    try {
+        ring.writer = std::thread(writer_main);
+    } catch (const std::system_error &e) {
+        pthread_sigmask(SIG_SETMASK, &old, nullptr);
+        close(ring.wake_fd);
+        return -e.code().value();
+    }
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    ring.running.store(true);
+    return 0;
+}
+
+void async_log_stop()
+{
+    if (!ring.running.load()) {
+        return;
+    }
+    ring.stopping.store(true);
+    std::uint64_t one = 1;
+    ssize_t rc = write(ring.wake_fd, &one, sizeof(one));
+    (void)rc;
+    ring.writer.join();
+    ring.running.store(false);
+    close(ring.wake_fd);
+}
+
+void async_log_set_mask(int mask)
+{
+    setlogmask(mask);
+    async_log_mask.store(mask, std::memory_order_relaxed);
+}
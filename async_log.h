@@ -0,0 +1,147 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <sys/socket.h>
+#include <syslog.h>
+
+// Logging off the calling thread. async_log() copies the format pointer and the raw arguments into a
+// lock-free ring; a writer thread formats them and calls syslog. A masked priority costs one load.
+//
+// The format must outlive the process, i.e. be a literal. Arguments are printf-like, plus:
+//   const sockaddr *        formatted by %s as the IP, without the port
+//   LogAddresses            formatted by %s as the IPs, space separated
+// Strings are copied, and truncated if the record runs out of room.
+
+// a list of addresses for %s, copied up to log_max_addresses
+struct LogAddresses {
+    const std::vector<sockaddr_storage> &addresses;
+};
+
+static const std::size_t log_max_addresses = 8;
+
+struct LogRecord {
+    int priority;
+    const char *format;
+    std::uint16_t length;
+    char args[498];
+};
+
+// fills a record, dropping what doesn't fit
+class LogRecordWriter {
+public:
+    explicit LogRecordWriter(LogRecord &record)
+        : record(record)
+    {
+        record.length = 0;
+    }
+
+    bool put(const void *data, std::size_t len)
+    {
+        if (len > sizeof(record.args) - record.length) {
+            return false;
+        }
+        std::memcpy(record.args + record.length, data, len);
+        record.length += len;
+        return true;
+    }
+    bool put_tag(char tag) { return put(&tag, 1); }
+    void put_string(const char *str);
+    void put_address(const sockaddr *addr);
+
+private:
+    LogRecord &record;
+};
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type encode_log_arg(LogRecordWriter &writer, T value)
+{
+    std::int64_t v = value;
+    writer.put_tag('i') && writer.put(&v, sizeof(v));
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value>::type encode_log_arg(LogRecordWriter &writer, T value)
+{
+    std::uint64_t v = value;
+    writer.put_tag('u') && writer.put(&v, sizeof(v));
+}
+
+inline void encode_log_arg(LogRecordWriter &writer, double value)
+{
+    writer.put_tag('f') && writer.put(&value, sizeof(value));
+}
+
+inline void encode_log_arg(LogRecordWriter &writer, const char *value)
+{
+    writer.put_string(value);
+}
+
+inline void encode_log_arg(LogRecordWriter &writer, const std::string &value)
+{
+    writer.put_string(value.c_str());
+}
+
+inline void encode_log_arg(LogRecordWriter &writer, const sockaddr *value)
+{
+    writer.put_address(value);
+}
+
+void encode_log_arg(LogRecordWriter &writer, const LogAddresses &value);
+
+inline void encode_log_args(LogRecordWriter &)
+{
+}
+
+template <typename T, typename... Rest>
+void encode_log_args(LogRecordWriter &writer, const T &first, const Rest &... rest)
+{
+    encode_log_arg(writer, first);
+    encode_log_args(writer, rest...);
+}
+
+// the setlogmask() of async_log
+extern std::atomic<int> async_log_mask;
+
+/// @brief start the writer thread. Call after daemon(), fork() doesn't carry threads.
+///        Until then, and after async_log_stop(), records are written by the caller
+/// @return 0 or negative errno
+int async_log_start();
+/// @brief write what is queued and join the writer thread
+void async_log_stop();
+// replaces setlogmask(). Sets both
+void async_log_set_mask(int mask);
+
+/// @return nullptr if the ring is full. Then the record is counted as dropped
+LogRecord *async_log_claim(std::size_t &slot);
+void async_log_commit(std::size_t slot);
+// format and syslog right away
+void async_log_write(const LogRecord &record);
+
+template <typename... Args>
+void async_log(int priority, const char *format, const Args &... args)
+{
+    if (!(async_log_mask.load(std::memory_order_relaxed) & LOG_MASK(LOG_PRI(priority)))) {
+        return;
+    }
+    std::size_t slot;
+    LogRecord *record = async_log_claim(slot);
+    if (!record) {
+        return;
+    }
+    record->priority = priority;
+    record->format = format;
+    LogRecordWriter writer(*record);
+    encode_log_args(writer, args...);
+    async_log_commit(slot);
+}
+
+#endif
@@ -0,0 +1,558 @@
+// Offline benchmarks of the resolve and update pipeline. WireGuard is a fake genetlink kernel
+// in process, DNS a stub server on loopback. Reports per operation the time, the allocations and
+// the system calls, as counted by bench_syscalls.c.
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "bench/bench_hooks.h"
+#include "bench/bench_wg.h"
+#include "core.h"
+#include "dns.h"
+
+static const char *const bench_device = "bench0";
+static const std::uint16_t bench_port = 51820;
+
+struct BenchResult {
+    double ns_per_op;
+    double allocs_per_op;
+    double syscalls_per_op;
+};
+
+struct Benchmark {
+    std::string name;
+    std::function<BenchResult()> run;
+};
+
+static double min_time_s = 0.3;
+
+static double elapsed_ns(const timespec &start, const timespec &end)
+{
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+/// @brief run op in growing rounds until a round lasts min_time_s, and report that round
+static BenchResult measure(const std::function<void()> &op)
+{
+    // warm up caches and buffers first
+    op();
+
+    std::uint64_t iterations = 1;
+    while (true) {
+        bench_counters before;
+        bench_counters after;
+        bench_counters_read(&before);
+        auto start = std::chrono::steady_clock::now();
+        for (std::uint64_t i = 0; i < iterations; ++i) {
+            op();
+        }
+        auto end = std::chrono::steady_clock::now();
+        bench_counters_read(&after);
+
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        if (ns >= min_time_s * 1e9 || iterations >= (1ULL << 40)) {
+            return { ns / iterations, static_cast<double>(after.allocations - before.allocations) / iterations,
+                static_cast<double>(after.syscalls - before.syscalls) / iterations };
+        }
+        // aim a bit past the minimum so the next round is likely the last
+        double scale = ns > 0 ? min_time_s * 1.2e9 / ns : 100;
+        iterations = static_cast<std::uint64_t>(iterations * std::min(std::max(scale, 2.0), 100.0));
+    }
+}
+
+static sockaddr_in make_endpoint(const char *ip)
+{
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(bench_port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    return addr;
+}
+
+// wg: the netlink parsers and serializers
+
+static BenchResult bench_parse_dump_of(std::size_t peers)
+{
+    sockaddr_in endpoint = make_endpoint("192.0.2.1");
+    bench_dump *dump = bench_dump_build(bench_device, peers, reinterpret_cast<sockaddr *>(&endpoint));
+    BenchResult result = measure([dump, peers] {
+        wg_device *dev = bench_parse_dump(dump);
+        if (!dev || !dev->first_peer) {
+            std::fprintf(stderr, "dump of %zu peers not parsed\n", peers);
+            std::exit(EXIT_FAILURE);
+        }
+    });
+    bench_dump_free(dump);
+    return result;
+}
+
+static BenchResult bench_scan_dump_of(std::size_t peers)
+{
+    sockaddr_in endpoint = make_endpoint("192.0.2.1");
+    bench_dump *dump = bench_dump_build(bench_device, peers, reinterpret_cast<sockaddr *>(&endpoint));
+    BenchResult result = measure([dump, peers] {
+        std::size_t count;
+        if (bench_scan_dump(dump, &count) < 0 || count != peers) {
+            std::fprintf(stderr, "dump of %zu peers not scanned\n", peers);
+            std::exit(EXIT_FAILURE);
+        }
+    });
+    bench_dump_free(dump);
+    return result;
+}
+
+static int count_scanned_peer(const wg_peer_status *, void *data)
+{
+    ++*static_cast<std::size_t *>(data);
+    return 0;
+}
+
+/// @brief op against the fake kernel knowing bench_device with the peers
+static BenchResult bench_fake_kernel(std::size_t peers, const std::function<void(wg_nl_context *, bench_dump *)> &op)
+{
+    sockaddr_in endpoint = make_endpoint("192.0.2.1");
+    bench_dump *dump = bench_dump_build(bench_device, peers, reinterpret_cast<sockaddr *>(&endpoint));
+    bench_fake_kernel_clear();
+    bench_fake_kernel_add_device(dump);
+    bench_fake_kernel_enable(true);
+    wg_nl_context *ctx = wg_nl_open();
+    BenchResult result = measure([ctx, dump, &op] { op(ctx, dump); });
+    wg_nl_close(ctx);
+    bench_fake_kernel_enable(false);
+    bench_fake_kernel_clear();
+    bench_dump_free(dump);
+    return result;
+}
+
+static void check_nl(int rc, const char *what)
+{
+    if (rc < 0) {
+        std::fprintf(stderr, "%s: %s\n", what, std::strerror(-rc));
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+static BenchResult bench_nl_scan_peers(std::size_t peers)
+{
+    return bench_fake_kernel(peers, [peers](wg_nl_context *ctx, bench_dump *) {
+        std::size_t count = 0;
+        check_nl(wg_nl_scan_peers(ctx, bench_device, count_scanned_peer, &count), "wg_nl_scan_peers");
+        if (count != peers) {
+            std::fprintf(stderr, "wg_nl_scan_peers: %zu of %zu peers\n", count, peers);
+            std::exit(EXIT_FAILURE);
+        }
+    });
+}
+
+/// @param devices dumped together, each with the peers
+static BenchResult bench_nl_scan_devices(std::size_t devices, std::size_t peers)
+{
+    sockaddr_in endpoint = make_endpoint("192.0.2.1");
+    std::vector<std::string> names;
+    std::vector<bench_dump *> dumps;
+    bench_fake_kernel_clear();
+    for (std::size_t i = 0; i < devices; ++i) {
+        names.push_back(bench_device + std::to_string(i));
+        dumps.push_back(bench_dump_build(names[i].c_str(), peers, reinterpret_cast<sockaddr *>(&endpoint)));
+        bench_fake_kernel_add_device(dumps[i]);
+    }
+    bench_fake_kernel_enable(true);
+    wg_nl_context *ctx = wg_nl_open();
+    std::vector<std::size_t> counts(devices);
+    std::vector<wg_device_scan> scans(devices);
+    BenchResult result = measure([&] {
+        for (std::size_t i = 0; i < devices; ++i) {
+            counts[i] = 0;
+            scans[i] = { names[i].c_str(), count_scanned_peer, &counts[i], 0, 0 };
+        }
+        check_nl(wg_nl_scan_devices(ctx, scans.data(), scans.size()), "wg_nl_scan_devices");
+        for (std::size_t count : counts) {
+            if (count != peers) {
+                std::fprintf(stderr, "wg_nl_scan_devices: %zu of %zu peers\n", count, peers);
+                std::exit(EXIT_FAILURE);
+            }
+        }
+    });
+    wg_nl_close(ctx);
+    bench_fake_kernel_enable(false);
+    bench_fake_kernel_clear();
+    for (bench_dump *dump : dumps) {
+        bench_dump_free(dump);
+    }
+    return result;
+}
+
+static BenchResult bench_set_device(std::size_t peers)
+{
+    // parsed once. It lives until the next parse
+    wg_device *dev = nullptr;
+    return bench_fake_kernel(peers, [&dev](wg_nl_context *ctx, bench_dump *dump) {
+        if (!dev) {
+            dev = bench_parse_dump(dump);
+        }
+        check_nl(wg_nl_set_device(ctx, dev), "wg_nl_set_device");
+    });
+}
+
+static BenchResult bench_set_peer_endpoint()
+{
+    wg_key key;
+    bench_peer_key(7, key);
+    wg_endpoint endpoint {};
+    endpoint.addr4 = make_endpoint("198.51.100.1");
+    return bench_fake_kernel(10, [&key, &endpoint](wg_nl_context *ctx, bench_dump *) {
+        check_nl(wg_nl_set_peer_endpoint(ctx, bench_device, key, &endpoint), "wg_nl_set_peer_endpoint");
+    });
+}
+
+/// @param count peers of the dump that get a new endpoint together
+static BenchResult bench_set_peer_endpoints(std::size_t count)
+{
+    std::vector<wg_endpoint_update> updates(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        bench_peer_key(i, updates[i].public_key);
+        updates[i].endpoint.addr4 = make_endpoint("198.51.100.1");
+    }
+    return bench_fake_kernel(count, [&updates](wg_nl_context *ctx, bench_dump *) {
+        check_nl(wg_nl_set_peer_endpoints(ctx, bench_device, updates.data(), updates.size()), "wg_nl_set_peer_endpoints");
+    });
+}
+
+// dns: against a stub server answering every A question with the same large set
+
+class DnsStub {
+public:
+    /// @param answers A records per answer, every address twice
+    explicit DnsStub(std::size_t answers)
+        : answers(answers)
+        , fd(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0))
+        , stopping(false)
+    {
+        sockaddr_in addr = make_endpoint("127.0.0.1");
+        addr.sin_port = 0;
+        socklen_t addr_len = sizeof(addr);
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+            || getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &addr_len) < 0) {
+            std::perror("DNS stub");
+            std::exit(EXIT_FAILURE);
+        }
+        port = ntohs(addr.sin_port);
+        thread = std::thread(&DnsStub::serve, this);
+    }
+
+    ~DnsStub()
+    {
+        stopping = true;
+        thread.join();
+        close(fd);
+    }
+
+    std::string address() const { return "127.0.0.1#" + std::to_string(port); }
+
+private:
+    void serve()
+    {
+        bench_counters_ignore_thread();
+        std::uint8_t query[512];
+        std::vector<std::uint8_t> reply;
+        while (!stopping) {
+            pollfd pfd { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 50) <= 0) {
+                continue;
+            }
+            sockaddr_storage from;
+            socklen_t from_len = sizeof(from);
+            ssize_t len = recvfrom(fd, query, sizeof(query), 0, reinterpret_cast<sockaddr *>(&from), &from_len);
+            // header, at least a root name, type and class
+            if (len < 12 + 5) {
+                continue;
+            }
+            std::uint16_t qtype = query[len - 4] << 8 | query[len - 3];
+            std::size_t count = qtype == 1 ? answers : 0;
+
+            reply.assign(query, query + len);
+            // QR RD RA, NOERROR. NODATA for AAAA
+            reply[2] = 0x81;
+            reply[3] = 0x80;
+            reply[6] = count >> 8;
+            reply[7] = count & 0xff;
+            for (std::size_t i = 0; i < count; ++i) {
+                std::uint32_t ip = 0x0a000000 | static_cast<std::uint32_t>(i / 2);
+                const std::uint8_t record[] = {
+                    // the name of the question, TYPE A, CLASS IN, TTL 300, RDLENGTH 4
+                    0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04,
+                    static_cast<std::uint8_t>(ip >> 24), static_cast<std::uint8_t>(ip >> 16),
+                    static_cast<std::uint8_t>(ip >> 8), static_cast<std::uint8_t>(ip),
+                };
+                reply.insert(reply.end(), record, record + sizeof(record));
+            }
+            sendto(fd, reply.data(), reply.size(), 0, reinterpret_cast<sockaddr *>(&from), from_len);
+        }
+    }
+
+    std::size_t answers;
+    int fd;
+    std::uint16_t port;
+    std::atomic<bool> stopping;
+    std::thread thread;
+};
+
+static void check_dns(int rc, std::size_t addresses, std::size_t expected)
+{
+    if (rc != 0 || addresses != expected) {
+        std::fprintf(stderr, "DNS stub: rc %d, %zu of %zu addresses\n", rc, addresses, expected);
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+static BenchResult bench_dns_resolve(std::size_t answers)
+{
+    DnsStub stub(answers);
+    DnsResolver resolver(1000);
+    resolver.add_nameserver(stub.address());
+    std::vector<sockaddr_storage> addresses;
+    std::uint32_t ttl;
+    return measure([&] {
+        int rc = resolver.resolve("peer.bench.example", addresses, ttl);
+        check_dns(rc, addresses.size(), answers / 2);
+    });
+}
+
+static BenchResult bench_dns_result(std::size_t answers)
+{
+    DnsStub stub(answers);
+    DnsResolver resolver(1000);
+    resolver.add_nameserver(stub.address());
+    DnsQuery query(resolver, "peer.bench.example");
+    query.start(std::chrono::steady_clock::now());
+    resolver.wait(query);
+    std::vector<sockaddr_storage> addresses;
+    std::uint32_t ttl;
+    return measure([&] {
+        int rc = query.result(addresses, ttl);
+        check_dns(rc, addresses.size(), answers / 2);
+    });
+}
+
+// cycle: task_resolve_and_update against the fake kernel, one batch of every peer per cycle
+
+struct CycleProbe {
+    std::uint64_t warmup_dumps;
+    std::uint64_t measured_dumps;
+    timespec start_cpu;
+    timespec end_cpu;
+    bench_counters start_counters;
+    bench_counters end_counters;
+};
+
+// on the thread of the task, as every peer is due again
+static void on_cycle_dump(std::uint64_t dumps, void *data)
+{
+    CycleProbe &probe = *static_cast<CycleProbe *>(data);
+    if (dumps == probe.warmup_dumps) {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &probe.start_cpu);
+        bench_counters_read(&probe.start_counters);
+    } else if (dumps == probe.warmup_dumps + probe.measured_dumps) {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &probe.end_cpu);
+        bench_counters_read(&probe.end_counters);
+        kill(getpid(), SIGTERM);
+    }
+}
+
+/// @param changed whether every resolution moves the endpoint, so that every peer is set every cycle
+/// @param hostnames how many distinct hostnames the peers have, resolved by a stub server. 0 for literal
+///        addresses, so that the cycle is the daemon's own work
+static BenchResult bench_cycle(std::size_t peers, bool changed, std::size_t hostnames)
+{
+    bool resolved = hostnames != 0;
+    // the stub answers with 10.0.0.0 twice
+    const char *resolved_ip = resolved ? "10.0.0.0" : "192.0.2.1";
+    sockaddr_in endpoint = make_endpoint(changed ? "198.51.100.1" : resolved_ip);
+    bench_dump *dump = bench_dump_build(bench_device, peers, reinterpret_cast<sockaddr *>(&endpoint));
+    std::unique_ptr<DnsStub> stub(resolved ? new DnsStub(2) : nullptr);
+
+    ResolvUpdateConfig config {};
+    // the batch slack is 10 ms: the next cycle is a batch of its own
+    config.refresh_interval_ms = 11;
+    config.ttl_min_ms = 1000;
+    config.ttl_max_ms = 3600000;
+    config.dns_timeout_ms = 1000;
+    config.dns_max_stale_ms = 86400000;
+    config.handshake_stale_ms = 135000;
+    config.healthy_max_ms = 60000;
+    config.stale_interval_ms = 1000;
+    config.network_debounce_ms = 50;
+    config.frontend = true;
+    // the cycles measure the built-in resolver, which takes IP literals without getaddrinfo
+    config.builtin_resolver = true;
+    if (stub) {
+        config.nameservers.push_back(stub->address());
+    }
+    for (std::size_t i = 0; i < peers; ++i) {
+        PeerConfig peer {};
+        peer.wg_device_name = bench_device;
+        bench_peer_key(i, peer.wg_peer_pubkey);
+        wg_key_b64_string base64;
+        wg_key_to_base64(base64, peer.wg_peer_pubkey);
+        peer.wg_peer_pubkey_base64 = base64;
+        peer.peer_hostname = resolved ? "peer" + std::to_string(i % hostnames) + ".bench.example" : resolved_ip;
+        peer.peer_port = bench_port;
+        peer.ip_version_preference = IPVersionPreference::NoPreference;
+        config.peers.push_back(peer);
+    }
+
+    // a cycle is a sleep of refresh_interval_ms and a little work: count enough of them
+    CycleProbe probe {};
+    probe.warmup_dumps = 3;
+    probe.measured_dumps = std::max<std::uint64_t>(10, min_time_s * 1000 / config.refresh_interval_ms);
+    bench_fake_kernel_clear();
+    bench_fake_kernel_add_device(dump);
+    bench_fake_kernel_on_dump(on_cycle_dump, &probe);
+    bench_fake_kernel_enable(true);
+    std::thread task([&config] { task_resolve_and_update(config); });
+    task.join();
+    bench_fake_kernel_enable(false);
+
+    struct bench_fake_kernel_stats stats;
+    bench_fake_kernel_stats(&stats);
+    bench_fake_kernel_clear();
+    bench_dump_free(dump);
+    if (stats.dumps < probe.warmup_dumps + probe.measured_dumps || (changed && stats.set_peers < peers * probe.measured_dumps)) {
+        std::fprintf(stderr, "cycle: %llu dump(s), %llu peer(s) set\n", static_cast<unsigned long long>(stats.dumps),
+            static_cast<unsigned long long>(stats.set_peers));
+        std::exit(EXIT_FAILURE);
+    }
+
+    double cycles = static_cast<double>(probe.measured_dumps);
+    return { elapsed_ns(probe.start_cpu, probe.end_cpu) / cycles,
+        (probe.end_counters.allocations - probe.start_counters.allocations) / cycles,
+        (probe.end_counters.syscalls - probe.start_counters.syscalls) / cycles };
+}
+
+static std::vector<Benchmark> benchmarks()
+{
+    std::vector<Benchmark> list;
+    for (std::size_t peers : { 10, 1000, 100000 }) {
+        list.push_back({ "wg/parse-dump/" + std::to_string(peers), [peers] { return bench_parse_dump_of(peers); } });
+    }
+    for (std::size_t peers : { 10, 1000, 100000 }) {
+        list.push_back({ "wg/scan-dump/" + std::to_string(peers), [peers] { return bench_scan_dump_of(peers); } });
+    }
+    for (std::size_t peers : { 10, 1000, 100000 }) {
+        list.push_back({ "wg/nl-scan-peers/" + std::to_string(peers), [peers] { return bench_nl_scan_peers(peers); } });
+    }
+    // as many devices as wireguard.c dumps at once, then more
+    for (std::size_t devices : { 8, 12 }) {
+        list.push_back({ "wg/nl-scan-devices/" + std::to_string(devices) + "x1000", [devices] { return bench_nl_scan_devices(devices, 1000); } });
+    }
+    for (std::size_t peers : { 10, 1000, 100000 }) {
+        list.push_back({ "wg/set-device/" + std::to_string(peers), [peers] { return bench_set_device(peers); } });
+    }
+    list.push_back({ "wg/set-peer-endpoint", bench_set_peer_endpoint });
+    for (std::size_t count : { 10, 1000 }) {
+        list.push_back({ "wg/set-peer-endpoints/" + std::to_string(count), [count] { return bench_set_peer_endpoints(count); } });
+    }
+    for (std::size_t answers : { 16, 250 }) {
+        list.push_back({ "dns/resolve/" + std::to_string(answers) + "-answers", [answers] { return bench_dns_resolve(answers); } });
+    }
+    list.push_back({ "dns/result-dedup/250-answers", [] { return bench_dns_result(250); } });
+    for (std::size_t peers : { 10, 1000 }) {
+        list.push_back({ "cycle/" + std::to_string(peers) + "/steady", [peers] { return bench_cycle(peers, false, 0); } });
+        list.push_back({ "cycle/" + std::to_string(peers) + "/changed", [peers] { return bench_cycle(peers, true, 0); } });
+        list.push_back({ "cycle/" + std::to_string(peers) + "/resolved", [peers] { return bench_cycle(peers, false, peers); } });
+        // ten peers per hostname
+        list.push_back({ "cycle/" + std::to_string(peers) + "/shared-hostnames", [peers] { return bench_cycle(peers, false, peers / 10); } });
+    }
+    return list;
+}
+
+static void usage(const char *argv0)
+{
+    std::printf("Usage: %s [--filter SUBSTRING] [--min-time SECONDS] [--list]\n"
+                "  cycle/* report CPU time of the daemon thread per cycle, the rest wall time per operation\n",
+        argv0);
+}
+
+int main(int argc, char **argv)
+{
+    static const option long_options[] = {
+        { "filter", required_argument, nullptr, 'f' },
+        { "min-time", required_argument, nullptr, 't' },
+        { "list", no_argument, nullptr, 'l' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 },
+    };
+    std::string filter;
+    bool list_only = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:t:lh", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'f':
+            filter = optarg;
+            break;
+        case 't':
+            min_time_s = std::atof(optarg);
+            if (min_time_s <= 0) {
+                std::fprintf(stderr, "Invalid minimum time %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'l':
+            list_only = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the daemon stops on SIGTERM. The threads it starts inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    // quiet, and written synchronously: no logger thread to count
+    async_log_set_mask(LOG_UPTO(LOG_ERR));
+
+    if (!list_only) {
+        std::printf("%-32s %14s %12s %12s\n", "benchmark", "ns/op", "allocs/op", "syscalls/op");
+    }
+    for (const Benchmark &benchmark : benchmarks()) {
+        if (!filter.empty() && benchmark.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        if (list_only) {
+            std::printf("%s\n", benchmark.name.c_str());
+            continue;
+        }
+        BenchResult result = benchmark.run();
+        std::printf("%-32s %14.0f %12.1f %12.1f\n", benchmark.name.c_str(), result.ns_per_op, result.allocs_per_op, result.syscalls_per_op);
+        std::fflush(stdout);
+    }
+    return EXIT_SUCCESS;
+}
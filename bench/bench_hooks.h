@@ -0,0 +1,41 @@
+/* Between the libc interposers of bench_syscalls.c and the rest of the benchmark.
+ * Only type headers: bench_syscalls.c defines the socket and unistd calls, and must not see their
+ * libc prototypes. */
+
+#ifndef BENCH_HOOKS_H
+#define BENCH_HOOKS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct bench_counters {
+	uint64_t allocations;
+	uint64_t syscalls;
+};
+
+/* totals since start, of every thread but the ignored ones */
+void bench_counters_read(struct bench_counters *counters);
+/* for helper threads such as the DNS stub, whose work isn't the one measured */
+void bench_counters_ignore_thread(void);
+
+/* the fake kernel of bench_wg.c. A fake socket is a real AF_UNIX one nobody reads */
+bool bench_fake_socket(int domain, int protocol, int *fd);
+bool bench_fake_owns(int fd);
+ssize_t bench_fake_sendto(int fd, const void *buf, size_t len);
+ssize_t bench_fake_recvmsg(int fd, void *msg);
+/* if the first fd is a fake socket, answers for every fd of the poll set as if none were real */
+bool bench_fake_poll(void *fds, unsigned long count, int *ready);
+int bench_fake_getsockname(int fd, void *addr, unsigned int *addr_len);
+void bench_fake_close(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,209 @@
+/* Counts the allocations and the system calls of the benchmark by interposing the libc
+ * entry points, and routes the sockets of the fake kernel to bench_wg.c.
+ *
+ * The definitions here take the place of the libc ones for every object of the executable.
+ * Calls libc makes internally aren't seen, so syscalls/op is a lower bound. The prototypes
+ * are ABI compatible stand-ins, hence no socket or unistd header. */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+
+#include "bench_hooks.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static uint64_t allocations;
+static uint64_t syscalls;
+static __thread bool ignored;
+
+void bench_counters_read(struct bench_counters *counters)
+{
+	counters->allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+	counters->syscalls = __atomic_load_n(&syscalls, __ATOMIC_RELAXED);
+}
+
+void bench_counters_ignore_thread(void)
+{
+	ignored = true;
+}
+
+static void count_allocation(void)
+{
+	if (!ignored)
+		__atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+}
+
+static void count_syscall(void)
+{
+	if (!ignored)
+		__atomic_fetch_add(&syscalls, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	count_allocation();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	count_allocation();
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	count_allocation();
+	return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	count_allocation();
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+	void *ret;
+
+	count_allocation();
+	ret = __libc_memalign(alignment, size);
+	if (!ret)
+		return ENOMEM;
+	*ptr = ret;
+	return 0;
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+static void *next_symbol(void **cache, const char *name)
+{
+	void *fn = __atomic_load_n(cache, __ATOMIC_RELAXED);
+
+	if (!fn) {
+		fn = dlsym(RTLD_NEXT, name);
+		__atomic_store_n(cache, fn, __ATOMIC_RELAXED);
+	}
+	return fn;
+}
+
+#define NEXT(name, type) ((type)next_symbol(&next_##name, #name))
+
+#define FORWARD(ret, name, params, args) \
+	static void *next_##name; \
+	ret name params \
+	{ \
+		count_syscall(); \
+		return NEXT(name, ret (*) params) args; \
+	}
+
+FORWARD(ssize_t, read, (int fd, void *buf, size_t len), (fd, buf, len))
+FORWARD(ssize_t, write, (int fd, const void *buf, size_t len), (fd, buf, len))
+FORWARD(int, connect, (int fd, const void *addr, unsigned int addr_len), (fd, addr, addr_len))
+FORWARD(int, setsockopt, (int fd, int level, int name, const void *value, unsigned int len), (fd, level, name, value, len))
+FORWARD(ssize_t, send, (int fd, const void *buf, size_t len, int flags), (fd, buf, len, flags))
+FORWARD(ssize_t, sendmsg, (int fd, const void *msg, int flags), (fd, msg, flags))
+FORWARD(ssize_t, recv, (int fd, void *buf, size_t len, int flags), (fd, buf, len, flags))
+FORWARD(ssize_t, recvfrom, (int fd, void *buf, size_t len, int flags, void *addr, unsigned int *addr_len), (fd, buf, len, flags, addr, addr_len))
+FORWARD(int, accept4, (int fd, void *addr, unsigned int *addr_len, int flags), (fd, addr, addr_len, flags))
+FORWARD(int, epoll_create1, (int flags), (flags))
+FORWARD(int, epoll_ctl, (int epfd, int op, int fd, void *event), (epfd, op, fd, event))
+FORWARD(int, epoll_wait, (int epfd, void *events, int count, int timeout), (epfd, events, count, timeout))
+FORWARD(int, timerfd_create, (int clock, int flags), (clock, flags))
+FORWARD(int, timerfd_settime, (int fd, int flags, const void *value, void *old_value), (fd, flags, value, old_value))
+FORWARD(int, signalfd, (int fd, const void *mask, int flags), (fd, mask, flags))
+FORWARD(int, eventfd, (unsigned int count, int flags), (count, flags))
+
+/* _FORTIFY_SOURCE turns some calls into these */
+static void *next___read_chk, *next___recv_chk, *next___recvfrom_chk;
+
+ssize_t __read_chk(int fd, void *buf, size_t len, size_t buf_len)
+{
+	count_syscall();
+	return NEXT(__read_chk, ssize_t (*)(int, void *, size_t, size_t))(fd, buf, len, buf_len);
+}
+
+ssize_t __recv_chk(int fd, void *buf, size_t len, size_t buf_len, int flags)
+{
+	count_syscall();
+	return NEXT(__recv_chk, ssize_t (*)(int, void *, size_t, size_t, int))(fd, buf, len, buf_len, flags);
+}
+
+ssize_t __recvfrom_chk(int fd, void *buf, size_t len, size_t buf_len, int flags, void *addr, unsigned int *addr_len)
+{
+	count_syscall();
+	return NEXT(__recvfrom_chk, ssize_t (*)(int, void *, size_t, size_t, int, void *, unsigned int *))(fd, buf, len, buf_len, flags, addr, addr_len);
+}
+
+/* the calls of the netlink sockets of wireguard.c */
+static void *next_socket, *next_bind, *next_getsockname, *next_sendto, *next_recvmsg, *next_poll, *next_close;
+
+int socket(int domain, int type, int protocol)
+{
+	int fd;
+
+	count_syscall();
+	if (bench_fake_socket(domain, protocol, &fd))
+		return fd;
+	return NEXT(socket, int (*)(int, int, int))(domain, type, protocol);
+}
+
+int bind(int fd, const void *addr, unsigned int addr_len)
+{
+	count_syscall();
+	if (bench_fake_owns(fd))
+		return 0;
+	return NEXT(bind, int (*)(int, const void *, unsigned int))(fd, addr, addr_len);
+}
+
+int getsockname(int fd, void *addr, unsigned int *addr_len)
+{
+	count_syscall();
+	if (bench_fake_owns(fd))
+		return bench_fake_getsockname(fd, addr, addr_len);
+	return NEXT(getsockname, int (*)(int, void *, unsigned int *))(fd, addr, addr_len);
+}
+
+ssize_t sendto(int fd, const void *buf, size_t len, int flags, const void *addr, unsigned int addr_len)
+{
+	count_syscall();
+	if (bench_fake_owns(fd))
+		return bench_fake_sendto(fd, buf, len);
+	return NEXT(sendto, ssize_t (*)(int, const void *, size_t, int, const void *, unsigned int))(fd, buf, len, flags, addr, addr_len);
+}
+
+ssize_t recvmsg(int fd, void *msg, int flags)
+{
+	count_syscall();
+	if (bench_fake_owns(fd))
+		return bench_fake_recvmsg(fd, msg);
+	return NEXT(recvmsg, ssize_t (*)(int, void *, int))(fd, msg, flags);
+}
+
+int poll(void *fds, unsigned long count, int timeout)
+{
+	int ready;
+
+	count_syscall();
+	if (bench_fake_poll(fds, count, &ready))
+		return ready;
+	return NEXT(poll, int (*)(void *, unsigned long, int))(fds, count, timeout);
+}
+
+int close(int fd)
+{
+	count_syscall();
+	if (bench_fake_owns(fd))
+		bench_fake_close(fd);
+	return NEXT(close, int (*)(int))(fd);
+}
@@ -0,0 +1,547 @@
+/* Built with wireguard.c itself, so its static parsers and the mnl helpers can be driven
+ * directly. The benchmark links this instead of wireguard.c. */
+
+#include "../wireguard.c"
+
+#include "bench_hooks.h"
+#include "bench_wg.h"
+
+/* any ID above GENL_MIN_ID that the controller would hand out */
+#define BENCH_FAMILY_ID (GENL_MIN_ID + 16)
+#define BENCH_MAX_DEVICES 16
+#define BENCH_MAX_SOCKETS 16
+/* replies queued on a socket, enough for a dump of a few hundred thousand peers */
+#define BENCH_MAX_REPLIES 16384
+#define BENCH_SMALL_REPLY 64
+
+struct bench_dump {
+	char name[IFNAMSIZ];
+	size_t count;
+	size_t capacity;
+	void **messages;
+	size_t *lengths;
+	size_t bytes;
+};
+
+void bench_peer_key(size_t index, wg_key key)
+{
+	size_t i;
+
+	/* distinct, and spread over the whole key like real ones */
+	for (i = 0; i < sizeof(wg_key); ++i)
+		key[i] = (uint8_t)((index >> ((i % 8) * 8)) ^ (i * 0x9d));
+}
+
+static int dump_append(struct bench_dump *dump, const struct nlmsghdr *nlh)
+{
+	void *copy;
+
+	if (dump->count == dump->capacity) {
+		size_t capacity = dump->capacity ? dump->capacity * 2 : 64;
+		void **messages = realloc(dump->messages, capacity * sizeof(*messages));
+		size_t *lengths;
+
+		if (!messages)
+			return -ENOMEM;
+		dump->messages = messages;
+		lengths = realloc(dump->lengths, capacity * sizeof(*lengths));
+		if (!lengths)
+			return -ENOMEM;
+		dump->lengths = lengths;
+		dump->capacity = capacity;
+	}
+	copy = malloc(nlh->nlmsg_len);
+	if (!copy)
+		return -ENOMEM;
+	memcpy(copy, nlh, nlh->nlmsg_len);
+	dump->messages[dump->count] = copy;
+	dump->lengths[dump->count] = nlh->nlmsg_len;
+	dump->bytes += nlh->nlmsg_len;
+	++dump->count;
+	return 0;
+}
+
+static struct nlmsghdr *dump_message_start(void *buf, const char *name, bool first)
+{
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	struct genlmsghdr *genl;
+	wg_key key;
+
+	nlh->nlmsg_type = BENCH_FAMILY_ID;
+	nlh->nlmsg_flags = NLM_F_MULTI;
+	genl = mnl_nlmsg_put_extra_header(nlh, sizeof(struct genlmsghdr));
+	genl->cmd = WG_CMD_GET_DEVICE;
+	genl->version = WG_GENL_VERSION;
+	mnl_attr_put_u32(nlh, WGDEVICE_A_IFINDEX, 1000);
+	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, name);
+	if (first) {
+		memset(key, 0x42, sizeof(key));
+		mnl_attr_put(nlh, WGDEVICE_A_PRIVATE_KEY, sizeof(key), key);
+		mnl_attr_put(nlh, WGDEVICE_A_PUBLIC_KEY, sizeof(key), key);
+		mnl_attr_put_u16(nlh, WGDEVICE_A_LISTEN_PORT, 51820);
+		mnl_attr_put_u32(nlh, WGDEVICE_A_FWMARK, 0);
+	}
+	return nlh;
+}
+
+/* false if the peer doesn't fit the message */
+static bool dump_put_peer(struct nlmsghdr *nlh, size_t index, const struct sockaddr *endpoint)
+{
+	size_t size = mnl_ideal_socket_buffer_size();
+	struct nlattr *peer_nest, *allowedips_nest, *allowedip_nest;
+	struct timespec64 handshake = { .tv_sec = 1600000000 + (int64_t)index };
+	uint64_t rx = index * 1000, tx = index * 2000;
+	struct in_addr ip4 = { .s_addr = htonl(0x0a000000 | (uint32_t)index) };
+	struct in6_addr ip6 = { .s6_addr = { 0xfd } };
+	wg_key key, preshared = { 0 };
+
+	bench_peer_key(index, key);
+	memcpy(&ip6.s6_addr[12], &ip4, sizeof(ip4));
+	peer_nest = mnl_attr_nest_start_check(nlh, size, 0);
+	if (!peer_nest)
+		return false;
+	if (!mnl_attr_put_check(nlh, size, WGPEER_A_PUBLIC_KEY, sizeof(key), key) ||
+	    !mnl_attr_put_check(nlh, size, WGPEER_A_PRESHARED_KEY, sizeof(preshared), preshared) ||
+	    !mnl_attr_put_check(nlh, size, WGPEER_A_ENDPOINT, endpoint->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6), endpoint) ||
+	    !mnl_attr_put_u16_check(nlh, size, WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL, 25) ||
+	    !mnl_attr_put_check(nlh, size, WGPEER_A_LAST_HANDSHAKE_TIME, sizeof(handshake), &handshake) ||
+	    !mnl_attr_put_check(nlh, size, WGPEER_A_RX_BYTES, sizeof(rx), &rx) ||
+	    !mnl_attr_put_check(nlh, size, WGPEER_A_TX_BYTES, sizeof(tx), &tx) ||
+	    !mnl_attr_put_u32_check(nlh, size, WGPEER_A_PROTOCOL_VERSION, 1))
+		goto toobig;
+	allowedips_nest = mnl_attr_nest_start_check(nlh, size, WGPEER_A_ALLOWEDIPS);
+	if (!allowedips_nest)
+		goto toobig;
+	allowedip_nest = mnl_attr_nest_start_check(nlh, size, 0);
+	if (!allowedip_nest ||
+	    !mnl_attr_put_u16_check(nlh, size, WGALLOWEDIP_A_FAMILY, AF_INET) ||
+	    !mnl_attr_put_check(nlh, size, WGALLOWEDIP_A_IPADDR, sizeof(ip4), &ip4) ||
+	    !mnl_attr_put_u8_check(nlh, size, WGALLOWEDIP_A_CIDR_MASK, 32))
+		goto toobig;
+	mnl_attr_nest_end(nlh, allowedip_nest);
+	allowedip_nest = mnl_attr_nest_start_check(nlh, size, 0);
+	if (!allowedip_nest ||
+	    !mnl_attr_put_u16_check(nlh, size, WGALLOWEDIP_A_FAMILY, AF_INET6) ||
+	    !mnl_attr_put_check(nlh, size, WGALLOWEDIP_A_IPADDR, sizeof(ip6), &ip6) ||
+	    !mnl_attr_put_u8_check(nlh, size, WGALLOWEDIP_A_CIDR_MASK, 128))
+		goto toobig;
+	mnl_attr_nest_end(nlh, allowedip_nest);
+	mnl_attr_nest_end(nlh, allowedips_nest);
+	mnl_attr_nest_end(nlh, peer_nest);
+	return true;
+
+toobig:
+	mnl_attr_nest_cancel(nlh, peer_nest);
+	return false;
+}
+
+struct bench_dump *bench_dump_build(const char *device_name, size_t peer_count, const struct sockaddr *endpoint)
+{
+	struct bench_dump *dump = calloc(1, sizeof(*dump));
+	void *buf = malloc(mnl_ideal_socket_buffer_size());
+	struct nlmsghdr *nlh;
+	struct nlattr *peers_nest;
+	size_t index = 0;
+	bool first = true;
+
+	if (!dump || !buf)
+		goto err;
+	strncpy(dump->name, device_name, sizeof(dump->name) - 1);
+
+	do {
+		nlh = dump_message_start(buf, device_name, first);
+		first = false;
+		if (index < peer_count) {
+			peers_nest = mnl_attr_nest_start(nlh, WGDEVICE_A_PEERS);
+			while (index < peer_count && dump_put_peer(nlh, index, endpoint))
+				++index;
+			mnl_attr_nest_end(nlh, peers_nest);
+		}
+		if (dump_append(dump, nlh))
+			goto err;
+	} while (index < peer_count);
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = NLMSG_DONE;
+	nlh->nlmsg_flags = NLM_F_MULTI;
+	*(int *)mnl_nlmsg_put_extra_header(nlh, sizeof(int)) = 0;
+	if (dump_append(dump, nlh))
+		goto err;
+	free(buf);
+	return dump;
+
+err:
+	free(buf);
+	bench_dump_free(dump);
+	return NULL;
+}
+
+void bench_dump_free(struct bench_dump *dump)
+{
+	size_t i;
+
+	if (!dump)
+		return;
+	for (i = 0; i < dump->count; ++i)
+		free(dump->messages[i]);
+	free(dump->messages);
+	free(dump->lengths);
+	free(dump);
+}
+
+size_t bench_dump_message_count(const struct bench_dump *dump)
+{
+	return dump->count;
+}
+
+size_t bench_dump_bytes(const struct bench_dump *dump)
+{
+	return dump->bytes;
+}
+
+static wg_device *bench_parsed;
+
+wg_device *bench_parse_dump(const struct bench_dump *dump)
+{
+	size_t i;
+
+	wg_free_device(bench_parsed);
+	bench_parsed = calloc(1, sizeof(wg_device));
+	if (!bench_parsed)
+		return NULL;
+	for (i = 0; i < dump->count; ++i) {
+		if (mnl_cb_run2(dump->messages[i], dump->lengths[i], 0, 0, read_device_cb, bench_parsed, mnlg_cb_array, MNL_ARRAY_SIZE(mnlg_cb_array)) < 0) {
+			wg_free_device(bench_parsed);
+			bench_parsed = NULL;
+			return NULL;
+		}
+	}
+	coalesce_peers(bench_parsed);
+	return bench_parsed;
+}
+
+static int count_peer(const wg_peer_status *peer, void *data)
+{
+	(void)peer;
+	++*(size_t *)data;
+	return 0;
+}
+
+int bench_scan_dump(const struct bench_dump *dump, size_t *peer_count)
+{
+	struct peer_scan scan = { .cb = count_peer, .data = peer_count };
+	size_t i;
+
+	*peer_count = 0;
+	for (i = 0; i < dump->count; ++i) {
+		if (mnl_cb_run2(dump->messages[i], dump->lengths[i], 0, 0, scan_device_cb, &scan, mnlg_cb_array, MNL_ARRAY_SIZE(mnlg_cb_array)) < 0)
+			return errno ? -errno : -EINVAL;
+	}
+	return scan.ret;
+}
+
+/* fake kernel: */
+
+struct fake_reply {
+	/* a message of a dump, or small */
+	const void *data;
+	size_t len;
+	unsigned char small[BENCH_SMALL_REPLY] __attribute__((aligned(4)));
+};
+
+struct fake_socket {
+	int fd;
+	uint32_t portid;
+	struct fake_reply *replies;
+	size_t head, tail;
+	/* a dump runs until its replies up to here are read, like the kernel's it is one at a time */
+	size_t dump_end;
+};
+
+static struct {
+	bool enabled;
+	const struct bench_dump *devices[BENCH_MAX_DEVICES];
+	size_t device_count;
+	struct fake_socket sockets[BENCH_MAX_SOCKETS];
+	struct bench_fake_kernel_stats stats;
+	void (*on_dump)(uint64_t dumps, void *data);
+	void *on_dump_data;
+} fake;
+
+void bench_fake_kernel_enable(bool enable)
+{
+	fake.enabled = enable;
+}
+
+void bench_fake_kernel_add_device(const struct bench_dump *dump)
+{
+	if (fake.device_count < BENCH_MAX_DEVICES)
+		fake.devices[fake.device_count++] = dump;
+}
+
+void bench_fake_kernel_clear(void)
+{
+	fake.device_count = 0;
+	memset(&fake.stats, 0, sizeof(fake.stats));
+	fake.on_dump = NULL;
+	fake.on_dump_data = NULL;
+}
+
+void bench_fake_kernel_stats(struct bench_fake_kernel_stats *stats)
+{
+	*stats = fake.stats;
+}
+
+void bench_fake_kernel_on_dump(void (*cb)(uint64_t dumps, void *data), void *data)
+{
+	fake.on_dump = cb;
+	fake.on_dump_data = data;
+}
+
+static struct fake_socket *fake_socket_of(int fd)
+{
+	size_t i;
+
+	for (i = 0; i < BENCH_MAX_SOCKETS; ++i) {
+		if (fake.sockets[i].replies && fake.sockets[i].fd == fd)
+			return &fake.sockets[i];
+	}
+	return NULL;
+}
+
+bool bench_fake_socket(int domain, int protocol, int *fd)
+{
+	size_t i;
+
+	if (!fake.enabled || domain != AF_NETLINK || protocol != NETLINK_GENERIC)
+		return false;
+	for (i = 0; i < BENCH_MAX_SOCKETS && fake.sockets[i].replies; ++i)
+		;
+	if (i == BENCH_MAX_SOCKETS) {
+		errno = EMFILE;
+		*fd = -1;
+		return true;
+	}
+	fake.sockets[i].replies = malloc(BENCH_MAX_REPLIES * sizeof(struct fake_reply));
+	if (!fake.sockets[i].replies) {
+		errno = ENOMEM;
+		*fd = -1;
+		return true;
+	}
+	*fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (*fd < 0) {
+		free(fake.sockets[i].replies);
+		fake.sockets[i].replies = NULL;
+		return true;
+	}
+	fake.sockets[i].fd = *fd;
+	fake.sockets[i].portid = 4000 + i;
+	fake.sockets[i].head = fake.sockets[i].tail = fake.sockets[i].dump_end = 0;
+	return true;
+}
+
+bool bench_fake_owns(int fd)
+{
+	return fake_socket_of(fd) != NULL;
+}
+
+void bench_fake_close(int fd)
+{
+	struct fake_socket *sock = fake_socket_of(fd);
+
+	free(sock->replies);
+	sock->replies = NULL;
+}
+
+int bench_fake_getsockname(int fd, void *addr, unsigned int *addr_len)
+{
+	struct sockaddr_nl nl = { .nl_family = AF_NETLINK, .nl_pid = fake_socket_of(fd)->portid };
+
+	memcpy(addr, &nl, *addr_len < sizeof(nl) ? *addr_len : sizeof(nl));
+	*addr_len = sizeof(nl);
+	return 0;
+}
+
+static struct nlmsghdr *queue_small(struct fake_socket *sock, const struct nlmsghdr *request, uint16_t type)
+{
+	struct fake_reply *reply;
+	struct nlmsghdr *nlh;
+
+	if (sock->tail - sock->head == BENCH_MAX_REPLIES)
+		return NULL;
+	reply = &sock->replies[sock->tail++ % BENCH_MAX_REPLIES];
+	nlh = mnl_nlmsg_put_header(reply->small);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_seq = request->nlmsg_seq;
+	nlh->nlmsg_pid = sock->portid;
+	reply->data = reply->small;
+	return nlh;
+}
+
+/* call once the message is complete */
+static void queue_small_done(struct fake_socket *sock, const struct nlmsghdr *nlh)
+{
+	sock->replies[(sock->tail - 1) % BENCH_MAX_REPLIES].len = nlh->nlmsg_len;
+	assert(nlh->nlmsg_len <= BENCH_SMALL_REPLY);
+}
+
+static void queue_ack(struct fake_socket *sock, const struct nlmsghdr *request, int error)
+{
+	struct nlmsghdr *nlh = queue_small(sock, request, NLMSG_ERROR);
+	struct nlmsgerr *err;
+
+	if (!nlh)
+		return;
+	err = mnl_nlmsg_put_extra_header(nlh, sizeof(*err));
+	err->error = error;
+	err->msg = *request;
+	queue_small_done(sock, nlh);
+}
+
+static const struct bench_dump *find_device(const struct nlmsghdr *request)
+{
+	const struct nlattr *attr;
+	size_t i;
+
+	mnl_attr_for_each(attr, request, sizeof(struct genlmsghdr)) {
+		if (mnl_attr_get_type(attr) != WGDEVICE_A_IFNAME)
+			continue;
+		for (i = 0; i < fake.device_count; ++i) {
+			if (!strcmp(fake.devices[i]->name, mnl_attr_get_str(attr)))
+				return fake.devices[i];
+		}
+	}
+	return NULL;
+}
+
+static size_t count_set_peers(const struct nlmsghdr *request)
+{
+	const struct nlattr *attr, *peer;
+	size_t count = 0;
+
+	mnl_attr_for_each(attr, request, sizeof(struct genlmsghdr)) {
+		if (mnl_attr_get_type(attr) != WGDEVICE_A_PEERS)
+			continue;
+		mnl_attr_for_each_nested(peer, attr)
+			++count;
+	}
+	return count;
+}
+
+ssize_t bench_fake_sendto(int fd, const void *buf, size_t len)
+{
+	struct fake_socket *sock = fake_socket_of(fd);
+	const struct nlmsghdr *request = buf;
+	const struct genlmsghdr *genl;
+	const struct bench_dump *dump;
+	struct nlmsghdr *nlh;
+	size_t i;
+
+	if (len < NLMSG_HDRLEN + sizeof(*genl) || request->nlmsg_len > len) {
+		errno = EINVAL;
+		return -1;
+	}
+	genl = mnl_nlmsg_get_payload(request);
+
+	if (request->nlmsg_type == GENL_ID_CTRL && genl->cmd == CTRL_CMD_GETFAMILY) {
+		nlh = queue_small(sock, request, GENL_ID_CTRL);
+		if (nlh) {
+			struct genlmsghdr *reply = mnl_nlmsg_put_extra_header(nlh, sizeof(*reply));
+
+			reply->cmd = CTRL_CMD_NEWFAMILY;
+			mnl_attr_put_u16(nlh, CTRL_ATTR_FAMILY_ID, BENCH_FAMILY_ID);
+			queue_small_done(sock, nlh);
+		}
+		queue_ack(sock, request, 0);
+		return len;
+	}
+	if (request->nlmsg_type != BENCH_FAMILY_ID) {
+		queue_ack(sock, request, -EOPNOTSUPP);
+		return len;
+	}
+
+	dump = find_device(request);
+	if (!dump) {
+		queue_ack(sock, request, -ENODEV);
+		return len;
+	}
+	if (genl->cmd == WG_CMD_SET_DEVICE) {
+		++fake.stats.sets;
+		fake.stats.set_peers += count_set_peers(request);
+		fake.stats.set_bytes += request->nlmsg_len;
+		queue_ack(sock, request, 0);
+		return len;
+	}
+	if (genl->cmd != WG_CMD_GET_DEVICE) {
+		queue_ack(sock, request, -EOPNOTSUPP);
+		return len;
+	}
+
+	if (sock->head < sock->dump_end) {
+		queue_ack(sock, request, -EBUSY);
+		return len;
+	}
+	++fake.stats.dumps;
+	if (fake.on_dump)
+		fake.on_dump(fake.stats.dumps, fake.on_dump_data);
+	/* seq and portid 0 pass any check, so the messages are served as they are */
+	for (i = 0; i < dump->count && sock->tail - sock->head < BENCH_MAX_REPLIES; ++i) {
+		struct fake_reply *reply = &sock->replies[sock->tail++ % BENCH_MAX_REPLIES];
+
+		reply->data = dump->messages[i];
+		reply->len = dump->lengths[i];
+	}
+	sock->dump_end = sock->tail;
+	return len;
+}
+
+bool bench_fake_poll(void *fds_ptr, unsigned long count, int *ready)
+{
+	struct pollfd *fds = fds_ptr;
+	struct fake_socket *sock;
+	unsigned long i;
+
+	if (!count || !bench_fake_owns(fds[0].fd))
+		return false;
+	*ready = 0;
+	for (i = 0; i < count; ++i) {
+		sock = fake_socket_of(fds[i].fd);
+		fds[i].revents = sock && sock->head != sock->tail ? (fds[i].events & POLLIN) : 0;
+		if (fds[i].revents)
+			++*ready;
+	}
+	if (!*ready) {
+		/* a real poll would block forever */
+		errno = EAGAIN;
+		*ready = -1;
+	}
+	return true;
+}
+
+ssize_t bench_fake_recvmsg(int fd, void *msg_ptr)
+{
+	struct fake_socket *sock = fake_socket_of(fd);
+	struct msghdr *msg = msg_ptr;
+	const struct fake_reply *reply;
+	struct sockaddr_nl from = { .nl_family = AF_NETLINK };
+	size_t len;
+
+	if (sock->head == sock->tail) {
+		/* a real socket would block forever */
+		errno = EAGAIN;
+		return -1;
+	}
+	reply = &sock->replies[sock->head++ % BENCH_MAX_REPLIES];
+	len = reply->len;
+	msg->msg_flags = 0;
+	if (len > msg->msg_iov[0].iov_len) {
+		len = msg->msg_iov[0].iov_len;
+		msg->msg_flags |= MSG_TRUNC;
+	}
+	memcpy(msg->msg_iov[0].iov_base, reply->data, len);
+	if (msg->msg_name) {
+		memcpy(msg->msg_name, &from, msg->msg_namelen < sizeof(from) ? msg->msg_namelen : sizeof(from));
+		msg->msg_namelen = sizeof(from);
+	}
+	return len;
+}
@@ -0,0 +1,58 @@
+/* Synthetic WireGuard netlink traffic for the benchmark: captured dumps, the parsers of
+ * wireguard.c run over them, and a fake genetlink kernel serving them to wg_nl_*. */
+
+#ifndef BENCH_WG_H
+#define BENCH_WG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wireguard.h"
+
+/* A WG_CMD_GET_DEVICE dump of one device, as the kernel sends it: messages filled with as many
+ * peers as fit, then NLMSG_DONE. Peer i has bench_peer_key(i), the endpoint and two allowed IPs. */
+struct bench_dump;
+
+struct bench_dump *bench_dump_build(const char *device_name, size_t peer_count, const struct sockaddr *endpoint);
+void bench_dump_free(struct bench_dump *dump);
+size_t bench_dump_message_count(const struct bench_dump *dump);
+size_t bench_dump_bytes(const struct bench_dump *dump);
+void bench_peer_key(size_t index, wg_key key);
+
+/* parse_device() and parse_peer() over the dump, as wg_get_device() runs them. The device
+ * lives until the next call, which frees it. NULL on failure */
+wg_device *bench_parse_dump(const struct bench_dump *dump);
+/* the scan of wg_nl_scan_peers() over the dump, visiting every peer.
+ * @return 0 or negative errno */
+int bench_scan_dump(const struct bench_dump *dump, size_t *peer_count);
+
+/* While enabled, the NETLINK_GENERIC sockets wireguard.c opens talk to a fake kernel. It knows
+ * the wireguard family, dumps the devices added, and acks every SET of a known device without
+ * applying it. Meant for one thread at a time */
+void bench_fake_kernel_enable(bool enable);
+/* the dump must outlive the fake kernel */
+void bench_fake_kernel_add_device(const struct bench_dump *dump);
+void bench_fake_kernel_clear(void);
+
+struct bench_fake_kernel_stats {
+	uint64_t dumps;
+	uint64_t sets;
+	/* peers carried by the SET messages */
+	uint64_t set_peers;
+	/* of the SET messages, for the serialization */
+	uint64_t set_bytes;
+};
+
+void bench_fake_kernel_stats(struct bench_fake_kernel_stats *stats);
+/* called on the thread of wg_nl_* at each dump request */
+void bench_fake_kernel_on_dump(void (*cb)(uint64_t dumps, void *data), void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,508 @@
+// A DNS server on loopback answering from a trace, to replay DNS changes against the daemon
+// pointed at it with --nameserver. Each line of the trace takes effect at its time after start:
+//
+//     # at_ms  name        answer                      [ttl=S] [delay=MS] [tc]
+//     0        a.example   192.0.2.1,2001:db8::1       ttl=30
+//     5000     a.example   192.0.2.2                   ttl=30 delay=200
+//     9000     a.example   servfail
+//     12000    *           nxdomain                    ttl=5
+//
+// The answer is addresses, nodata, nxdomain, servfail, refused, or drop for no response at all.
+// A name is matched case insensitively, * matches any name. The latest line in effect wins,
+// names without one are refused. tc sets TC and cuts the message in the middle of the answers.
+// Every query is printed with its time and outcome, for convergence to be read off.
+//
+// With --echo port, the stub also answers the UDP probes of the daemon (--probe udp:port) on the
+// addresses named by the trace, so they can be served from loopback with scripted RTTs:
+//
+//     0        127.0.0.2   echo                        delay=40
+//     0        127.0.0.3   echo                        delay=5
+//     8000     127.0.0.3   drop
+
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "dns.h"
+
+static const std::uint16_t dns_type_a = 1;
+static const std::uint16_t dns_type_soa = 6;
+static const std::uint16_t dns_type_aaaa = 28;
+
+enum class StubAnswer {
+    Addresses,
+    NoData,
+    NxDomain,
+    ServFail,
+    Refused,
+    Drop,
+    // a probe datagram, sent back
+    Echo,
+};
+
+struct TraceEntry {
+    std::uint64_t at_ms;
+    // lower case without trailing dot, or *
+    std::string name;
+    StubAnswer answer;
+    std::vector<sockaddr_storage> addresses;
+    std::uint32_t ttl;
+    std::uint64_t delay_ms;
+    bool truncate;
+};
+
+struct PendingReply {
+    int fd;
+    std::chrono::steady_clock::time_point due;
+    sockaddr_storage to;
+    socklen_t to_len;
+    std::vector<std::uint8_t> message;
+};
+
+static std::string normalize_name(std::string name)
+{
+    if (!name.empty() && name.back() == '.') {
+        name.pop_back();
+    }
+    std::transform(name.begin(), name.end(), name.begin(), [](char c) { return std::tolower(static_cast<unsigned char>(c)); });
+    return name;
+}
+
+static bool parse_u64(const std::string &str, std::uint64_t &value)
+{
+    char *end = nullptr;
+    value = std::strtoull(str.c_str(), &end, 10);
+    return !str.empty() && str[0] != '-' && *end == '\0';
+}
+
+/// @return 0 or -EINVAL, after telling which line is wrong
+static int load_trace(const char *path, std::vector<TraceEntry> &trace)
+{
+    std::ifstream file(path);
+    if (!file) {
+        std::fprintf(stderr, "%s: %s\n", path, std::strerror(errno));
+        return -errno;
+    }
+
+    std::string line;
+    for (int line_no = 1; std::getline(file, line); ++line_no) {
+        std::size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+        std::istringstream iss(line);
+        std::string at;
+        std::string name;
+        std::string answer;
+        if (!(iss >> at)) {
+            continue;
+        }
+
+        TraceEntry entry { 0, {}, StubAnswer::Addresses, {}, 60, 0, false };
+        bool valid = parse_u64(at, entry.at_ms) && iss >> name >> answer;
+        entry.name = normalize_name(name);
+        if (answer == "nodata") {
+            entry.answer = StubAnswer::NoData;
+        } else if (answer == "nxdomain") {
+            entry.answer = StubAnswer::NxDomain;
+        } else if (answer == "servfail") {
+            entry.answer = StubAnswer::ServFail;
+        } else if (answer == "refused") {
+            entry.answer = StubAnswer::Refused;
+        } else if (answer == "drop") {
+            entry.answer = StubAnswer::Drop;
+        } else if (answer == "echo") {
+            sockaddr_storage addr;
+            valid = valid && parse_ip_literal(entry.name, addr);
+            entry.answer = StubAnswer::Echo;
+        } else {
+            std::istringstream addresses(answer);
+            std::string address;
+            while (valid && std::getline(addresses, address, ',')) {
+                sockaddr_storage addr;
+                valid = parse_ip_literal(address, addr);
+                entry.addresses.push_back(addr);
+            }
+        }
+
+        std::string modifier;
+        while (valid && iss >> modifier) {
+            std::uint64_t value;
+            if (modifier.compare(0, 4, "ttl=") == 0 && parse_u64(modifier.substr(4), value) && value <= INT32_MAX) {
+                entry.ttl = static_cast<std::uint32_t>(value);
+            } else if (modifier.compare(0, 6, "delay=") == 0 && parse_u64(modifier.substr(6), value)) {
+                entry.delay_ms = value;
+            } else if (modifier == "tc") {
+                entry.truncate = true;
+            } else {
+                valid = false;
+            }
+        }
+        if (!valid) {
+            std::fprintf(stderr, "%s:%d: invalid entry\n", path, line_no);
+            return -EINVAL;
+        }
+        trace.push_back(entry);
+    }
+    // in effect order, stable for lines of the same time
+    std::stable_sort(trace.begin(), trace.end(), [](const TraceEntry &a, const TraceEntry &b) { return a.at_ms < b.at_ms; });
+    return 0;
+}
+
+/// @param wildcard whether * matches, not for the addresses of echo lines
+static const TraceEntry *find_entry(const std::vector<TraceEntry> &trace, std::uint64_t now_ms, const std::string &name, bool wildcard = true)
+{
+    const TraceEntry *found = nullptr;
+    for (const TraceEntry &entry : trace) {
+        if (entry.at_ms > now_ms) {
+            break;
+        }
+        if (entry.name == name || (wildcard && entry.name == "*")) {
+            found = &entry;
+        }
+    }
+    return found;
+}
+
+static void put_u16(std::vector<std::uint8_t> &message, std::uint16_t value)
+{
+    message.push_back(value >> 8);
+    message.push_back(value & 0xff);
+}
+
+static void put_u32(std::vector<std::uint8_t> &message, std::uint32_t value)
+{
+    put_u16(message, value >> 16);
+    put_u16(message, value & 0xffff);
+}
+
+// owner is the question name, at offset 12
+static void put_record_header(std::vector<std::uint8_t> &message, std::uint16_t type, std::uint32_t ttl, std::uint16_t rdlength)
+{
+    put_u16(message, 0xc00c);
+    put_u16(message, type);
+    put_u16(message, 1);
+    put_u32(message, ttl);
+    put_u16(message, rdlength);
+}
+
+/// @param question_end the query is copied back up to the end of its question
+/// @param outcome what was answered, for the log
+static void build_reply(const std::uint8_t *query, std::size_t question_end, std::uint16_t qtype, const TraceEntry *entry,
+    std::vector<std::uint8_t> &message, std::string &outcome)
+{
+    message.assign(query, query + question_end);
+    // QR, RD as asked, RA
+    message[2] = 0x80 | (query[2] & 0x01);
+    message[3] = 0x80;
+    // ANCOUNT, NSCOUNT, ARCOUNT
+    std::fill(message.begin() + 6, message.begin() + 12, 0);
+
+    std::uint8_t rcode = 0;
+    if (!entry || entry->answer == StubAnswer::Refused) {
+        rcode = 5;
+        outcome = "REFUSED";
+    } else if (entry->answer == StubAnswer::ServFail) {
+        rcode = 2;
+        outcome = "SERVFAIL";
+    } else if (entry->answer == StubAnswer::NxDomain) {
+        rcode = 3;
+        outcome = "NXDOMAIN";
+    }
+    message[3] |= rcode;
+    if (rcode == 5 || rcode == 2) {
+        return;
+    }
+
+    std::size_t answer_start = message.size();
+    std::uint16_t ancount = 0;
+    if (entry->answer == StubAnswer::Addresses) {
+        int family = qtype == dns_type_a ? AF_INET : AF_INET6;
+        for (const sockaddr_storage &addr : entry->addresses) {
+            if (addr.ss_family != family || (qtype != dns_type_a && qtype != dns_type_aaaa)) {
+                continue;
+            }
+            char str[INET6_ADDRSTRLEN];
+            if (family == AF_INET) {
+                const in_addr &addr4 = reinterpret_cast<const sockaddr_in &>(addr).sin_addr;
+                put_record_header(message, dns_type_a, entry->ttl, sizeof(addr4));
+                message.insert(message.end(), reinterpret_cast<const std::uint8_t *>(&addr4), reinterpret_cast<const std::uint8_t *>(&addr4 + 1));
+                inet_ntop(AF_INET, &addr4, str, sizeof(str));
+            } else {
+                const in6_addr &addr6 = reinterpret_cast<const sockaddr_in6 &>(addr).sin6_addr;
+                put_record_header(message, dns_type_aaaa, entry->ttl, sizeof(addr6));
+                message.insert(message.end(), reinterpret_cast<const std::uint8_t *>(&addr6), reinterpret_cast<const std::uint8_t *>(&addr6 + 1));
+                inet_ntop(AF_INET6, &addr6, str, sizeof(str));
+            }
+            outcome += outcome.empty() ? str : std::string(" ") + str;
+            ++ancount;
+        }
+    }
+    message[6] = ancount >> 8;
+    message[7] = ancount & 0xff;
+
+    if (!ancount) {
+        // SOA for the negative caching TTL: root mname and rname, then serial, refresh, retry, expire, minimum
+        put_record_header(message, dns_type_soa, entry->ttl, 2 + 20);
+        message.push_back(0);
+        message.push_back(0);
+        for (std::uint32_t value : { 1U, 3600U, 600U, 86400U, entry->ttl }) {
+            put_u32(message, value);
+        }
+        message[9] = 1;
+        if (outcome.empty()) {
+            outcome = "NODATA";
+        }
+    }
+    outcome += " ttl=" + std::to_string(entry->ttl);
+
+    if (entry->truncate) {
+        message[2] |= 0x02;
+        if (ancount) {
+            // in the middle of a record past the first half
+            message.resize(answer_start + (message.size() - answer_start) / 2 + 3);
+        }
+        outcome += " TC";
+    }
+}
+
+// send a probe back from the socket it came to, after the delay of the echo line in effect for the address
+static void handle_echo(int fd, const std::string &name, const std::vector<TraceEntry> &trace, std::uint64_t now_ms,
+    std::chrono::steady_clock::time_point now, std::vector<PendingReply> &pending, bool quiet)
+{
+    std::uint8_t probe[512];
+    sockaddr_storage from;
+    socklen_t from_len = sizeof(from);
+    ssize_t len = recvfrom(fd, probe, sizeof(probe), 0, reinterpret_cast<sockaddr *>(&from), &from_len);
+    if (len < 0) {
+        return;
+    }
+    const TraceEntry *entry = find_entry(trace, now_ms, name, false);
+    std::string outcome = "dropped";
+    if (entry && entry->answer == StubAnswer::Echo) {
+        PendingReply reply { fd, now + std::chrono::milliseconds(entry->delay_ms), from, from_len, std::vector<std::uint8_t>(probe, probe + len) };
+        if (entry->delay_ms) {
+            outcome = "echoed after " + std::to_string(entry->delay_ms) + " ms";
+            pending.push_back(reply);
+        } else {
+            outcome = "echoed";
+            sendto(fd, probe, len, 0, reinterpret_cast<const sockaddr *>(&from), from_len);
+        }
+    }
+    if (!quiet) {
+        std::printf("%10.3f %-4s %s -> %s\n", now_ms / 1000.0, "ECHO", name.c_str(), outcome.c_str());
+        std::fflush(stdout);
+    }
+}
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int)
+{
+    stopping = 1;
+}
+
+static void usage(const char *me)
+{
+    std::fprintf(stderr, "Usage: %s [-l address] [-e port] [-q] trace\n"
+                         "   -l, --listen    ip:port or [ip6]:port, default 127.0.0.1:5353\n"
+                         "   -e, --echo      echo UDP probes on this port of the addresses of the trace\n"
+                         "   -q, --quiet     don't print the queries\n"
+                         "See the head of bench/dns_stub.cpp for the trace format\n",
+        me);
+}
+
+int main(int argc, char **argv)
+{
+    static const option long_options[] = {
+        { "listen", required_argument, nullptr, 'l' },
+        { "echo", required_argument, nullptr, 'e' },
+        { "quiet", no_argument, nullptr, 'q' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 },
+    };
+    std::string listen_address = "127.0.0.1:5353";
+    std::uint64_t echo_port = 0;
+    bool quiet = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "l:e:qh", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'l':
+            listen_address = optarg;
+            break;
+        case 'e':
+            if (!parse_u64(optarg, echo_port) || echo_port == 0 || echo_port > 65535) {
+                std::fprintf(stderr, "%s is not a valid port\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<TraceEntry> trace;
+    if (load_trace(argv[optind], trace) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    // the address forms of the name servers of the daemon
+    DnsResolver parser(0);
+    if (parser.add_nameserver(listen_address) < 0) {
+        std::fprintf(stderr, "%s is not a valid address\n", listen_address.c_str());
+        return EXIT_FAILURE;
+    }
+    const sockaddr_storage &addr = parser.nameservers().front();
+    socklen_t addr_len = addr.ss_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+    int fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, reinterpret_cast<const sockaddr *>(&addr), addr_len) < 0) {
+        std::fprintf(stderr, "%s: %s\n", listen_address.c_str(), std::strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // an echo socket per address of the trace, and the name it goes by there
+    std::vector<pollfd> pfds { { fd, POLLIN, 0 } };
+    std::vector<std::string> echo_names { {} };
+    for (const TraceEntry &entry : trace) {
+        sockaddr_storage echo_addr;
+        if (!echo_port || !parse_ip_literal(entry.name, echo_addr)
+            || std::find(echo_names.begin(), echo_names.end(), entry.name) != echo_names.end()) {
+            continue;
+        }
+        socklen_t echo_len;
+        if (echo_addr.ss_family == AF_INET) {
+            reinterpret_cast<sockaddr_in &>(echo_addr).sin_port = htons(static_cast<std::uint16_t>(echo_port));
+            echo_len = sizeof(sockaddr_in);
+        } else {
+            reinterpret_cast<sockaddr_in6 &>(echo_addr).sin6_port = htons(static_cast<std::uint16_t>(echo_port));
+            echo_len = sizeof(sockaddr_in6);
+        }
+        int echo_fd = socket(echo_addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (echo_fd < 0 || bind(echo_fd, reinterpret_cast<const sockaddr *>(&echo_addr), echo_len) < 0) {
+            std::fprintf(stderr, "%s port %llu: %s\n", entry.name.c_str(), static_cast<unsigned long long>(echo_port), std::strerror(errno));
+            return EXIT_FAILURE;
+        }
+        pfds.push_back({ echo_fd, POLLIN, 0 });
+        echo_names.push_back(entry.name);
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<PendingReply> pending;
+    while (!stopping) {
+        auto now = std::chrono::steady_clock::now();
+        // send the delayed replies that are due
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->due <= now) {
+                sendto(it->fd, it->message.data(), it->message.size(), 0, reinterpret_cast<const sockaddr *>(&it->to), it->to_len);
+                it = pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        int timeout = -1;
+        for (const PendingReply &reply : pending) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(reply.due - now).count() + 1;
+            timeout = timeout < 0 ? static_cast<int>(wait) : std::min(timeout, static_cast<int>(wait));
+        }
+
+        if (poll(pfds.data(), pfds.size(), timeout) <= 0) {
+            continue;
+        }
+        for (std::size_t i = 1; i < pfds.size(); ++i) {
+            if (pfds[i].revents & POLLIN) {
+                now = std::chrono::steady_clock::now();
+                handle_echo(pfds[i].fd, echo_names[i], trace, std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count(), now, pending, quiet);
+            }
+        }
+        if (!(pfds[0].revents & POLLIN)) {
+            continue;
+        }
+        std::uint8_t query[512];
+        sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+        ssize_t len = recvfrom(fd, query, sizeof(query), 0, reinterpret_cast<sockaddr *>(&from), &from_len);
+        if (len < 12 || (query[2] & 0x80)) {
+            continue;
+        }
+
+        // the question: labels, QTYPE, QCLASS. Queries aren't compressed
+        std::string name;
+        std::size_t off = 12;
+        while (off < static_cast<std::size_t>(len) && query[off] && query[off] < 64) {
+            if (off + 1 + query[off] > static_cast<std::size_t>(len)) {
+                break;
+            }
+            if (!name.empty()) {
+                name += '.';
+            }
+            name.append(reinterpret_cast<const char *>(query + off + 1), query[off]);
+            off += 1 + query[off];
+        }
+        if (off + 5 > static_cast<std::size_t>(len) || query[off]) {
+            continue;
+        }
+        std::uint16_t qtype = query[off + 1] << 8 | query[off + 2];
+        name = normalize_name(name);
+
+        now = std::chrono::steady_clock::now();
+        std::uint64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
+        const TraceEntry *entry = find_entry(trace, now_ms, name);
+        const char *type_str = qtype == dns_type_a ? "A" : qtype == dns_type_aaaa ? "AAAA" : "?";
+
+        PendingReply reply { fd, now + std::chrono::milliseconds(entry ? entry->delay_ms : 0), from, from_len, {} };
+        std::string outcome;
+        if (entry && (entry->answer == StubAnswer::Drop || entry->answer == StubAnswer::Echo)) {
+            outcome = "dropped";
+        } else {
+            build_reply(query, off + 5, qtype, entry, reply.message, outcome);
+            if (entry && entry->delay_ms) {
+                outcome += " after " + std::to_string(entry->delay_ms) + " ms";
+                pending.push_back(reply);
+            } else {
+                sendto(fd, reply.message.data(), reply.message.size(), 0, reinterpret_cast<const sockaddr *>(&from), from_len);
+            }
+        }
+        if (!quiet) {
+            std::printf("%10.3f %-4s %s -> %s\n", now_ms / 1000.0, type_str, name.c_str(), outcome.c_str());
+            std::fflush(stdout);
+        }
+    }
+    for (const pollfd &pfd : pfds) {
+        close(pfd.fd);
+    }
+    return EXIT_SUCCESS;
+}
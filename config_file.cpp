@@ -0,0 +1,101 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "config_file.h"
+
+static bool parse_peer_line(const std::string &line, IPVersionPreference default_preference, PeerConfig &peer, std::string &error)
+{
+    std::istringstream iss(line);
+    std::string port;
+    if (!(iss >> peer.wg_device_name >> peer.wg_peer_pubkey_base64 >> peer.peer_hostname >> port)) {
+        error = "expected: device pubkey hostname port [prefer-ipv4|prefer-ipv6] [interval=ms]";
+        return false;
+    }
+
+    if (peer.wg_device_name.size() >= IFNAMSIZ) {
+        error = "device name is too long";
+        return false;
+    }
+
+    if (wg_key_from_base64(peer.wg_peer_pubkey, peer.wg_peer_pubkey_base64.c_str()) < 0) {
+        error = "invalid peer public key";
+        return false;
+    }
+
+    char *end_ptr = nullptr;
+    unsigned long port_num = std::strtoul(port.c_str(), &end_ptr, 10);
+    if (*end_ptr != '\0' || port_num > 65535) {
+        error = port + " is not a valid port";
+        return false;
+    }
+    peer.peer_port = port_num;
+
+    peer.ip_version_preference = default_preference;
+    peer.refresh_interval_ms = 0;
+    std::string option;
+    while (iss >> option) {
+        if (option.compare(0, 9, "interval=") == 0) {
+            peer.refresh_interval_ms = std::strtoull(option.c_str() + 9, &end_ptr, 10);
+            if (option.size() == 9 || *end_ptr != '\0' || peer.refresh_interval_ms == 0) {
+                error = option + " is not a valid interval";
+                return false;
+            }
+        } else if (option == "prefer-ipv4") {
+            peer.ip_version_preference = IPVersionPreference::PreferV4;
+        } else if (option == "prefer-ipv6") {
+            peer.ip_version_preference = IPVersionPreference::PreferV6;
+        } else {
+            error = "unknown option " + option;
+            return false;
+        }
+    }
+    return true;
+}
+
+int load_config_file(const char *path, IPVersionPreference default_preference, std::vector<PeerConfig> &peers)
+{
+    std::ifstream file(path);
+    if (!file) {
+        int rc = -errno;
+        std::fprintf(stderr, "%s: %s\n", path, std::strerror(errno));
+        return rc;
+    }
+
+    std::set<std::pair<std::string, std::string>> configured;
+    for (const PeerConfig &existing : peers) {
+        configured.insert(std::make_pair(existing.wg_device_name, existing.wg_peer_pubkey_base64));
+    }
+
+    int loaded = 0;
+    unsigned int line_no = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+        ++line_no;
+        std::size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string::npos || line[begin] == '#') {
+            continue;
+        }
+
+        PeerConfig peer;
+        std::string error;
+        if (!parse_peer_line(line, default_preference, peer, error)) {
+            std::fprintf(stderr, "%s:%u: %s\n", path, line_no, error.c_str());
+            return -EINVAL;
+        }
+
+        if (!configured.insert(std::make_pair(peer.wg_device_name, peer.wg_peer_pubkey_base64)).second) {
+            std::fprintf(stderr, "%s:%u: peer %s on %s is already configured\n", path, line_no, peer.wg_peer_pubkey_base64.c_str(), peer.wg_device_name.c_str());
+            return -EINVAL;
+        }
+        peers.push_back(peer);
+        ++loaded;
+    }
+    return loaded;
+}
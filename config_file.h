@@ -0,0 +1,15 @@
+#ifndef CONFIG_FILE_H
+#define CONFIG_FILE_H
+
+#include <vector>
+
+#include "core.h"
+
+/// @brief load peers from a config file. One peer per line:
+///        device pubkey hostname port [prefer-ipv4|prefer-ipv6] [interval=ms]
+///        Blank lines and lines starting with # are ignored. Errors are printed to stderr
+/// @param default_preference for peers without a preference
+/// @return number of peers loaded, or negative errno. -EINVAL on syntax errors
+int load_config_file(const char *path, IPVersionPreference default_preference, std::vector<PeerConfig> &peers);
+
+#endif
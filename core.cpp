@@ -2,30 +2,172 @@
 #include <csignal>
 #include <cstring>
 
-#include <atomic>
+#include <algorithm>
 #include <chrono>
-#include <condition_variable>
-#include <mutex>
+#include <map>
+#include <memory>
+#include <random>
 #include <set>
-#include <sstream>
-#include <thread>
 
+#include <linux/if_addr.h>
+#include <linux/rtnetlink.h>
 #include <netdb.h>
-#include <syslog.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
+#include "address_selection.h"
+#include "async_log.h"
 #include "core.h"
+#include "device_backend.h"
+#include "dns.h"
+#include "dns_cache.h"
+#include "key_index.h"
+#include "metrics.h"
+#include "netlink_monitor.h"
+#include "probe.h"
+#include "reactor.h"
+#include "scheduler.h"
 
-static std::mutex wait_lock;
-static std::condition_variable wait_cv;
-static volatile std::sig_atomic_t sigint_status;
+static const char *const resolv_conf_path = "/etc/resolv.conf";
+// peers due within this much of each other share a wakeup and a device dump
+static const std::chrono::milliseconds batch_slack(10);
+
+// built-in resolver queries in flight at once. Each holds up to two sockets
+static const std::size_t max_inflight_queries = 64;
+// addresses of a hostname probed, in the order of the answer. Each probe holds a socket
+static const std::size_t max_probed_addresses = 8;
+// RTT differences below this are jitter, whatever the hysteresis
+static const double probe_min_gain_ms = 1;
+// nullptr when the system resolver is used
+static std::unique_ptr<DnsResolver> dns_resolver;
+// nullptr unless enabled with the built-in resolver
+static std::unique_ptr<DnsCache> dns_cache;
+// the kernel over a socket opened once, so a cycle doesn't pay a socket and a family lookup per
+// request. Or devices simulated in memory
+static std::unique_ptr<DeviceBackend> device_backend;
+// bumped in place on the reactor thread, read by the exporter between cycles
+static Metrics metrics;
+// per device, of the peers a scan looks for, rebuilt by each scan without allocating
+static std::vector<KeyIndex> scan_indexes;
+// the dumps of a batch, requested together. Kept for the storage
+static std::vector<wg_device_scan> device_scans;
+// the changed endpoints of a device, and the entry of task_indexes of each. Kept for the storage
+static std::vector<wg_endpoint_update> endpoint_updates;
+static std::vector<std::size_t> endpoint_update_entries;
+// of the backoff delays and the start
+static std::mt19937_64 jitter_rng;
+// nullptr unless RFC 6724 ordering is enabled
+static std::unique_ptr<DestinationSelector> destination_selector;
+// the addresses of a peer as ordered for its device. Kept for the storage
+static std::vector<sockaddr_storage> ranked_addresses;
+
+// what probing learnt of an address of a hostname
+struct AddressRtt {
+    sockaddr_storage address;
+    // smoothed as TCP does, each sample weighing 1/8. Restarts from the sample after the address was unreachable
+    double srtt_ms;
+    // answered the last probe
+    bool reachable;
+};
+
+// with probing, of the addresses of each hostname by hostname index, as of the last probe
+static std::vector<std::vector<AddressRtt>> hostname_rtts;
+
+// runtime state of a tracked peer
+struct PeerTask {
+    const PeerConfig *config;
+    // index into the device list of task_resolve_and_update
+    std::size_t device_index;
+    // peers with the same hostname share its index, into Batch::hostnames
+    std::size_t hostname_index;
+    std::vector<sockaddr_storage> addresses;
+
+    // with handshake_aware, from the scan before resolution
+    bool healthy;
+    bool handshake_fresh;
+    bool rx_seen;
+    std::uint64_t rx_bytes;
+    // doubles while the peer stays healthy. 0 when it isn't
+    std::uint64_t healthy_interval_ms;
+    // of the last resolution, for the convergence time of an endpoint it changes
+    std::chrono::steady_clock::time_point resolve_start;
+    // with backoff: the last attempt failed to resolve or on the device, and the delay it got. 0 after a success
+    bool failed;
+    std::uint64_t backoff_ms;
+};
+
+// a hostname being resolved on the reactor, for every due peer of the batch that has it
+struct Resolution : Reactor::Handler {
+    // index into Batch::due_tasks, of the peer that started the query
+    std::size_t batch_index;
+    std::size_t hostname_index;
+    // what the query asks for, AF_UNSPEC for both
+    int query_family;
+    std::unique_ptr<DnsQuery> query;
+
+    void on_event(int fd, std::uint32_t) override { query->on_readable(fd); }
+};
+
+// RTT probes to the addresses a hostname resolved to, on the reactor
+struct Probe : Reactor::Handler {
+    std::size_t hostname_index;
+    std::unique_ptr<ProbeRound> round;
+
+    void on_event(int fd, std::uint32_t events) override { round->on_event(fd, events); }
+};
+
+// what a batch knows of a hostname. Left over from an earlier batch unless serial is that of the batch
+struct HostnameState {
+    std::uint64_t serial;
+    // in flight, or nullptr once answered
+    Resolution *resolving;
+    // indexes into Batch::due_tasks of the other peers waiting for it. Kept across batches for the storage
+    std::vector<std::size_t> waiters;
+    // the answer, see begin_resolution
+    int rc;
+    std::uint32_t ttl;
+    std::vector<sockaddr_storage> addresses;
+    // with backoff, the delay drawn in batch backoff_serial for the peers failing from the same previous delay
+    std::uint64_t backoff_serial;
+    std::uint64_t backoff_from_ms;
+    std::uint64_t backoff_ms;
+};
+
+// due peers popped together. They are resolved concurrently, then each device is scanned once
+struct Batch {
+    std::vector<std::size_t> due_tasks;
+    // per due task
+    std::vector<std::uint64_t> refresh_ms;
+    // due tasks before this one are resolving or resolved
+    std::size_t next_start;
+    std::size_t finished;
+    std::vector<std::unique_ptr<Resolution>> inflight;
+    // with probing, of the hostnames answered with several addresses. The devices wait for them
+    std::vector<std::unique_ptr<Probe>> probes;
+    // by hostname index, so peers sharing a hostname share its query and its answer
+    std::vector<HostnameState> hostnames;
+    std::uint64_t serial;
+    // resolved peers of each device, and the devices touched
+    std::vector<std::vector<std::size_t>> device_due_tasks;
+    std::vector<std::size_t> due_devices;
+    // make the peers of the batch due again once done
+    bool resolve_again;
+};
 
 static const sockaddr *get_first_address(bool prefer_v4, const std::vector<sockaddr_storage> &addresses);
 static bool is_addr_same(const sockaddr *a, const sockaddr *b);
-static bool get_address_str(const sockaddr *addr, std::string &str);
-static int update_peer_ip(const std::string &if_name, const wg_key *peer_pubkey,
-    const std::vector<sockaddr_storage> &addresses, std::uint16_t port, IPVersionPreference config_ip_version_preference);
-static int resolve_dns(const std::string &peer_dns, std::vector<sockaddr_storage> &addresses);
+static int update_peer_ip(const std::string &if_name, wg_endpoint *endpoint, const std::vector<sockaddr_storage> &addresses,
+    std::uint16_t port, IPVersionPreference config_ip_version_preference, bool ranked, bool &changed);
+static int set_endpoint_address(const std::string &if_name, wg_endpoint *endpoint, const sockaddr *target, std::uint16_t port);
+struct DevicePeerScan;
+static int update_device_peers(const ResolvUpdateConfig &config, const std::string &if_name, DevicePeerScan &scan);
+static double seconds_since(std::chrono::steady_clock::time_point start);
+static void log_resolved_addresses(const std::string &hostname, const std::vector<sockaddr_storage> &addrs);
+static int begin_resolution(const std::string &peer_dns, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl, int &query_family);
+static int end_resolution(const std::string &peer_dns, const DnsQuery &query, int query_family, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl);
+static int resolve_dns_system(const std::string &peer_dns, std::vector<sockaddr_storage> &addresses);
+static void setup_dns_resolver(const ResolvUpdateConfig &config);
+static std::uint64_t get_next_refresh_ms(const ResolvUpdateConfig &config, const PeerConfig &peer, int resolve_rc, std::uint32_t ttl);
 
 bool is_addr_same(const sockaddr *a, const sockaddr *b)
 {
@@ -42,7 +184,7 @@ bool is_addr_same(const sockaddr *a, const sockaddr *b)
 const sockaddr *get_first_address(bool prefer_v4, const std::vector<sockaddr_storage> &addresses)
 {
     if (addresses.empty()) {
-        syslog(LOG_DEBUG, "No address offered");
+        async_log(LOG_DEBUG, "No address offered");
         return nullptr;
     }
     const sockaddr *sock_addr = nullptr;
@@ -58,150 +200,379 @@ const sockaddr *get_first_address(bool prefer_v4, const std::vector<sockaddr_sto
         }
     }
 
-    std::string ip_str;
-    get_address_str(sock_addr, ip_str);
-    syslog(LOG_DEBUG, "%s address offered: %s", sock_addr->sa_family == AF_INET ? "IPv4" : "IPv6", ip_str.c_str());
+    async_log(LOG_DEBUG, "%s address offered: %s", sock_addr->sa_family == AF_INET ? "IPv4" : "IPv6", sock_addr);
     return sock_addr;
 }
 
-bool get_address_str(const sockaddr *addr, std::string &str)
+// if the port of the peer is already set, the port param has no use
+// ranked: addresses are ordered best first, so without a preference the first one is taken whatever its family
+int update_peer_ip(const std::string &if_name, wg_endpoint *endpoint, const std::vector<sockaddr_storage> &addresses,
+    std::uint16_t port, IPVersionPreference config_ip_version_preference, bool ranked, bool &changed)
 {
-    char buf[INET6_ADDRSTRLEN];
-    const void *addrptr;
-    switch (addr->sa_family) {
+    // get peer addr
+    // cond 1: if peer addr matches any addr in addresses, no op
+    // cond 2: if no peer addr matches but addresses not empty, use the first one in addresses
+    // cond 3: if no peer addr matches and addresses empty, no op
+
+    changed = false;
+    if (addresses.empty()) {
+        async_log(LOG_DEBUG, "Peer ip unchanged - host ip is not found");
+
+        // cond 3
+        return 0;
+    }
+
+    for (const sockaddr_storage &resolved_address : addresses) {
+        if (is_addr_same(reinterpret_cast<const sockaddr *>(&resolved_address), &endpoint->addr)) {
+            // cond 1
+            async_log(LOG_DEBUG, "Peer ip unchanged - host ip unchanged");
+            return 0;
+        }
+    }
+
+    // no matched ip?
+    // set to first
+
+    IPVersionPreference current_ip_ver_pref = IPVersionPreference::NoPreference;
+
+    if (config_ip_version_preference == IPVersionPreference::NoPreference && ranked) {
+        current_ip_ver_pref = addresses[0].ss_family == AF_INET ? IPVersionPreference::PreferV4 : IPVersionPreference::PreferV6;
+    } else if (config_ip_version_preference == IPVersionPreference::NoPreference) {
+        switch (endpoint->addr.sa_family) {
+        // if no existing endpoint, use first v4, then v6
+        // if existing endpoint is v4, use first v4, then v6
+        case AF_UNSPEC:
+        case AF_INET:
+            async_log(LOG_INFO, "original IP is IPv4, while config has no preference. Use v4");
+            current_ip_ver_pref = IPVersionPreference::PreferV4;
+            break;
+        // if existing endpoint is v6, use first v6, then v4
+        case AF_INET6:
+            async_log(LOG_INFO, "original IP is IPv6, while config has no preference. Use v6");
+            current_ip_ver_pref = IPVersionPreference::PreferV6;
+            break;
+        default:
+            async_log(LOG_CRIT, "Unexpected protocol type: %d. Report this bug: " __FILE__ ":%d", endpoint->addr.sa_family, __LINE__);
+            return -EPROTONOSUPPORT;
+        }
+    } else {
+        async_log(LOG_INFO, "Config prefers %s", get_ip_version_preference_str(config_ip_version_preference));
+        current_ip_ver_pref = config_ip_version_preference;
+    }
+
+    // ip_ver_pref is either v4 or v6 now
+    const sockaddr *target = get_first_address(current_ip_ver_pref == IPVersionPreference::PreferV4, addresses);
+
+    // target is not supposed to be nullptr
+    // the only way to make it null is to pass empty addr list, but addr list won't be empty here
+    int rc = set_endpoint_address(if_name, endpoint, target, port);
+    changed = rc == 0;
+    return rc;
+}
+
+int set_endpoint_address(const std::string &if_name, wg_endpoint *endpoint, const sockaddr *target, std::uint16_t port)
+{
+    // the addresses are copied into the record before the endpoint is overwritten
+    async_log(LOG_DEBUG, "Updating WireGuard device %s, original IP %s, new IP %s...", if_name.c_str(), &endpoint->addr, target);
+
+    switch (target->sa_family) {
     case AF_INET:
-        addrptr = &reinterpret_cast<const sockaddr_in *>(addr)->sin_addr;
+        std::memcpy(&endpoint->addr4, target, sizeof(sockaddr_in));
+        endpoint->addr4.sin_port = htons(port);
         break;
     case AF_INET6:
-        addrptr = &reinterpret_cast<const sockaddr_in6 *>(addr)->sin6_addr;
+        std::memcpy(&endpoint->addr6, target, sizeof(sockaddr_in6));
+        endpoint->addr6.sin6_port = htons(port);
         break;
     default:
-        return false;
+        async_log(LOG_CRIT, "Invalid socket type: %d", target->sa_family);
+        return -EPFNOSUPPORT;
     }
+    return 0;
+}
 
-    const char *ok = inet_ntop(addr->sa_family, addrptr, buf, INET6_ADDRSTRLEN);
-    if (ok) {
-        str = std::string(buf);
-        return true;
+// With probing, the reachable address of the lowest smoothed RTT, among those of the preferred family if any of them
+// answered. A reachable endpoint among the candidates stays unless beaten by the hysteresis.
+/// @param decided false if no resolved address answered, to fall back to the first address of the preferred family
+/// @return the address to set, nullptr to keep the endpoint
+/// @param addresses resolved for the peer, as ordered for its device
+static const sockaddr *select_probed_address(const ResolvUpdateConfig &config, const PeerTask &task, const std::vector<sockaddr_storage> &addresses,
+    const wg_endpoint &endpoint, bool &decided)
+{
+    IPVersionPreference preference = task.config->ip_version_preference;
+    int family = preference == IPVersionPreference::PreferV4 ? AF_INET : preference == IPVersionPreference::PreferV6 ? AF_INET6 : AF_UNSPEC;
+    const AddressRtt *best = nullptr;
+    const AddressRtt *best_preferred = nullptr;
+    const AddressRtt *current = nullptr;
+    for (const AddressRtt &rtt : hostname_rtts[task.hostname_index]) {
+        const sockaddr *addr = reinterpret_cast<const sockaddr *>(&rtt.address);
+        // the probe may predate the answer
+        bool resolved = std::any_of(addresses.begin(), addresses.end(),
+            [addr](const sockaddr_storage &resolved) { return is_addr_same(reinterpret_cast<const sockaddr *>(&resolved), addr); });
+        if (!rtt.reachable || !resolved) {
+            continue;
+        }
+        if (!best || rtt.srtt_ms < best->srtt_ms) {
+            best = &rtt;
+        }
+        if (addr->sa_family == family && (!best_preferred || rtt.srtt_ms < best_preferred->srtt_ms)) {
+            best_preferred = &rtt;
+        }
+        if (is_addr_same(addr, &endpoint.addr)) {
+            current = &rtt;
+        }
+    }
+    if (best_preferred) {
+        best = best_preferred;
+        if (current && current->address.ss_family != family) {
+            current = nullptr;
+        }
+    }
+    decided = best != nullptr;
+    if (!best || best == current) {
+        return nullptr;
+    }
+    if (current && best->srtt_ms >= current->srtt_ms * (1 - config.probe_hysteresis) - probe_min_gain_ms) {
+        async_log(LOG_DEBUG, "Peer %s: keeping %s at %.2f ms, %s at %.2f ms isn't enough faster", task.config->wg_peer_pubkey_base64.c_str(),
+            &endpoint.addr, current->srtt_ms, reinterpret_cast<const sockaddr *>(&best->address), best->srtt_ms);
+        return nullptr;
+    }
+    if (current) {
+        async_log(LOG_INFO, "Peer %s: %s at %.2f ms is faster than %s at %.2f ms", task.config->wg_peer_pubkey_base64.c_str(),
+            reinterpret_cast<const sockaddr *>(&best->address), best->srtt_ms, &endpoint.addr, current->srtt_ms);
     } else {
-        return false;
+        async_log(LOG_INFO, "Peer %s: %s is the fastest reachable address, at %.2f ms", task.config->wg_peer_pubkey_base64.c_str(),
+            reinterpret_cast<const sockaddr *>(&best->address), best->srtt_ms);
     }
+    return reinterpret_cast<const sockaddr *>(&best->address);
 }
 
-// if the port of the peer is already set, the port param has no use
-int update_peer_ip(const std::string &if_name, const wg_key *peer_pubkey,
-    const std::vector<sockaddr_storage> &addresses, std::uint16_t port, IPVersionPreference config_ip_version_preference)
-{
-    // get peer addr
-    // cond 1: if peer addr matches any addr in addresses, no op
-    // cond 2: if no peer addr matches but addresses not empty, use the first one in addresses
-    // cond 3: if no peer addr matches and addresses empty, no op
+// what a scan of one device found of its due peers
+struct DevicePeerScan {
+    const std::vector<PeerTask> &tasks;
+    const std::vector<std::size_t> &task_indexes;
+    // public key of each wanted peer to its entry of task_indexes
+    KeyIndex &index;
+    // per entry of task_indexes
+    std::vector<bool> wanted;
+    std::vector<wg_peer_status> peers;
+    std::vector<bool> found;
+    std::size_t wanted_count;
+    std::size_t found_count;
+    // of the dump
+    int rc;
+    // of the device, from the dump
+    std::uint32_t fwmark;
+};
 
-    if (addresses.empty()) {
-        syslog(LOG_DEBUG, "Peer ip unchanged - host ip is not found");
+// the scans of a batch. Kept for the storage
+static std::vector<DevicePeerScan> batch_scans;
 
-        // cond 3
+static int scan_device_peer(const wg_peer_status *peer, void *data)
+{
+    DevicePeerScan &scan = *static_cast<DevicePeerScan *>(data);
+    std::uint32_t i = scan.index.find(peer->public_key);
+    if (i == KeyIndex::npos) {
         return 0;
     }
+    // a restarted dump reports the peer again. Keep the latest
+    scan.peers[i] = *peer;
+    if (!scan.found[i]) {
+        scan.found[i] = true;
+        ++scan.found_count;
+    }
+    // the rest of the device is of no interest
+    return scan.found_count == scan.wanted_count ? 1 : 0;
+}
 
-    wg_device *device;
-    if (wg_get_device(&device, if_name.c_str()) < 0) {
-        syslog(LOG_DEBUG, "Update peer ip failed: WireGuard device %s is not found", if_name.c_str());
-        return -ENOENT;
+// set wanted before the scan
+static void init_device_peer_scan(DevicePeerScan &scan)
+{
+    scan.peers.assign(scan.task_indexes.size(), wg_peer_status());
+    scan.found.assign(scan.task_indexes.size(), false);
+    scan.index.reset(scan.task_indexes.size());
+    for (std::size_t i = 0; i < scan.task_indexes.size(); ++i) {
+        // a peer tracked twice on a device is matched to its first entry, as the scan reports it once
+        if (scan.wanted[i]) {
+            scan.index.insert(scan.tasks[scan.task_indexes[i]].config->wg_peer_pubkey, static_cast<std::uint32_t>(i));
+        }
     }
+    scan.wanted_count = scan.index.size();
+    scan.found_count = 0;
+}
 
-    int rc = 0;
-    wg_peer *peer;
-    wg_for_each_peer(device, peer)
-    {
-        if (std::memcmp(peer->public_key, peer_pubkey, sizeof(wg_key)) == 0) {
-            // pub key match, this is the peer
-            for (const sockaddr_storage &resolved_address : addresses) {
-                if (is_addr_same(reinterpret_cast<const sockaddr *>(&resolved_address), &peer->endpoint.addr)) {
-                    // cond 1
-                    syslog(LOG_DEBUG, "Peer ip unchanged - host ip unchanged");
-                    goto update_peer_cleanup;
-                }
-            }
+// dump the devices of the batch at once, one per scan. A scan that wants no peer is left out, with rc 0
+static void scan_batch_devices(const std::vector<std::string> &devices, const Batch &batch, std::vector<DevicePeerScan> &scans)
+{
+    device_scans.clear();
+    for (std::size_t i = 0; i < scans.size(); ++i) {
+        scans[i].rc = 0;
+        if (scans[i].wanted_count) {
+            device_scans.push_back({ devices[batch.due_devices[i]].c_str(), scan_device_peer, &scans[i], 0, 0 });
+        }
+    }
+    if (device_scans.empty()) {
+        return;
+    }
 
-            // no matched ip?
-            // set to first
-
-            IPVersionPreference current_ip_ver_pref = IPVersionPreference::NoPreference;
-
-            if (config_ip_version_preference == IPVersionPreference::NoPreference) {
-                switch (peer->endpoint.addr.sa_family) {
-                // if no existing endpoint, use first v4, then v6
-                // if existing endpoint is v4, use first v4, then v6
-                case AF_UNSPEC:
-                case AF_INET:
-                    syslog(LOG_INFO, "original IP is IPv4, while config has no preference. Use v4");
-                    current_ip_ver_pref = IPVersionPreference::PreferV4;
-                    break;
-                // if existing endpoint is v6, use first v6, then v4
-                case AF_INET6:
-                    syslog(LOG_INFO, "original IP is IPv6, while config has no preference. Use v6");
-                    current_ip_ver_pref = IPVersionPreference::PreferV6;
-                    break;
-                default:
-                    syslog(LOG_CRIT, "Unexpected protocol type: %d. Report this bug: " __FILE__ ":%d", peer->endpoint.addr.sa_family, __LINE__);
-                    rc = -EPROTONOSUPPORT;
-                    goto update_peer_cleanup;
-                }
-            } else {
-                syslog(LOG_INFO, "Config prefers %s", get_ip_version_preference_str(config_ip_version_preference));
-                current_ip_ver_pref = config_ip_version_preference;
-            }
+    auto scan_start = std::chrono::steady_clock::now();
+    device_backend->scan_devices(device_scans.data(), device_scans.size());
+    metrics.dump_duration.observe(seconds_since(scan_start));
+    for (const wg_device_scan &device_scan : device_scans) {
+        DevicePeerScan &scan = *static_cast<DevicePeerScan *>(device_scan.data);
+        scan.rc = device_scan.ret;
+        scan.fwmark = device_scan.fwmark;
+    }
+}
 
-            // ip_ver_pref is either v4 or v6 now
-            const sockaddr *target = get_first_address(current_ip_ver_pref == IPVersionPreference::PreferV4, addresses);
-
-            // target is not supposed to be nullptr
-            // the only way to make it null is to pass empty addr list, but addr list won't be empty here
-
-            std::string original_ip;
-            std::string new_ip;
-
-            bool orinal_ip_str_ok = get_address_str(&peer->endpoint.addr, original_ip);
-            bool new_ip_str_ok = get_address_str(target, new_ip);
-
-            switch (target->sa_family) {
-            case AF_INET:
-                std::memcpy(&peer->endpoint.addr4, target, sizeof(sockaddr_in));
-                peer->endpoint.addr4.sin_port = htons(port);
-                break;
-            case AF_INET6:
-                std::memcpy(&peer->endpoint.addr6, target, sizeof(sockaddr_in6));
-                peer->endpoint.addr6.sin6_port = htons(port);
-                break;
-            default:
-                syslog(LOG_CRIT, "Invalid socket type: %d", target->sa_family);
-                rc = -EPFNOSUPPORT;
-                goto update_peer_cleanup;
-            }
+// after the dump of the device, set the endpoints of the changed peers together. A peer that can't be updated
+// doesn't hold back the others: its failure is returned once the rest are sent
+int update_device_peers(const ResolvUpdateConfig &config, const std::string &if_name, DevicePeerScan &scan)
+{
+    const std::vector<PeerTask> &tasks = scan.tasks;
+    const std::vector<std::size_t> &task_indexes = scan.task_indexes;
+    if (scan.wanted_count == 0) {
+        async_log(LOG_DEBUG, "Peer ip unchanged - host ip is not found");
+        return 0;
+    }
 
-            syslog(LOG_DEBUG, "Updating WireGuard device %s, original IP %s, new IP %s...", if_name.c_str(), orinal_ip_str_ok ? original_ip.c_str() : "(N/A)", new_ip_str_ok ? new_ip.c_str() : "(N/A)");
+    int scan_rc = scan.rc;
+    if (scan_rc == -ENODEV) {
+        async_log(LOG_DEBUG, "Update peer ip failed: WireGuard device %s is not found", if_name.c_str());
+        return -ENODEV;
+    }
+    if (scan_rc < 0) {
+        // e.g. the wireguard module reloaded twice in a row. Not a reason to park the device
+        ++metrics.netlink_errors;
+        async_log(LOG_ERR, "Dump of WireGuard device %s failed: %s", if_name.c_str(), std::strerror(-scan_rc));
+        return scan_rc;
+    }
 
-            rc = wg_set_device(device);
-            if (rc < 0) {
-                syslog(LOG_ERR, "set wireguard peer failed: %s", std::strerror(-rc));
-                goto update_peer_cleanup;
+    endpoint_updates.clear();
+    endpoint_update_entries.clear();
+    // the first peer that couldn't be updated. The others are still sent
+    int peer_rc = 0;
+    std::size_t peer_failures = 0;
+    for (std::size_t i = 0; i < task_indexes.size(); ++i) {
+        const PeerTask &task = tasks[task_indexes[i]];
+        if (task.addresses.empty()) {
+            continue;
+        }
+        if (!scan.found[i]) {
+            async_log(LOG_DEBUG, "Peer %s is not found on WireGuard device %s", task.config->wg_peer_pubkey_base64.c_str(), if_name.c_str());
+            continue;
+        }
+
+        wg_endpoint &endpoint = scan.peers[i].endpoint;
+        // the routes depend on the fwmark of the device, so the order is per device
+        const std::vector<sockaddr_storage> *addresses = &task.addresses;
+        if (destination_selector) {
+            ranked_addresses = task.addresses;
+            destination_selector->sort(ranked_addresses, scan.fwmark);
+            addresses = &ranked_addresses;
+            if (config.debug) {
+                async_log(LOG_DEBUG, "Peer %s: addresses in RFC 6724 order %s", task.config->wg_peer_pubkey_base64.c_str(), LogAddresses { ranked_addresses });
+            }
+        }
+        bool changed;
+        bool decided = false;
+        const sockaddr *probed = config.probe_port ? select_probed_address(config, task, *addresses, endpoint, decided) : nullptr;
+        int rc;
+        if (decided) {
+            rc = probed ? set_endpoint_address(if_name, &endpoint, probed, task.config->peer_port) : 0;
+            changed = probed && rc == 0;
+        } else {
+            rc = update_peer_ip(if_name, &endpoint, *addresses, task.config->peer_port, task.config->ip_version_preference,
+                destination_selector != nullptr, changed);
+        }
+        if (rc < 0) {
+            async_log(LOG_ERR, "Endpoint of peer %s on WireGuard device %s not updated: %s", task.config->wg_peer_pubkey_base64.c_str(),
+                if_name.c_str(), std::strerror(-rc));
+            ++peer_failures;
+            if (!peer_rc) {
+                peer_rc = rc;
             }
+            continue;
+        }
+        if (changed) {
+            wg_endpoint_update update;
+            std::memcpy(update.public_key, task.config->wg_peer_pubkey, sizeof(wg_key));
+            update.endpoint = endpoint;
+            endpoint_updates.push_back(update);
+            endpoint_update_entries.push_back(i);
+        }
+    }
+    if (peer_failures) {
+        async_log(LOG_ERR, "%zu peer(s) of WireGuard device %s not updated", peer_failures, if_name.c_str());
+    }
+    if (endpoint_updates.empty()) {
+        return peer_rc;
+    }
 
-            syslog(LOG_INFO, "WireGuard device %s: updated peer with new IP %s...", if_name.c_str(), new_ip_str_ok ? new_ip.c_str() : "(N/A)");
+    // only the endpoints go back. Re-sending the dumped device would carry every peer with all its allowed IPs
+    auto set_start = std::chrono::steady_clock::now();
+    int rc = device_backend->set_peer_endpoints(if_name.c_str(), endpoint_updates.data(), endpoint_updates.size());
+    auto set_end = std::chrono::steady_clock::now();
+    metrics.set_duration.observe(std::chrono::duration<double>(set_end - set_start).count());
+    if (rc < 0) {
+        ++metrics.netlink_errors;
+    }
+    for (std::size_t u = 0; u < endpoint_updates.size(); ++u) {
+        std::size_t i = endpoint_update_entries[u];
+        const PeerTask &task = tasks[task_indexes[i]];
+        if (endpoint_updates[u].ret < 0) {
+            async_log(LOG_ERR, "set wireguard peer %s failed: %s", task.config->wg_peer_pubkey_base64.c_str(), std::strerror(-endpoint_updates[u].ret));
+            continue;
         }
+        ++metrics.endpoint_updates;
+        metrics.convergence.observe(std::chrono::duration<double>(set_end - task.resolve_start).count());
+        timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        metrics.peers[task_indexes[i]].last_update = wall.tv_sec + wall.tv_nsec / 1e9;
+        async_log(LOG_INFO, "WireGuard device %s: updated peer %s with new IP of %s", if_name.c_str(), task.config->wg_peer_pubkey_base64.c_str(), task.config->peer_hostname.c_str());
     }
+    return rc < 0 ? rc : peer_rc;
+}
 
-update_peer_cleanup:
-    wg_free_device(device);
+/// @brief resolve right away if possible, otherwise tell what to query on the reactor
+/// @param ttl TTL of the answer in seconds, the negative caching TTL if no host found. 0 if unknown
+/// @param query_family set if -EAGAIN
+/// @return -EAGAIN if a DnsQuery is to be run, then end_resolution. -254 if no host found. -255 other failures.
+int begin_resolution(const std::string &peer_dns, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl, int &query_family)
+{
+    if (!dns_resolver) {
+        // getaddrinfo doesn't tell
+        ttl = 0;
+        return resolve_dns_system(peer_dns, addresses);
+    }
+    if (dns_cache) {
+        return dns_cache->lookup_cached(peer_dns, addresses, ttl, query_family);
+    }
+
+    sockaddr_storage literal;
+    if (parse_ip_literal(peer_dns, literal)) {
+        addresses.assign(1, literal);
+        ttl = 0;
+        return 0;
+    }
+    query_family = AF_UNSPEC;
+    return -EAGAIN;
+}
+
+// the result of the query begin_resolution asked for, same convention
+int end_resolution(const std::string &peer_dns, const DnsQuery &query, int query_family, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl)
+{
+    int rc = dns_cache ? dns_cache->complete(peer_dns, query, query_family, addresses, ttl) : query.result(addresses, ttl);
+    if (rc == -254) {
+        async_log(LOG_DEBUG, "Resolve error: host or ip not found for %s", peer_dns.c_str());
+    } else if (rc < 0) {
+        async_log(LOG_ERR, "Resolve error: no name server answered for %s in %llu ms", peer_dns.c_str(), static_cast<unsigned long long>(dns_resolver->timeout_ms()));
+    }
     return rc;
 }
 
-/// @brief
-/// @param peer_dns
-/// @param addresses
-/// @return -254 if no host found. -255 other failures.
-int resolve_dns(const std::string &peer_dns, std::vector<sockaddr_storage> &addresses)
+// blocking getaddrinfo. Subject to the glibc timeout and retry sequence of resolv.conf
+int resolve_dns_system(const std::string &peer_dns, std::vector<sockaddr_storage> &addresses)
 {
     addrinfo hints = { 0 };
 
@@ -213,12 +584,12 @@ int resolve_dns(const std::string &peer_dns, std::vector<sockaddr_storage> &addr
     addrinfo *result;
     int rc = getaddrinfo(peer_dns.c_str(), nullptr, &hints, &result);
     if (rc == EAI_NODATA || rc == EAI_NONAME) {
-        syslog(LOG_DEBUG, "Resolve error: host or ip not found for %s", peer_dns.c_str());
+        async_log(LOG_DEBUG, "Resolve error: host or ip not found for %s", peer_dns.c_str());
         return -254;
     }
 
     if (rc != 0) {
-        syslog(LOG_ERR, "getaddrinfo: %s", gai_strerror(rc));
+        async_log(LOG_ERR, "getaddrinfo: %s", gai_strerror(rc));
         return -255;
     }
 
@@ -234,7 +605,7 @@ int resolve_dns(const std::string &peer_dns, std::vector<sockaddr_storage> &addr
             std::memcpy(&addr, rp->ai_addr, sizeof(sockaddr_in6));
             break;
         default:
-            syslog(LOG_CRIT, "Invalid socket type: %d", rp->ai_family);
+            async_log(LOG_CRIT, "Invalid socket type: %d", rp->ai_family);
             rc = -EPFNOSUPPORT;
             goto resolve_dns_cleanup;
         }
@@ -261,68 +632,845 @@ const char *get_ip_version_preference_str(IPVersionPreference pref)
     }
 }
 
-void task_resolve_and_update(const ResolvUpdateConfig &config)
+// refresh_interval_ms unless TTL scheduling is on and the resolver told a TTL
+std::uint64_t get_next_refresh_ms(const ResolvUpdateConfig &config, const PeerConfig &peer, int resolve_rc, std::uint32_t ttl)
 {
-    syslog(LOG_INFO, "Starting resolve and update task...");
-    syslog(LOG_INFO, "Target WireGuard device %s, peer key %s", config.wg_device_name.c_str(), config.wg_peer_pubkey_base64.c_str());
-    syslog(LOG_INFO, "target hostname %s, target port %u, endpoint preference: %s", config.peer_hostname.c_str(), config.peer_port, get_ip_version_preference_str(config.ip_version_preference));
+    if (!config.ttl_refresh || ttl == 0 || (resolve_rc < 0 && resolve_rc != -254)) {
+        return peer.refresh_interval_ms ? peer.refresh_interval_ms : config.refresh_interval_ms;
+    }
 
+    // refresh a bit before the record expires in the resolver cache
+    std::uint64_t next_ms = static_cast<std::uint64_t>(ttl * 1000.0 * (1.0 - config.ttl_early_refresh));
+    if (next_ms < config.ttl_min_ms) {
+        next_ms = config.ttl_min_ms;
+    }
+    if (next_ms > config.ttl_max_ms) {
+        next_ms = config.ttl_max_ms;
+    }
+    return next_ms;
+}
+
+void setup_dns_resolver(const ResolvUpdateConfig &config)
+{
+    if (!config.builtin_resolver) {
+        async_log(LOG_INFO, "Using system resolver");
+        if (config.dns_cache) {
+            async_log(LOG_WARNING, "DNS cache needs TTLs from the built-in resolver, -b. Disabled");
+        }
+        if (!config.nameservers.empty()) {
+            async_log(LOG_WARNING, "Name servers are for the built-in resolver, -b. Ignored");
+        }
+        return;
+    }
+
+    std::unique_ptr<DnsResolver> resolver(new DnsResolver(config.dns_timeout_ms));
     int rc = 0;
-    while (true) {
-        std::vector<sockaddr_storage> addrs;
-        rc = resolve_dns(config.peer_hostname, addrs);
-        if (rc == -254) {
-            // no host found. don't log.
-            goto task_resolve_and_update_loop_end;
+    if (config.nameservers.empty()) {
+        rc = resolver->load_resolv_conf(resolv_conf_path);
+        if (rc <= 0) {
+            async_log(LOG_WARNING, "No name server loaded from %s, falling back to system resolver", resolv_conf_path);
+            return;
+        }
+    } else {
+        for (const std::string &nameserver : config.nameservers) {
+            if (resolver->add_nameserver(nameserver) < 0) {
+                async_log(LOG_WARNING, "Ignoring name server %s", nameserver.c_str());
+                continue;
+            }
+            ++rc;
         }
+        if (rc == 0) {
+            async_log(LOG_WARNING, "No usable name server given, falling back to system resolver");
+            return;
+        }
+    }
+    resolver->refresh_address_families();
+    async_log(LOG_INFO, "Using built-in resolver with %d name server(s), query timeout %llu ms", rc, static_cast<unsigned long long>(config.dns_timeout_ms));
+    dns_resolver = std::move(resolver);
+
+    if (config.dns_cache) {
+        async_log(LOG_INFO, "DNS cache enabled, serving stale answers for up to %llu ms", static_cast<unsigned long long>(config.dns_max_stale_ms));
+        dns_cache.reset(new DnsCache(*dns_resolver, config.dns_max_stale_ms));
+    }
+}
+
+void log_resolved_addresses(const std::string &hostname, const std::vector<sockaddr_storage> &addrs)
+{
+    if (addrs.empty()) {
+        async_log(LOG_DEBUG, "No IP found for host %s", hostname.c_str());
+        return;
+    }
+    // formatted by the log writer, and not at all unless debug logging is on
+    async_log(LOG_DEBUG, "%zu IP(s) retrieved for %s: %s", addrs.size(), hostname.c_str(), LogAddresses { addrs });
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::uint64_t signal_bit(int signo)
+{
+    return std::uint64_t(1) << signo;
+}
+
+// forget what was learnt of the network, and make every peer due now.
+// Parked peers stay parked
+static void resolve_everything_now(std::size_t task_count, DeadlineScheduler &scheduler, Batch &batch, bool batch_active)
+{
+    if (dns_cache) {
+        dns_cache->clear();
+    }
+    if (dns_resolver) {
+        dns_resolver->refresh_address_families();
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < task_count; ++i) {
+        if (scheduler.is_scheduled(i)) {
+            scheduler.schedule(i, now);
+        }
+    }
+    if (batch_active) {
+        // its answers may predate the change
+        batch.resolve_again = true;
+    }
+}
+
+// A peer is healthy if its last handshake is younger than handshake_stale_ms and it received
+// something since the last look. Healthy peers aren't resolved.
+static void judge_peer_health(const ResolvUpdateConfig &config, PeerTask &task, const wg_peer_status *status, std::int64_t now_sec)
+{
+    if (!status) {
+        // no device, or the peer isn't on it
+        task.healthy = false;
+        task.handshake_fresh = false;
+        task.rx_seen = false;
+        return;
+    }
+
+    std::int64_t handshake_sec = status->last_handshake_time.tv_sec;
+    task.handshake_fresh = handshake_sec != 0 && (now_sec - handshake_sec) * 1000 < static_cast<std::int64_t>(config.handshake_stale_ms);
+    bool rx_advancing = !task.rx_seen || status->rx_bytes != task.rx_bytes;
+    task.rx_seen = true;
+    task.rx_bytes = status->rx_bytes;
+    task.healthy = task.handshake_fresh && rx_advancing;
+}
+
+// scan the devices of the batch once for the handshakes and rx of their due peers
+static void check_batch_health(const ResolvUpdateConfig &config, const std::vector<std::string> &devices, std::vector<PeerTask> &tasks, Batch &batch)
+{
+    for (std::size_t index : batch.due_tasks) {
+        std::vector<std::size_t> &device_tasks = batch.device_due_tasks[tasks[index].device_index];
+        if (device_tasks.empty()) {
+            batch.due_devices.push_back(tasks[index].device_index);
+        }
+        device_tasks.push_back(index);
+    }
+
+    std::vector<DevicePeerScan> &scans = batch_scans;
+    scans.clear();
+    scans.reserve(batch.due_devices.size());
+    for (std::size_t device_index : batch.due_devices) {
+        std::vector<std::size_t> &device_tasks = batch.device_due_tasks[device_index];
+        scans.push_back({ tasks, device_tasks, scan_indexes[device_index], std::vector<bool>(device_tasks.size(), true), {}, {}, 0, 0, 0, 0 });
+        init_device_peer_scan(scans.back());
+    }
+    scan_batch_devices(devices, batch, scans);
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (DevicePeerScan &scan : scans) {
+        if (scan.rc < 0 && scan.rc != -ENODEV) {
+            ++metrics.netlink_errors;
+        }
+        for (std::size_t i = 0; i < scan.task_indexes.size(); ++i) {
+            std::size_t index = scan.task_indexes[i];
+            judge_peer_health(config, tasks[index], scan.rc == 0 && scan.found[i] ? &scan.peers[i] : nullptr, now.tv_sec);
+            metrics.peers[index].healthy = tasks[index].healthy;
+        }
+    }
+    for (std::size_t device_index : batch.due_devices) {
+        batch.device_due_tasks[device_index].clear();
+    }
+    batch.due_devices.clear();
+}
+
+// Decorrelated jitter: after a failure, a random delay between the usual one and three times the previous
+// delay, up to backoff_max_ms. Daemons failing together, e.g. on a name server outage, drift apart.
+// Peers of a hostname failing together in a batch stay together, to keep sharing their queries
+static std::uint64_t get_backoff_ms(const ResolvUpdateConfig &config, PeerTask &task, Batch &batch, std::uint64_t refresh_ms)
+{
+    if (!task.failed) {
+        task.backoff_ms = 0;
+        return refresh_ms;
+    }
+    std::uint64_t previous_ms = task.backoff_ms ? task.backoff_ms : refresh_ms;
+    HostnameState &state = batch.hostnames[task.hostname_index];
+    if (state.backoff_serial == batch.serial && state.backoff_from_ms == previous_ms && state.backoff_ms >= refresh_ms) {
+        task.backoff_ms = state.backoff_ms;
+    } else {
+        std::uint64_t max_ms = std::max(refresh_ms, std::min(previous_ms * 3, config.backoff_max_ms));
+        task.backoff_ms = std::uniform_int_distribution<std::uint64_t>(refresh_ms, max_ms)(jitter_rng);
+        state.backoff_serial = batch.serial;
+        state.backoff_from_ms = previous_ms;
+        state.backoff_ms = task.backoff_ms;
+    }
+    if (config.debug) {
+        async_log(LOG_DEBUG, "Peer %s failed, retrying in %llu ms", task.config->wg_peer_pubkey_base64.c_str(), static_cast<unsigned long long>(task.backoff_ms));
+    }
+    return task.backoff_ms;
+}
+
+// a due peer is resolved, successfully or not
+static void finish_task(const ResolvUpdateConfig &config, std::vector<PeerTask> &tasks, Batch &batch, std::size_t batch_index, int rc, std::uint32_t ttl)
+{
+    std::size_t index = batch.due_tasks[batch_index];
+    PeerTask &task = tasks[index];
+    const std::string &hostname = task.config->peer_hostname;
+    batch.refresh_ms[batch_index] = get_next_refresh_ms(config, *task.config, rc, ttl);
+    task.failed = rc < 0;
+    ++batch.finished;
+    if (config.handshake_aware) {
+        task.healthy_interval_ms = 0;
+        if (!task.handshake_fresh) {
+            // the tunnel is down. Don't wait for a long TTL to bring it back
+            batch.refresh_ms[batch_index] = std::min(batch.refresh_ms[batch_index], config.stale_interval_ms);
+        }
+    }
+
+    std::vector<std::size_t> &device_tasks = batch.device_due_tasks[task.device_index];
+    if (device_tasks.empty()) {
+        batch.due_devices.push_back(task.device_index);
+    }
+    device_tasks.push_back(index);
+
+    metrics.resolve_duration.observe(seconds_since(task.resolve_start));
+    ++metrics.resolutions;
+    metrics.peers[index].resolve_ok = rc == 0 && !task.addresses.empty();
+    if (rc == -254) {
+        ++metrics.nxdomain;
+    } else if (rc < 0) {
+        ++metrics.resolution_failures;
+    }
+
+    if (rc == -254) {
+        // no host found. don't log.
+        task.addresses.clear();
+        return;
+    }
+    if (rc < 0) {
+        async_log(LOG_ERR, "Failed to resolve hostname %s", hostname.c_str());
+        task.addresses.clear();
+        return;
+    }
+    if (config.debug) {
+        log_resolved_addresses(hostname, task.addresses);
+    }
+    if (config.debug && config.ttl_refresh) {
+        async_log(LOG_DEBUG, "TTL of %s %u s", hostname.c_str(), ttl);
+    }
+}
+
+// with probing, time the addresses of a hostname answered with more than one
+static void start_probe(const ResolvUpdateConfig &config, Batch &batch, Reactor &reactor, std::size_t hostname_index, const std::vector<sockaddr_storage> &addresses)
+{
+    if (!config.probe_port || addresses.size() < 2) {
+        return;
+    }
+    std::vector<sockaddr_storage> targets(addresses.begin(), addresses.begin() + std::min(addresses.size(), max_probed_addresses));
+    std::unique_ptr<Probe> probe(new Probe);
+    probe->hostname_index = hostname_index;
+    probe->round.reset(new ProbeRound(config.probe_protocol, config.probe_port, targets));
+    probe->round->start(std::chrono::steady_clock::now(), config.probe_timeout_ms);
+    for (int fd : probe->round->fds()) {
+        int rc = reactor.add(fd, probe->round->events(), probe.get());
         if (rc < 0) {
-            syslog(LOG_ERR, "Failed to resolve hostname");
-            goto task_resolve_and_update_loop_end;
-        }
-
-        if (config.debug) {
-            if (addrs.empty()) {
-                syslog(LOG_DEBUG, "No IP found for host %s", config.peer_hostname.c_str());
-            } else {
-                std::stringstream ss;
-                for (const auto &addr : addrs) {
-                    std::string str;
-                    bool ok = get_address_str(reinterpret_cast<const sockaddr *>(&addr), str);
-
-                    if (ok) {
-                        ss << str << " ";
-                    } else {
-                        ss << "(invalid) ";
+            // the probe times out on this socket
+            async_log(LOG_ERR, "Failed to watch probe socket: %s", std::strerror(-rc));
+        }
+    }
+    batch.probes.push_back(std::move(probe));
+}
+
+// fold a probe round into what is known of the addresses. Addresses no longer probed are forgotten
+static void record_probe(const ResolvUpdateConfig &config, const ProbeRound &round, std::vector<AddressRtt> &rtts)
+{
+    std::vector<AddressRtt> updated;
+    updated.reserve(round.addresses().size());
+    for (std::size_t i = 0; i < round.addresses().size(); ++i) {
+        const sockaddr *addr = reinterpret_cast<const sockaddr *>(&round.addresses()[i]);
+        auto known = std::find_if(rtts.begin(), rtts.end(), [addr](const AddressRtt &rtt) { return is_addr_same(reinterpret_cast<const sockaddr *>(&rtt.address), addr); });
+        AddressRtt rtt { round.addresses()[i], known != rtts.end() ? known->srtt_ms : 0, false };
+        double sample_ms = round.rtts()[i];
+        if (sample_ms >= 0) {
+            rtt.srtt_ms = known != rtts.end() && known->reachable ? rtt.srtt_ms + (sample_ms - rtt.srtt_ms) / 8 : sample_ms;
+            rtt.reachable = true;
+        }
+        if (config.debug && rtt.reachable) {
+            async_log(LOG_DEBUG, "Probed %s: %.2f ms, smoothed %.2f ms", addr, sample_ms, rtt.srtt_ms);
+        } else if (config.debug) {
+            async_log(LOG_DEBUG, "Probed %s: no answer", addr);
+        }
+        updated.push_back(rtt);
+    }
+    rtts.swap(updated);
+}
+
+// run the timers of the probes in flight, and record those done
+static void reap_probes(const ResolvUpdateConfig &config, Batch &batch, Reactor &reactor)
+{
+    auto now = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < batch.probes.size();) {
+        Probe &probe = *batch.probes[i];
+        probe.round->on_timer(now);
+        if (!probe.round->done()) {
+            ++i;
+            continue;
+        }
+
+        for (int fd : probe.round->fds()) {
+            reactor.remove(fd);
+        }
+        record_probe(config, *probe.round, hostname_rtts[probe.hostname_index]);
+        batch.probes[i] = std::move(batch.probes.back());
+        batch.probes.pop_back();
+    }
+}
+
+// start resolving due peers of the batch, up to max_inflight_queries queries in flight
+static void start_resolutions(const ResolvUpdateConfig &config, std::vector<PeerTask> &tasks, Batch &batch, Reactor &reactor)
+{
+    while (batch.next_start < batch.due_tasks.size() && batch.inflight.size() < max_inflight_queries) {
+        std::size_t batch_index = batch.next_start++;
+        PeerTask &task = tasks[batch.due_tasks[batch_index]];
+        if (config.handshake_aware && task.healthy) {
+            // check back later, less often the longer it stays healthy
+            std::uint64_t interval_ms = task.config->refresh_interval_ms ? task.config->refresh_interval_ms : config.refresh_interval_ms;
+            task.healthy_interval_ms = std::min(task.healthy_interval_ms ? task.healthy_interval_ms * 2 : interval_ms, std::max(interval_ms, config.healthy_max_ms));
+            batch.refresh_ms[batch_index] = task.healthy_interval_ms;
+            task.failed = false;
+            ++batch.finished;
+            if (config.debug) {
+                async_log(LOG_DEBUG, "Peer %s is healthy, skipping resolution of %s for %llu ms", task.config->wg_peer_pubkey_base64.c_str(),
+                    task.config->peer_hostname.c_str(), static_cast<unsigned long long>(task.healthy_interval_ms));
+            }
+            continue;
+        }
+
+        task.resolve_start = std::chrono::steady_clock::now();
+        HostnameState &state = batch.hostnames[task.hostname_index];
+        if (state.serial == batch.serial && state.resolving) {
+            // asked already. Wait for the same answer
+            state.waiters.push_back(batch_index);
+            continue;
+        }
+        if (state.serial == batch.serial) {
+            task.addresses = state.addresses;
+            finish_task(config, tasks, batch, batch_index, state.rc, state.ttl);
+            continue;
+        }
+
+        state.serial = batch.serial;
+        state.resolving = nullptr;
+        state.waiters.clear();
+        state.ttl = 0;
+        int query_family = AF_UNSPEC;
+        state.rc = begin_resolution(task.config->peer_hostname, state.addresses, state.ttl, query_family);
+        if (state.rc == 0) {
+            start_probe(config, batch, reactor, task.hostname_index, state.addresses);
+        }
+        if (state.rc != -EAGAIN) {
+            task.addresses = state.addresses;
+            finish_task(config, tasks, batch, batch_index, state.rc, state.ttl);
+            continue;
+        }
+
+        std::unique_ptr<Resolution> resolution(new Resolution);
+        resolution->batch_index = batch_index;
+        resolution->hostname_index = task.hostname_index;
+        resolution->query_family = query_family;
+        resolution->query.reset(new DnsQuery(*dns_resolver, task.config->peer_hostname, query_family));
+        resolution->query->start(task.resolve_start);
+        for (int fd : resolution->query->fds()) {
+            int rc = reactor.add(fd, EPOLLIN, resolution.get());
+            if (rc < 0) {
+                // the query times out on this socket
+                async_log(LOG_ERR, "Failed to watch DNS socket: %s", std::strerror(-rc));
+            }
+        }
+        state.resolving = resolution.get();
+        batch.inflight.push_back(std::move(resolution));
+    }
+}
+
+// run the timers of the queries in flight, and finish those done
+static void reap_resolutions(const ResolvUpdateConfig &config, std::vector<PeerTask> &tasks, Batch &batch, Reactor &reactor)
+{
+    auto now = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < batch.inflight.size();) {
+        Resolution &resolution = *batch.inflight[i];
+        resolution.query->on_timer(now);
+        if (!resolution.query->done()) {
+            ++i;
+            continue;
+        }
+
+        for (int fd : resolution.query->fds()) {
+            reactor.remove(fd);
+        }
+        PeerTask &task = tasks[batch.due_tasks[resolution.batch_index]];
+        HostnameState &state = batch.hostnames[resolution.hostname_index];
+        state.resolving = nullptr;
+        state.ttl = 0;
+        state.rc = end_resolution(task.config->peer_hostname, *resolution.query, resolution.query_family, state.addresses, state.ttl);
+        if (state.rc == 0) {
+            start_probe(config, batch, reactor, resolution.hostname_index, state.addresses);
+        }
+        task.addresses = state.addresses;
+        finish_task(config, tasks, batch, resolution.batch_index, state.rc, state.ttl);
+        for (std::size_t batch_index : state.waiters) {
+            tasks[batch.due_tasks[batch_index]].addresses = state.addresses;
+            finish_task(config, tasks, batch, batch_index, state.rc, state.ttl);
+        }
+
+        batch.inflight[i] = std::move(batch.inflight.back());
+        batch.inflight.pop_back();
+    }
+}
+
+// one scan per device touched by the batch
+/// @param missing_devices appended with the devices that don't exist
+static void update_batch_devices(const ResolvUpdateConfig &config, const std::vector<std::string> &devices, std::vector<PeerTask> &tasks, Batch &batch,
+    std::vector<std::size_t> &missing_devices)
+{
+    std::vector<DevicePeerScan> &scans = batch_scans;
+    scans.clear();
+    scans.reserve(batch.due_devices.size());
+    for (std::size_t device_index : batch.due_devices) {
+        const std::vector<std::size_t> &device_tasks = batch.device_due_tasks[device_index];
+        scans.push_back({ tasks, device_tasks, scan_indexes[device_index], {}, {}, {}, 0, 0, 0, 0 });
+        for (std::size_t index : device_tasks) {
+            scans.back().wanted.push_back(!tasks[index].addresses.empty());
+        }
+        init_device_peer_scan(scans.back());
+    }
+    scan_batch_devices(devices, batch, scans);
+
+    for (std::size_t i = 0; i < scans.size(); ++i) {
+        std::size_t device_index = batch.due_devices[i];
+        int rc = update_device_peers(config, devices[device_index], scans[i]);
+        if (rc == -ENODEV) {
+            // no such device
+            missing_devices.push_back(device_index);
+        } else if (rc < 0) {
+            async_log(LOG_ERR, "Failed to update peer ip on %s", devices[device_index].c_str());
+            // e.g. the wireguard module is gone. Not the fault of the name server, but retried alike
+            for (std::size_t index : batch.device_due_tasks[device_index]) {
+                tasks[index].failed = true;
+            }
+        }
+        batch.device_due_tasks[device_index].clear();
+    }
+    batch.due_devices.clear();
+}
+
+// rtnetlink events read by the reactor, handled by the main loop afterwards
+struct NetworkEvents : Reactor::Handler, NetlinkMonitor::Handler {
+    NetlinkMonitor monitor;
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+    bool overflow = false;
+    // with network_events, an address or a default route changed
+    bool network_changed = false;
+    // any address, route or rule, the cached lookups of destination_selector are stale
+    bool routes_changed = false;
+
+    void on_event(int, std::uint32_t) override { monitor.read_events(*this); }
+    void on_link(bool is_added, int, const char *ifname, const char *kind) override
+    {
+        if (!is_added) {
+            removed.push_back(ifname);
+        } else if (!kind || std::strcmp(kind, "wireguard") == 0) {
+            // another kind of link under the name won't take a peer
+            added.push_back(ifname);
+        }
+    }
+    void on_address(bool, int, int, unsigned char scope, std::uint32_t flags) override
+    {
+        routes_changed = true;
+        // link local and host addresses don't reach a peer. Tentative ones come again when usable
+        if (scope < RT_SCOPE_LINK && !(flags & IFA_F_TENTATIVE)) {
+            network_changed = true;
+        }
+    }
+    void on_route(bool, int, std::uint32_t table, unsigned char dst_len) override
+    {
+        routes_changed = true;
+        // default routes only. Allowed IP routes of WireGuard itself would retrigger all the time
+        if (dst_len == 0 && table != RT_TABLE_LOCAL) {
+            network_changed = true;
+        }
+    }
+    void on_rule(bool, int) override
+    {
+        // e.g. wg-quick adding its "not fwmark" rule
+        routes_changed = true;
+    }
+    void on_overflow() override
+    {
+        overflow = true;
+        network_changed = true;
+        routes_changed = true;
+    }
+};
+
+// Peers of a missing device aren't resolved until RTM_NEWLINK announces it
+struct DeviceParking {
+    // tracked peers of each device
+    std::vector<std::vector<std::size_t>> device_tasks;
+    std::vector<bool> parked;
+};
+
+static void park_device(DeviceParking &parking, std::size_t device_index, const std::vector<std::string> &devices, DeadlineScheduler &scheduler)
+{
+    if (parking.parked[device_index]) {
+        return;
+    }
+    async_log(LOG_INFO, "WireGuard device %s is missing, waiting for it to appear", devices[device_index].c_str());
+    parking.parked[device_index] = true;
+    for (std::size_t index : parking.device_tasks[device_index]) {
+        scheduler.cancel(index);
+        metrics.peers[index].parked = true;
+    }
+}
+
+static void unpark_device(DeviceParking &parking, std::size_t device_index, const std::vector<std::string> &devices, DeadlineScheduler &scheduler)
+{
+    if (!parking.parked[device_index]) {
+        return;
+    }
+    async_log(LOG_INFO, "WireGuard device %s appeared, updating its peers", devices[device_index].c_str());
+    parking.parked[device_index] = false;
+    auto now = std::chrono::steady_clock::now();
+    for (std::size_t index : parking.device_tasks[device_index]) {
+        scheduler.schedule(index, now);
+        metrics.peers[index].parked = false;
+    }
+}
+
+static void handle_link_events(NetworkEvents &events, DeviceParking &parking, const std::vector<std::string> &devices,
+    const std::map<std::string, std::size_t> &device_indexes, DeadlineScheduler &scheduler)
+{
+    // removals first: a device deleted and created again in one read ends up unparked
+    for (const std::string &ifname : events.removed) {
+        auto it = device_indexes.find(ifname);
+        if (it != device_indexes.end()) {
+            park_device(parking, it->second, devices, scheduler);
+        }
+    }
+    for (const std::string &ifname : events.added) {
+        auto it = device_indexes.find(ifname);
+        if (it != device_indexes.end()) {
+            unpark_device(parking, it->second, devices, scheduler);
+        }
+    }
+    if (events.overflow) {
+        // missed events: look for every parked device again. Those still missing are parked again
+        async_log(LOG_WARNING, "rtnetlink overflowed, checking every missing device");
+        for (std::size_t i = 0; i < devices.size(); ++i) {
+            unpark_device(parking, i, devices, scheduler);
+        }
+    }
+    events.added.clear();
+    events.removed.clear();
+    events.overflow = false;
+}
+
+void task_resolve_and_update(const ResolvUpdateConfig &config)
+{
+    async_log(LOG_INFO, "Starting resolve and update task...");
+
+    std::vector<PeerTask> tasks;
+    std::vector<std::string> devices;
+    std::map<std::string, std::size_t> device_indexes;
+    std::map<std::string, std::size_t> hostname_indexes;
+    for (const PeerConfig &peer : config.peers) {
+        async_log(LOG_INFO, "Target WireGuard device %s, peer key %s", peer.wg_device_name.c_str(), peer.wg_peer_pubkey_base64.c_str());
+        async_log(LOG_INFO, "target hostname %s, target port %u, endpoint preference: %s", peer.peer_hostname.c_str(), peer.peer_port, get_ip_version_preference_str(peer.ip_version_preference));
+        auto device = device_indexes.insert(std::make_pair(peer.wg_device_name, devices.size()));
+        if (device.second) {
+            devices.push_back(peer.wg_device_name);
+        }
+        auto hostname = hostname_indexes.insert(std::make_pair(peer.peer_hostname, hostname_indexes.size()));
+        tasks.push_back({ &peer, device.first->second, hostname.first->second, {}, false, false, false, 0, 0, {}, false, 0 });
+    }
+    DeviceParking parking { std::vector<std::vector<std::size_t>>(devices.size()), std::vector<bool>(devices.size(), false) };
+    for (std::size_t i = 0; i < tasks.size(); ++i) {
+        parking.device_tasks[tasks[i].device_index].push_back(i);
+    }
+    async_log(LOG_INFO, "Tracking %zu peer(s) on %zu device(s)", tasks.size(), devices.size());
+    metrics.peers.assign(tasks.size(), PeerMetrics());
+
+    // before the DNS cache starts its thread, which must not take the signals
+    Reactor reactor;
+    int rc = reactor.open({ SIGINT, SIGTERM, SIGHUP });
+    if (rc < 0) {
+        async_log(LOG_CRIT, "Failed to set up the event loop: %s", std::strerror(-rc));
+        return;
+    }
+
+    std::unique_ptr<MetricsExporter> exporter;
+    if (!config.metrics_address.empty()) {
+        exporter.reset(new MetricsExporter(metrics, config.peers, reactor));
+        rc = exporter->open(config.metrics_address);
+        if (rc < 0) {
+            async_log(LOG_WARNING, "Failed to serve metrics on %s: %s", config.metrics_address.c_str(), std::strerror(-rc));
+            exporter.reset();
+        } else {
+            async_log(LOG_INFO, "Serving metrics on %s", config.metrics_address.c_str());
+        }
+    }
+
+    // subscribed before the first dump, so a device created meanwhile isn't missed
+    NetworkEvents network_events;
+    if (config.rfc6724) {
+        // routes are looked up under the fwmark of a device, so policy rules count too
+        rc = network_events.monitor.open({ RTNLGRP_LINK, RTNLGRP_IPV4_IFADDR, RTNLGRP_IPV6_IFADDR, RTNLGRP_IPV4_ROUTE, RTNLGRP_IPV6_ROUTE,
+            RTNLGRP_IPV4_RULE, RTNLGRP_IPV6_RULE });
+    } else if (config.network_events) {
+        rc = network_events.monitor.open({ RTNLGRP_LINK, RTNLGRP_IPV4_IFADDR, RTNLGRP_IPV6_IFADDR, RTNLGRP_IPV4_ROUTE, RTNLGRP_IPV6_ROUTE });
+    } else {
+        rc = network_events.monitor.open({ RTNLGRP_LINK });
+    }
+    if (rc == 0) {
+        rc = reactor.add(network_events.monitor.fd(), EPOLLIN, &network_events);
+    }
+    bool watch_links = rc == 0;
+    if (!watch_links) {
+        async_log(LOG_WARNING, "Failed to watch links: %s. Polling missing devices", std::strerror(-rc));
+    } else if (config.network_events) {
+        async_log(LOG_INFO, "Resolving every peer again %llu ms after address or default route changes",
+            static_cast<unsigned long long>(config.network_debounce_ms));
+    }
+
+    setup_dns_resolver(config);
+    if (config.ttl_refresh) {
+        async_log(LOG_INFO, "Refresh by TTL, between %llu and %llu ms, %.0f%% early. Fallback interval %llu ms",
+            static_cast<unsigned long long>(config.ttl_min_ms), static_cast<unsigned long long>(config.ttl_max_ms),
+            config.ttl_early_refresh * 100, static_cast<unsigned long long>(config.refresh_interval_ms));
+        if (!dns_resolver) {
+            async_log(LOG_WARNING, "System resolver doesn't expose TTL, see -b. Refreshing every %llu ms", static_cast<unsigned long long>(config.refresh_interval_ms));
+        }
+    }
+
+    if (config.handshake_aware) {
+        async_log(LOG_INFO, "Handshake aware: healthy peers checked up to every %llu ms, peers without a handshake in %llu ms resolved at least every %llu ms",
+            static_cast<unsigned long long>(config.healthy_max_ms), static_cast<unsigned long long>(config.handshake_stale_ms),
+            static_cast<unsigned long long>(config.stale_interval_ms));
+    }
+    if (config.rfc6724) {
+        destination_selector.reset(new DestinationSelector());
+        rc = destination_selector->open();
+        if (rc < 0) {
+            async_log(LOG_WARNING, "Failed to open a route socket: %s. Addresses are taken in the order of the answer", std::strerror(-rc));
+            destination_selector.reset();
+        } else {
+            async_log(LOG_INFO, "Ordering the addresses of hostnames by RFC 6724 destination address selection");
+        }
+    }
+    if (config.probe_port) {
+        async_log(LOG_INFO, "Probing the addresses of hostnames on %s port %u, switching for a %.0f%% lower RTT",
+            config.probe_protocol == ProbeProtocol::Udp ? "UDP" : "TCP", config.probe_port, config.probe_hysteresis * 100);
+    }
+
+    if (config.fake_wireguard.empty()) {
+        std::unique_ptr<NetlinkDeviceBackend> netlink(new NetlinkDeviceBackend());
+        if (netlink->open() < 0) {
+            async_log(LOG_CRIT, "Failed to allocate netlink context");
+            return;
+        }
+        device_backend = std::move(netlink);
+    } else {
+        FakeDeviceOptions options;
+        if (parse_fake_device_options(config.fake_wireguard, options) < 0) {
+            async_log(LOG_CRIT, "Invalid fake WireGuard options %s", config.fake_wireguard.c_str());
+            return;
+        }
+        async_log(LOG_WARNING, "WireGuard is simulated in memory, %zu extra peer(s) per device. No device is touched",
+            options.peers);
+        device_backend.reset(new FakeDeviceBackend(options, config.peers));
+    }
+
+    // every peer is due at start. With backoff, spread over a little time, so that daemons started together don't query together.
+    // The peers of a hostname start together, to share their queries
+    DeadlineScheduler scheduler(tasks.size());
+    auto start = std::chrono::steady_clock::now();
+    jitter_rng.seed(std::random_device {}());
+    std::vector<std::uint64_t> hostname_jitter_ms(hostname_indexes.size(), UINT64_MAX);
+    for (std::size_t i = 0; i < tasks.size(); ++i) {
+        std::uint64_t jitter_ms = 0;
+        if (config.backoff) {
+            std::uint64_t interval_ms = tasks[i].config->refresh_interval_ms ? tasks[i].config->refresh_interval_ms : config.refresh_interval_ms;
+            std::uint64_t &hostname_jitter = hostname_jitter_ms[tasks[i].hostname_index];
+            if (hostname_jitter == UINT64_MAX) {
+                hostname_jitter = std::uniform_int_distribution<std::uint64_t>(0, config.start_jitter_ms)(jitter_rng);
+            }
+            jitter_ms = std::min(hostname_jitter, interval_ms);
+        }
+        scheduler.schedule(i, start + std::chrono::milliseconds(jitter_ms));
+    }
+
+    Batch batch;
+    batch.device_due_tasks.resize(devices.size());
+    scan_indexes.resize(devices.size());
+    batch.hostnames.resize(hostname_indexes.size());
+    batch.serial = 0;
+    hostname_rtts.resize(hostname_indexes.size());
+    std::vector<std::size_t> missing_devices;
+    // simulated devices come and go as if announced by rtnetlink, at their times
+    auto link_change_due = device_backend->take_link_events(network_events.added, network_events.removed);
+    bool batch_active = false;
+    bool stopping = false;
+    bool network_change_pending = false;
+    std::chrono::steady_clock::time_point network_change_due;
+    while (!stopping) {
+        auto now = std::chrono::steady_clock::now();
+        if (network_change_pending && now >= network_change_due) {
+            network_change_pending = false;
+            async_log(LOG_INFO, "Network changed, resolving every peer again");
+            resolve_everything_now(tasks.size(), scheduler, batch, batch_active);
+        }
+        if (!batch_active && !scheduler.empty() && scheduler.next_due() <= now + batch_slack) {
+            batch.due_tasks.clear();
+            scheduler.pop_due(now + batch_slack, batch.due_tasks);
+            batch.refresh_ms.assign(batch.due_tasks.size(), 0);
+            batch.next_start = 0;
+            batch.finished = 0;
+            batch.resolve_again = false;
+            // answers of earlier batches are stale
+            ++batch.serial;
+            batch_active = true;
+            if (destination_selector && !watch_links) {
+                // without route events, routes are looked up again each batch
+                destination_selector->clear();
+            }
+            if (config.handshake_aware) {
+                check_batch_health(config, devices, tasks, batch);
+            }
+        }
+
+        if (batch_active) {
+            do {
+                start_resolutions(config, tasks, batch, reactor);
+                reap_resolutions(config, tasks, batch, reactor);
+            } while (batch.next_start < batch.due_tasks.size() && batch.inflight.size() < max_inflight_queries);
+            reap_probes(config, batch, reactor);
+
+            if (batch.finished == batch.due_tasks.size() && batch.probes.empty()) {
+                missing_devices.clear();
+                update_batch_devices(config, devices, tasks, batch, missing_devices);
+
+                now = std::chrono::steady_clock::now();
+                for (std::size_t i = 0; i < batch.due_tasks.size(); ++i) {
+                    if (parking.parked[tasks[batch.due_tasks[i]].device_index]) {
+                        // removed while resolving
+                        continue;
+                    }
+                    std::uint64_t refresh_ms = batch.refresh_ms[i];
+                    if (config.backoff) {
+                        refresh_ms = get_backoff_ms(config, tasks[batch.due_tasks[i]], batch, refresh_ms);
+                    }
+                    scheduler.schedule(batch.due_tasks[i], batch.resolve_again ? now : now + std::chrono::milliseconds(refresh_ms));
+                }
+                if (watch_links) {
+                    for (std::size_t device_index : missing_devices) {
+                        park_device(parking, device_index, devices, scheduler);
                     }
                 }
-                std::string ips(ss.str());
-                syslog(LOG_DEBUG, "%d IP(s) retrieved: %s", addrs.size(), ips.c_str());
+                if (config.debug && !scheduler.empty()) {
+                    async_log(LOG_DEBUG, "%zu peer(s) processed, next resolution in %lld ms", batch.due_tasks.size(),
+                        static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(scheduler.next_due() - now).count()));
+                } else if (config.debug) {
+                    async_log(LOG_DEBUG, "%zu peer(s) processed, every device is missing", batch.due_tasks.size());
+                }
+                batch_active = false;
+                continue;
             }
         }
 
-        rc = update_peer_ip(config.wg_device_name.c_str(), &config.wg_peer_pubkey, addrs, config.peer_port, config.ip_version_preference);
-        if (rc < 0) {
-            if (rc = -ENOENT) {
-                // no such device
-            } else {
-                syslog(LOG_ERR, "Failed to update peer ip");
+        bool has_deadline = true;
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        if (batch_active) {
+            for (const auto &resolution : batch.inflight) {
+                deadline = std::min(deadline, resolution->query->next_timeout());
             }
-            goto task_resolve_and_update_loop_end;
+            for (const auto &probe : batch.probes) {
+                deadline = std::min(deadline, probe->round->next_timeout());
+            }
+        } else if (!scheduler.empty()) {
+            deadline = scheduler.next_due();
+        } else {
+            // every device is parked. Only an event or a signal wakes
+            has_deadline = false;
+        }
+        if (network_change_pending) {
+            deadline = std::min(deadline, network_change_due);
+            has_deadline = true;
+        }
+        if (link_change_due != std::chrono::steady_clock::time_point::max()) {
+            deadline = std::min(deadline, link_change_due);
+            has_deadline = true;
         }
-    task_resolve_and_update_loop_end:
-        std::unique_lock<std::mutex> lock(wait_lock);
-        bool signal_hit = wait_cv.wait_for(lock, std::chrono::milliseconds(config.refresh_interval_ms), [] { return sigint_status; });
-        if (signal_hit) {
-            // signal
+        if (has_deadline) {
+            reactor.set_deadline(deadline);
+        } else {
+            reactor.clear_deadline();
+        }
+
+        std::uint64_t signals;
+        rc = reactor.run_once(signals);
+        if (rc < 0) {
+            async_log(LOG_CRIT, "Event loop failed: %s", std::strerror(-rc));
             break;
         }
+        link_change_due = device_backend->take_link_events(network_events.added, network_events.removed);
+        handle_link_events(network_events, parking, devices, device_indexes, scheduler);
+        if (network_events.routes_changed) {
+            network_events.routes_changed = false;
+            if (destination_selector) {
+                destination_selector->clear();
+            }
+        }
+        if (network_events.network_changed) {
+            network_events.network_changed = false;
+            if (config.network_events && !network_change_pending) {
+                // the changes of a redial or a failover come in a burst. Wait for the rest
+                network_change_pending = true;
+                network_change_due = std::chrono::steady_clock::now() + std::chrono::milliseconds(config.network_debounce_ms);
+            }
+        }
+        if (signals & (signal_bit(SIGINT) | signal_bit(SIGTERM))) {
+            async_log(LOG_INFO, "%s received", (signals & signal_bit(SIGINT)) ? "SIGINT" : "SIGTERM");
+            stopping = true;
+        } else if (signals & signal_bit(SIGHUP)) {
+            async_log(LOG_INFO, "SIGHUP received, resolving every peer again");
+            resolve_everything_now(tasks.size(), scheduler, batch, batch_active);
+        }
+    }
+    // queries and probes in flight are dropped, their sockets closed
+    batch.inflight.clear();
+    batch.probes.clear();
+    if (dns_cache) {
+        DnsCacheStats stats = dns_cache->stats();
+        async_log(LOG_INFO, "DNS cache: %llu hit(s), %llu miss(es), %llu stale served, %llu background refresh(es)",
+            static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.misses),
+            static_cast<unsigned long long>(stats.stale_served), static_cast<unsigned long long>(stats.refreshes));
+        dns_cache.reset();
+    }
+    if (destination_selector) {
+        async_log(LOG_DEBUG, "%llu route lookup(s) for RFC 6724", static_cast<unsigned long long>(destination_selector->lookups()));
+        destination_selector.reset();
     }
-    syslog(LOG_INFO, "Exiting resolve and update task...");
+    device_backend.reset();
+    async_log(LOG_INFO, "Exiting resolve and update task...");
 }
-
-void sigint_handler(int)
-{
-    syslog(LOG_ERR, "SIGINT received");
-    sigint_status = 1;
-    wait_cv.notify_all();
-}
\ No newline at end of file
@@ -10,6 +10,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "probe.h"
 #include "wireguard.h"
 
 enum class IPVersionPreference {
@@ -18,20 +19,77 @@ enum class IPVersionPreference {
     PreferV6,
 };
 
-struct ResolvUpdateConfig {
+struct PeerConfig {
     std::string wg_device_name;
     std::string wg_peer_pubkey_base64;
     wg_key wg_peer_pubkey;
     std::string peer_hostname;
     std::uint16_t peer_port;
     IPVersionPreference ip_version_preference;
+    // overrides ResolvUpdateConfig::refresh_interval_ms if not 0
+    std::uint64_t refresh_interval_ms;
+};
+
+struct ResolvUpdateConfig {
+    // from the command line and/or the config file
+    std::vector<PeerConfig> peers;
+    // fixed interval, or the fallback when no TTL is available with ttl_refresh
     std::uint64_t refresh_interval_ms;
+    // schedule the next resolution from the TTL of the answer
+    bool ttl_refresh;
+    std::uint64_t ttl_min_ms;
+    std::uint64_t ttl_max_ms;
+    // fraction of the TTL to refresh ahead of expiry, [0, 1)
+    double ttl_early_refresh;
     bool debug;
     bool frontend;
+    // use the built-in resolver instead of getaddrinfo. It queries the name servers directly:
+    // /etc/hosts, nsswitch and the search options of resolv.conf don't apply
+    bool builtin_resolver;
+    // name servers of the built-in resolver instead of those of resolv.conf if not empty.
+    // See DnsResolver::add_nameserver
+    std::vector<std::string> nameservers;
+    std::uint64_t dns_timeout_ms;
+    // cache answers of the built-in resolver, serving stale ones while refreshing
+    bool dns_cache;
+    std::uint64_t dns_max_stale_ms;
+    // skip resolution while the last handshake is fresh and rx advances
+    bool handshake_aware;
+    // a handshake older than this is stale
+    std::uint64_t handshake_stale_ms;
+    // the longest interval between checks of a healthy peer
+    std::uint64_t healthy_max_ms;
+    // the longest interval between resolutions of a peer whose handshake is stale
+    std::uint64_t stale_interval_ms;
+    // retry a peer whose resolution or device keeps failing later and later, with jitter
+    bool backoff;
+    // the longest delay between attempts with backoff
+    std::uint64_t backoff_max_ms;
+    // with backoff, the first resolution of each peer is delayed at random by up to this, or its interval if less
+    std::uint64_t start_jitter_ms;
+    // pick among the addresses of a hostname by smoothed RTT, probing them on this port. 0 to take the first
+    // address of the preferred family
+    std::uint16_t probe_port;
+    ProbeProtocol probe_protocol;
+    std::uint64_t probe_timeout_ms;
+    // with probing, a faster address replaces a reachable endpoint only if its RTT is lower by this fraction, [0, 1)
+    double probe_hysteresis;
+    // order the addresses of a hostname by RFC 6724 destination address selection against the routing table
+    // before picking one, and skip those without a route
+    bool rfc6724;
+    // resolve every peer again when an address or a default route changes
+    bool network_events;
+    // how long to collect a burst of changes
+    std::uint64_t network_debounce_ms;
+    // serve Prometheus metrics here if not empty. See MetricsExporter::open
+    std::string metrics_address;
+    // simulate the WireGuard devices in memory with these options if not empty. See parse_fake_device_options
+    std::string fake_wireguard;
 };
 
 const char *get_ip_version_preference_str(IPVersionPreference pref);
+/// @brief run until SIGINT or SIGTERM. SIGHUP drops cached answers and resolves every peer again.
+///        Blocks these signals in the calling thread, before starting any thread
 void task_resolve_and_update(const ResolvUpdateConfig &config);
-void sigint_handler(int);
 
 #endif
\ No newline at end of file
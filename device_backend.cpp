@@ -0,0 +1,334 @@
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <thread>
+
+#include "device_backend.h"
+
+// a keepalive, as received by a peer with a handshake between two dumps
+static const std::uint64_t fake_rx_per_dump = 32;
+// about what a page long WG_CMD_SET_DEVICE holds of peers with an IPv6 endpoint
+static const std::size_t fake_peers_per_set = 50;
+// as WG_NL_MAX_CONCURRENT_DUMPS
+static const std::size_t fake_concurrent_dumps = 8;
+
+NetlinkDeviceBackend::NetlinkDeviceBackend()
+    : ctx(nullptr)
+{
+}
+
+NetlinkDeviceBackend::~NetlinkDeviceBackend()
+{
+    wg_nl_close(ctx);
+}
+
+int NetlinkDeviceBackend::open()
+{
+    ctx = wg_nl_open();
+    return ctx ? 0 : -ENOMEM;
+}
+
+int NetlinkDeviceBackend::scan_devices(wg_device_scan *scans, std::size_t count)
+{
+    return wg_nl_scan_devices(ctx, scans, count);
+}
+
+int NetlinkDeviceBackend::set_peer_endpoints(const char *device_name, wg_endpoint_update *updates, std::size_t count)
+{
+    return wg_nl_set_peer_endpoints(ctx, device_name, updates, count);
+}
+
+static bool parse_rate(const std::string &str, double &rate)
+{
+    char *end = nullptr;
+    rate = std::strtod(str.c_str(), &end);
+    // 1 would never let a dump finish
+    return !str.empty() && *end == '\0' && rate >= 0 && rate < 1;
+}
+
+static bool parse_count(const std::string &str, unsigned long long &count)
+{
+    char *end = nullptr;
+    count = std::strtoull(str.c_str(), &end, 10);
+    return !str.empty() && str[0] != '-' && *end == '\0' && count != ULLONG_MAX;
+}
+
+// DEV, DEV:FROM-UNTIL, DEV:FROM- or DEV:-UNTIL, in ms after start
+static bool parse_missing_device(const std::string &str, std::vector<FakeDeviceOptions::MissingDevice> &missing)
+{
+    std::size_t colon = str.find(':');
+    FakeDeviceOptions::MissingDevice device = { str.substr(0, colon), 0, UINT64_MAX };
+    if (device.name.empty()) {
+        return false;
+    }
+    if (colon != std::string::npos) {
+        std::string range = str.substr(colon + 1);
+        std::size_t dash = range.find('-');
+        if (dash == std::string::npos) {
+            return false;
+        }
+        std::string from = range.substr(0, dash);
+        std::string until = range.substr(dash + 1);
+        unsigned long long ms;
+        if (!from.empty()) {
+            if (!parse_count(from, ms)) {
+                return false;
+            }
+            device.from_ms = ms;
+        }
+        if (!until.empty()) {
+            if (!parse_count(until, ms) || ms <= device.from_ms) {
+                return false;
+            }
+            device.until_ms = ms;
+        }
+    }
+    missing.push_back(device);
+    return true;
+}
+
+int parse_fake_device_options(const std::string &spec, FakeDeviceOptions &options)
+{
+    options = { 0, 0, 0, 0, -1, {} };
+
+    std::istringstream iss(spec);
+    std::string option;
+    while (std::getline(iss, option, ',')) {
+        std::size_t sep = option.find('=');
+        if (sep == std::string::npos) {
+            return -EINVAL;
+        }
+        std::string key = option.substr(0, sep);
+        std::string value = option.substr(sep + 1);
+        unsigned long long count;
+        bool valid;
+        if (key == "peers") {
+            valid = parse_count(value, count);
+            options.peers = count;
+        } else if (key == "latency-us") {
+            valid = parse_count(value, count);
+            options.latency_us = count;
+        } else if (key == "enoent") {
+            valid = parse_rate(value, options.enoent_rate);
+        } else if (key == "eintr") {
+            valid = parse_rate(value, options.eintr_rate);
+        } else if (key == "handshake" && value == "none") {
+            valid = true;
+            options.handshake_age_s = -1;
+        } else if (key == "handshake") {
+            valid = parse_count(value, count) && count <= INT32_MAX;
+            options.handshake_age_s = static_cast<std::int64_t>(count);
+        } else if (key == "missing") {
+            valid = parse_missing_device(value, options.missing);
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+FakeDeviceBackend::FakeDeviceBackend(const FakeDeviceOptions &options, const std::vector<PeerConfig> &peers)
+    : options(options)
+    , rng(std::random_device {}())
+    , start(std::chrono::steady_clock::now())
+{
+    for (const FakeDeviceOptions::MissingDevice &device : options.missing) {
+        // one missing from start isn't announced: the first dump finds it missing
+        announced_present[device.name] = !is_missing(device.name, 0);
+    }
+    for (const PeerConfig &peer : peers) {
+        if (devices.count(peer.wg_device_name)) {
+            continue;
+        }
+        Device &device = devices[peer.wg_device_name];
+        device.peers.reserve(options.peers);
+        for (std::size_t i = 0; i < options.peers; ++i) {
+            // unlike any real key: the index, then a filler
+            wg_key key;
+            std::memset(key, 0xfa, sizeof(key));
+            for (std::size_t b = 0; b < sizeof(i); ++b) {
+                key[b] = static_cast<std::uint8_t>(i >> (b * 8));
+            }
+            add_peer(device, key);
+        }
+    }
+    for (const PeerConfig &peer : peers) {
+        add_peer(devices[peer.wg_device_name], peer.wg_peer_pubkey);
+    }
+}
+
+void FakeDeviceBackend::add_peer(Device &device, const wg_key public_key)
+{
+    std::string key(reinterpret_cast<const char *>(public_key), sizeof(wg_key));
+    if (!device.index.emplace(key, device.peers.size()).second) {
+        // the same peer configured twice
+        return;
+    }
+    wg_peer_status peer;
+    std::memset(&peer, 0, sizeof(peer));
+    std::memcpy(peer.public_key, public_key, sizeof(wg_key));
+    peer.has_public_key = true;
+    device.peers.push_back(peer);
+}
+
+FakeDeviceBackend::Device *FakeDeviceBackend::find_device(const char *device_name)
+{
+    auto it = devices.find(device_name);
+    if (it == devices.end() || (!options.missing.empty() && is_missing(it->first, ms_since_start()))) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+std::uint64_t FakeDeviceBackend::ms_since_start() const
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool FakeDeviceBackend::is_missing(const std::string &device_name, std::uint64_t now_ms) const
+{
+    for (const FakeDeviceOptions::MissingDevice &device : options.missing) {
+        if (device.name == device_name && now_ms >= device.from_ms && now_ms < device.until_ms) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::chrono::steady_clock::time_point FakeDeviceBackend::take_link_events(std::vector<std::string> &added, std::vector<std::string> &removed)
+{
+    std::uint64_t now_ms = ms_since_start();
+    for (auto &link : announced_present) {
+        bool present = !is_missing(link.first, now_ms);
+        if (present != link.second) {
+            link.second = present;
+            (present ? added : removed).push_back(link.first);
+        }
+    }
+    std::uint64_t next_ms = UINT64_MAX;
+    for (const FakeDeviceOptions::MissingDevice &device : options.missing) {
+        for (std::uint64_t at_ms : { device.from_ms, device.until_ms }) {
+            if (at_ms > now_ms) {
+                next_ms = std::min(next_ms, at_ms);
+            }
+        }
+    }
+    if (next_ms == UINT64_MAX) {
+        return std::chrono::steady_clock::time_point::max();
+    }
+    return start + std::chrono::milliseconds(next_ms);
+}
+
+bool FakeDeviceBackend::draw(double rate)
+{
+    return rate > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < rate;
+}
+
+void FakeDeviceBackend::round_trip()
+{
+    if (options.latency_us) {
+        std::this_thread::sleep_for(std::chrono::microseconds(options.latency_us));
+    }
+}
+
+bool FakeDeviceBackend::fail_request()
+{
+    if (!draw(options.enoent_rate)) {
+        return false;
+    }
+    // the family is looked up again and the request sent once more
+    if (options.latency_us) {
+        std::this_thread::sleep_for(std::chrono::microseconds(2 * options.latency_us));
+    }
+    return draw(options.enoent_rate);
+}
+
+int FakeDeviceBackend::scan_devices(wg_device_scan *scans, std::size_t count)
+{
+    int rc = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        // the requests of a wave go out together
+        if (i % fake_concurrent_dumps == 0) {
+            round_trip();
+        }
+        scans[i].ret = scan_device(scans[i].device_name, scans[i].cb, scans[i].data);
+        scans[i].fwmark = 0;
+        if (!rc) {
+            rc = scans[i].ret;
+        }
+    }
+    return rc;
+}
+
+int FakeDeviceBackend::scan_device(const char *device_name, wg_peer_scan_cb cb, void *data)
+{
+    if (fail_request()) {
+        return -ENOENT;
+    }
+    Device *device = find_device(device_name);
+    if (!device) {
+        return -ENODEV;
+    }
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    while (true) {
+        // the callback sees the peers before the change, then all of them again
+        std::size_t interrupted_at = SIZE_MAX;
+        if (draw(options.eintr_rate)) {
+            interrupted_at = std::uniform_int_distribution<std::size_t>(0, device->peers.size())(rng);
+        }
+        for (std::size_t i = 0; i < device->peers.size() && i < interrupted_at; ++i) {
+            wg_peer_status &peer = device->peers[i];
+            if (options.handshake_age_s >= 0) {
+                peer.last_handshake_time.tv_sec = now.tv_sec - options.handshake_age_s;
+                peer.rx_bytes += fake_rx_per_dump;
+            }
+            int ret = cb(&peer, data);
+            if (ret) {
+                return ret < 0 ? ret : 0;
+            }
+        }
+        if (interrupted_at == SIZE_MAX) {
+            return 0;
+        }
+        round_trip();
+    }
+}
+
+int FakeDeviceBackend::set_peer_endpoints(const char *device_name, wg_endpoint_update *updates, std::size_t count)
+{
+    Device *device = find_device(device_name);
+    for (std::size_t first = 0; first < count; first += fake_peers_per_set) {
+        std::size_t end = std::min(count, first + fake_peers_per_set);
+        round_trip();
+        int rc = fail_request() ? -ENOENT : device ? 0 : -ENODEV;
+        if (rc < 0) {
+            // the batch ends with the first failed request
+            for (std::size_t i = first; i < count; ++i) {
+                updates[i].ret = rc;
+            }
+            return rc;
+        }
+        for (std::size_t i = first; i < end; ++i) {
+            wg_endpoint_update &update = updates[i];
+            sa_family_t family = update.endpoint.addr.sa_family;
+            update.ret = family == AF_INET || family == AF_INET6 ? 0 : -EAFNOSUPPORT;
+            auto it = device->index.find(std::string(reinterpret_cast<const char *>(update.public_key), sizeof(wg_key)));
+            // a peer removed meanwhile isn't created again, as with WGPEER_F_UPDATE_ONLY
+            if (!update.ret && it != device->index.end()) {
+                device->peers[it->second].endpoint = update.endpoint;
+            }
+        }
+    }
+    return 0;
+}
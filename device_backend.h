@@ -0,0 +1,121 @@
+#ifndef DEVICE_BACKEND_H
+#define DEVICE_BACKEND_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "core.h"
+#include "wireguard.h"
+
+// Where the peers of the WireGuard devices are read and updated. Used from the reactor thread only
+class DeviceBackend {
+public:
+    virtual ~DeviceBackend() = default;
+
+    /// @brief stream the peers of several devices, with the contract of wg_nl_scan_devices
+    /// @return 0, or the ret of the first scan that failed. Each scan has its own ret: 0, -ENODEV if
+    ///         there's no such device, or another negative errno
+    virtual int scan_devices(wg_device_scan *scans, std::size_t count) = 0;
+    /// @brief set the endpoints of existing peers of a device, with the contract of wg_nl_set_peer_endpoints
+    /// @return 0, or the negative errno that ended the batch. Each update has its own ret
+    virtual int set_peer_endpoints(const char *device_name, wg_endpoint_update *updates, std::size_t count) = 0;
+    /// @brief links added and removed since the last call, as rtnetlink would announce them. Only simulated
+    ///        devices come and go this way
+    /// @return when the next change is due, time_point::max() if none
+    virtual std::chrono::steady_clock::time_point take_link_events(std::vector<std::string> & /*added*/, std::vector<std::string> & /*removed*/)
+    {
+        return std::chrono::steady_clock::time_point::max();
+    }
+};
+
+// The kernel, over one long lived generic netlink socket
+class NetlinkDeviceBackend : public DeviceBackend {
+public:
+    NetlinkDeviceBackend();
+    ~NetlinkDeviceBackend() override;
+    NetlinkDeviceBackend(const NetlinkDeviceBackend &) = delete;
+    NetlinkDeviceBackend &operator=(const NetlinkDeviceBackend &) = delete;
+
+    /// @return 0 or -ENOMEM. The socket itself is opened by the first request
+    int open();
+
+    int scan_devices(wg_device_scan *scans, std::size_t count) override;
+    int set_peer_endpoints(const char *device_name, wg_endpoint_update *updates, std::size_t count) override;
+
+private:
+    wg_nl_context *ctx;
+};
+
+struct FakeDeviceOptions {
+    // synthetic peers of each device besides the configured ones
+    std::size_t peers;
+    // slept per request, as a netlink round trip
+    std::uint64_t latency_us;
+    // chance per request that the wireguard family is gone (ENOENT). Retried once, like wg_nl_*
+    double enoent_rate;
+    // chance per dump that a peer changes meanwhile (EINTR). The dump restarts, like the kernel's
+    double eintr_rate;
+    // age of the last handshake of every peer in s, at each dump. -1 for no handshake ever
+    std::int64_t handshake_age_s;
+
+    // a device that doesn't exist, to dumps and sets alike (ENODEV), from and until these ms after start
+    struct MissingDevice {
+        std::string name;
+        std::uint64_t from_ms;
+        // UINT64_MAX if it never comes back
+        std::uint64_t until_ms;
+    };
+    std::vector<MissingDevice> missing;
+};
+
+/// @brief parse comma separated options: peers=N, latency-us=N, enoent=RATE, eintr=RATE, handshake=S|none,
+///        missing=DEV[:FROM-UNTIL], repeatable
+/// @return 0 or -EINVAL
+int parse_fake_device_options(const std::string &spec, FakeDeviceOptions &options);
+
+// Devices in memory, for tests and load generation without root or the wireguard module.
+// Every device named by the peers exists, holding its synthetic peers then its configured ones,
+// so finding a configured peer reads the whole dump. A peer with a handshake keeps receiving.
+// Devices are dumped fake_concurrent_dumps at a time, in a round trip. A batch of endpoints
+// is set in requests of fake_peers_per_set peers, each a round trip.
+class FakeDeviceBackend : public DeviceBackend {
+public:
+    FakeDeviceBackend(const FakeDeviceOptions &options, const std::vector<PeerConfig> &peers);
+
+    int scan_devices(wg_device_scan *scans, std::size_t count) override;
+    int set_peer_endpoints(const char *device_name, wg_endpoint_update *updates, std::size_t count) override;
+    std::chrono::steady_clock::time_point take_link_events(std::vector<std::string> &added, std::vector<std::string> &removed) override;
+
+private:
+    struct Device {
+        std::vector<wg_peer_status> peers;
+        // public key to index into peers
+        std::unordered_map<std::string, std::size_t> index;
+    };
+
+    // nullptr if there's no such device, or it's missing now
+    Device *find_device(const char *device_name);
+    bool is_missing(const std::string &device_name, std::uint64_t now_ms) const;
+    std::uint64_t ms_since_start() const;
+    void add_peer(Device &device, const wg_key public_key);
+    int scan_device(const char *device_name, wg_peer_scan_cb cb, void *data);
+    void round_trip();
+    // draws the ENOENT faults of a request and of its retry
+    bool fail_request();
+    bool draw(double rate);
+
+    FakeDeviceOptions options;
+    std::unordered_map<std::string, Device> devices;
+    std::mt19937 rng;
+    std::chrono::steady_clock::time_point start;
+    // per device of options.missing, whether its link was last announced present
+    std::unordered_map<std::string, bool> announced_present;
+};
+
+#endif
@@ -0,0 +1,716 @@
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "dns.h"
+#include "async_log.h"
+
+// glibc honors 3. Answers are raced, so more only costs a few packets.
+// Also bounded by the width of Question::failed_servers
+static const std::size_t max_nameservers = 16;
+static const std::size_t max_dns_message = 4096;
+static const std::size_t max_cname_chain = 8;
+
+static const std::uint16_t dns_type_a = 1;
+static const std::uint16_t dns_type_cname = 5;
+static const std::uint16_t dns_type_soa = 6;
+static const std::uint16_t dns_type_aaaa = 28;
+static const std::uint16_t dns_class_in = 1;
+
+static const std::uint8_t dns_rcode_noerror = 0;
+static const std::uint8_t dns_rcode_nxdomain = 3;
+
+static std::uint16_t read_u16(const std::uint8_t *p)
+{
+    return static_cast<std::uint16_t>(p[0] << 8 | p[1]);
+}
+
+static std::uint32_t read_u32(const std::uint8_t *p)
+{
+    return static_cast<std::uint32_t>(p[0]) << 24 | static_cast<std::uint32_t>(p[1]) << 16 | static_cast<std::uint32_t>(p[2]) << 8 | p[3];
+}
+
+static void write_u16(std::uint8_t *p, std::uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+// lower case, no trailing dot
+static std::string normalize_hostname(const std::string &hostname)
+{
+    std::string name(hostname);
+    if (!name.empty() && name.back() == '.') {
+        name.pop_back();
+    }
+    std::transform(name.begin(), name.end(), name.begin(), [](char c) { return std::tolower(static_cast<unsigned char>(c)); });
+    return name;
+}
+
+/// @brief encode a question section
+/// @return length of the whole message, or -EINVAL if the name can't be encoded
+static int build_query(std::uint8_t *buf, std::size_t buflen, const std::string &name, std::uint16_t id, std::uint16_t qtype)
+{
+    // header + root label + qtype + qclass
+    if (name.empty() || name.size() > 253 || buflen < 12 + name.size() + 2 + 4) {
+        return -EINVAL;
+    }
+
+    std::memset(buf, 0, 12);
+    write_u16(buf, id);
+    // RD
+    buf[2] = 0x01;
+    // QDCOUNT
+    write_u16(buf + 4, 1);
+
+    std::size_t off = 12;
+    std::size_t label_start = 0;
+    while (label_start <= name.size()) {
+        std::size_t dot = name.find('.', label_start);
+        if (dot == std::string::npos) {
+            dot = name.size();
+        }
+        std::size_t label_len = dot - label_start;
+        if (label_len == 0 || label_len > 63) {
+            return -EINVAL;
+        }
+        buf[off++] = static_cast<std::uint8_t>(label_len);
+        std::memcpy(buf + off, name.data() + label_start, label_len);
+        off += label_len;
+        label_start = dot + 1;
+    }
+    buf[off++] = 0;
+    write_u16(buf + off, qtype);
+    write_u16(buf + off + 2, dns_class_in);
+    off += 4;
+    return static_cast<int>(off);
+}
+
+/// @brief decompress a name at off into a lower case dotted string without trailing dot
+/// @param off advanced past the name in place
+/// @return false if malformed
+static bool read_name(const std::uint8_t *msg, std::size_t len, std::size_t &off, char (&out)[256])
+{
+    std::size_t pos = off;
+    std::size_t out_len = 0;
+    bool jumped = false;
+    // bounds pointer loops
+    int hops = 0;
+
+    while (true) {
+        if (pos >= len) {
+            return false;
+        }
+        std::uint8_t label_len = msg[pos];
+        if ((label_len & 0xc0) == 0xc0) {
+            if (pos + 1 >= len || ++hops > 16) {
+                return false;
+            }
+            if (!jumped) {
+                off = pos + 2;
+                jumped = true;
+            }
+            pos = (label_len & 0x3f) << 8 | msg[pos + 1];
+            continue;
+        }
+        if (label_len & 0xc0) {
+            return false;
+        }
+        if (label_len == 0) {
+            if (!jumped) {
+                off = pos + 1;
+            }
+            break;
+        }
+        if (pos + 1 + label_len > len || out_len + label_len + 1 >= sizeof(out)) {
+            return false;
+        }
+        if (out_len) {
+            out[out_len++] = '.';
+        }
+        for (std::size_t i = 0; i < label_len; ++i) {
+            out[out_len++] = std::tolower(msg[pos + 1 + i]);
+        }
+        pos += 1 + label_len;
+    }
+    out[out_len] = '\0';
+    return true;
+}
+
+static bool skip_name(const std::uint8_t *msg, std::size_t len, std::size_t &off)
+{
+    char unused[256];
+    return read_name(msg, len, off, unused);
+}
+
+static bool is_same_sockaddr(const sockaddr_storage &a, const sockaddr_storage &b)
+{
+    if (a.ss_family != b.ss_family) {
+        return false;
+    }
+    switch (a.ss_family) {
+    case AF_INET: {
+        const sockaddr_in &a4 = reinterpret_cast<const sockaddr_in &>(a);
+        const sockaddr_in &b4 = reinterpret_cast<const sockaddr_in &>(b);
+        return a4.sin_port == b4.sin_port && !std::memcmp(&a4.sin_addr, &b4.sin_addr, sizeof(in_addr));
+    }
+    case AF_INET6: {
+        const sockaddr_in6 &a6 = reinterpret_cast<const sockaddr_in6 &>(a);
+        const sockaddr_in6 &b6 = reinterpret_cast<const sockaddr_in6 &>(b);
+        return a6.sin6_port == b6.sin6_port && !std::memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof(in6_addr));
+    }
+    default:
+        return false;
+    }
+}
+
+static socklen_t sockaddr_len(const sockaddr_storage &addr)
+{
+    return addr.ss_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+}
+
+bool parse_ip_literal(const std::string &str, sockaddr_storage &addr)
+{
+    std::memset(&addr, 0, sizeof(addr));
+    sockaddr_in &addr4 = reinterpret_cast<sockaddr_in &>(addr);
+    if (inet_pton(AF_INET, str.c_str(), &addr4.sin_addr) == 1) {
+        addr4.sin_family = AF_INET;
+        return true;
+    }
+    sockaddr_in6 &addr6 = reinterpret_cast<sockaddr_in6 &>(addr);
+    if (inet_pton(AF_INET6, str.c_str(), &addr6.sin6_addr) == 1) {
+        addr6.sin6_family = AF_INET6;
+        return true;
+    }
+    return false;
+}
+
+DnsQuery::DnsQuery(const DnsResolver &resolver, const std::string &hostname, int family)
+    : resolver(resolver)
+    , hostname(normalize_hostname(hostname))
+    , socket_v4(-1)
+    , socket_v6(-1)
+    , retransmitted(false)
+{
+    if (family == AF_INET || (family == AF_UNSPEC && resolver.should_query(AF_INET))) {
+        questions.push_back({ dns_type_a, resolver.next_id(), DnsStatus::Pending, 0, 0 });
+    }
+    if (family == AF_INET6 || (family == AF_UNSPEC && resolver.should_query(AF_INET6))) {
+        questions.push_back({ dns_type_aaaa, resolver.next_id(), DnsStatus::Pending, 0, 0 });
+    }
+}
+
+DnsQuery::~DnsQuery()
+{
+    for (int fd : sockets) {
+        close(fd);
+    }
+}
+
+int DnsQuery::start(std::chrono::steady_clock::time_point now)
+{
+    const std::vector<sockaddr_storage> &servers = resolver.nameservers();
+    if (servers.empty()) {
+        for (Question &q : questions) {
+            q.status = DnsStatus::Failed;
+        }
+        return -255;
+    }
+
+    // one socket per family in use. the kernel picks a random source port for each
+    for (const sockaddr_storage &server : servers) {
+        int &fd = server.ss_family == AF_INET ? socket_v4 : socket_v6;
+        if (fd >= 0) {
+            continue;
+        }
+        fd = socket(server.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            async_log(LOG_ERR, "DNS socket: %s", std::strerror(errno));
+            continue;
+        }
+        sockets.push_back(fd);
+    }
+
+    deadline = now + std::chrono::milliseconds(resolver.timeout_ms());
+    retransmit_at = now + std::chrono::milliseconds(resolver.timeout_ms() / 2);
+    send_questions(false);
+    return 0;
+}
+
+void DnsQuery::send_questions(bool only_pending)
+{
+    const std::vector<sockaddr_storage> &servers = resolver.nameservers();
+    std::uint8_t buf[512];
+
+    for (Question &q : questions) {
+        if (only_pending && q.status != DnsStatus::Pending) {
+            continue;
+        }
+        int len = build_query(buf, sizeof(buf), hostname, q.id, q.qtype);
+        if (len < 0) {
+            async_log(LOG_DEBUG, "Resolve error: %s is not a valid hostname", hostname.c_str());
+            q.status = DnsStatus::Failed;
+            continue;
+        }
+
+        for (std::size_t i = 0; i < servers.size(); ++i) {
+            if (q.failed_servers & (1U << i)) {
+                continue;
+            }
+            int fd = servers[i].ss_family == AF_INET ? socket_v4 : socket_v6;
+            if (fd < 0 || sendto(fd, buf, len, 0, reinterpret_cast<const sockaddr *>(&servers[i]), sockaddr_len(servers[i])) != len) {
+                // e.g. ENETUNREACH to a v6 name server on a v4 only host
+                mark_failed(q, i);
+            }
+        }
+    }
+}
+
+int DnsQuery::nameserver_index(const sockaddr_storage &from) const
+{
+    const std::vector<sockaddr_storage> &servers = resolver.nameservers();
+    for (std::size_t i = 0; i < servers.size(); ++i) {
+        if (is_same_sockaddr(servers[i], from)) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+void DnsQuery::mark_failed(Question &q, std::size_t server)
+{
+    q.failed_servers |= 1U << server;
+    if (__builtin_popcount(q.failed_servers) >= static_cast<int>(resolver.nameservers().size())) {
+        q.status = DnsStatus::Failed;
+    }
+}
+
+void DnsQuery::on_readable(int fd)
+{
+    std::uint8_t buf[max_dns_message];
+    while (true) {
+        sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+        ssize_t len = recvfrom(fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr *>(&from), &from_len);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN, or ICMP errors on some kernels. Either way nothing more to read now
+            break;
+        }
+        int server = nameserver_index(from);
+        if (server < 0) {
+            continue;
+        }
+        handle_response(buf, static_cast<std::size_t>(len), server);
+    }
+}
+
+void DnsQuery::handle_response(const std::uint8_t *buf, std::size_t len, std::size_t server)
+{
+    if (len < 12) {
+        return;
+    }
+    std::uint16_t id = read_u16(buf);
+    std::uint16_t flags = read_u16(buf + 2);
+    bool is_response = flags & 0x8000;
+    bool truncated = flags & 0x0200;
+    std::uint8_t rcode = flags & 0x000f;
+    std::uint16_t qdcount = read_u16(buf + 4);
+    std::uint16_t ancount = read_u16(buf + 6);
+    std::uint16_t nscount = read_u16(buf + 8);
+
+    auto q = std::find_if(questions.begin(), questions.end(), [id](const Question &q) { return q.id == id; });
+    if (q == questions.end() || q->status != DnsStatus::Pending || !is_response || qdcount != 1) {
+        return;
+    }
+
+    // the question must be echoed back as is
+    std::size_t off = 12;
+    char name[256];
+    if (!read_name(buf, len, off, name) || off + 4 > len || hostname != name || read_u16(buf + off) != q->qtype || read_u16(buf + off + 2) != dns_class_in) {
+        return;
+    }
+    off += 4;
+
+    if (rcode != dns_rcode_noerror && rcode != dns_rcode_nxdomain) {
+        mark_failed(*q, server);
+        return;
+    }
+
+    // follow the CNAME chain from the question name
+    char chain[max_cname_chain][256];
+    std::size_t chain_len = 1;
+    std::strcpy(chain[0], name);
+    auto in_chain = [&chain, &chain_len](const char *owner) {
+        for (std::size_t i = 0; i < chain_len; ++i) {
+            if (!std::strcmp(chain[i], owner)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    std::size_t found = 0;
+    std::uint32_t min_ttl = UINT32_MAX;
+    for (std::uint16_t i = 0; i < ancount; ++i) {
+        char owner[256];
+        if (!read_name(buf, len, off, owner) || off + 10 > len) {
+            // a truncated message may stop in the middle of a record
+            break;
+        }
+        std::uint16_t type = read_u16(buf + off);
+        std::uint16_t klass = read_u16(buf + off + 2);
+        std::uint32_t ttl = read_u32(buf + off + 4);
+        std::uint16_t rdlength = read_u16(buf + off + 8);
+        off += 10;
+        if (off + rdlength > len) {
+            break;
+        }
+        const std::uint8_t *rdata = buf + off;
+        off += rdlength;
+
+        if (klass != dns_class_in || !in_chain(owner)) {
+            continue;
+        }
+        if (type == dns_type_cname) {
+            std::size_t target_off = rdata - buf;
+            if (chain_len < max_cname_chain && read_name(buf, len, target_off, chain[chain_len])) {
+                ++chain_len;
+                min_ttl = std::min(min_ttl, ttl);
+            }
+            continue;
+        }
+        if (type != q->qtype) {
+            continue;
+        }
+
+        sockaddr_storage addr = { 0 };
+        if (type == dns_type_a && rdlength == sizeof(in_addr)) {
+            sockaddr_in &addr4 = reinterpret_cast<sockaddr_in &>(addr);
+            addr4.sin_family = AF_INET;
+            std::memcpy(&addr4.sin_addr, rdata, sizeof(in_addr));
+        } else if (type == dns_type_aaaa && rdlength == sizeof(in6_addr)) {
+            sockaddr_in6 &addr6 = reinterpret_cast<sockaddr_in6 &>(addr);
+            addr6.sin6_family = AF_INET6;
+            std::memcpy(&addr6.sin6_addr, rdata, sizeof(in6_addr));
+        } else {
+            continue;
+        }
+        answers.push_back(addr);
+        min_ttl = std::min(min_ttl, ttl);
+        ++found;
+    }
+
+    if (found) {
+        q->status = DnsStatus::Ok;
+        q->ttl = min_ttl;
+        return;
+    }
+
+    if (truncated) {
+        // no TCP fallback. Let other name servers race
+        mark_failed(*q, server);
+        return;
+    }
+
+    // negative caching TTL, RFC 2308: min(SOA TTL, SOA MINIMUM)
+    std::uint32_t negative_ttl = 0;
+    for (std::uint16_t i = 0; i < nscount; ++i) {
+        if (!skip_name(buf, len, off) || off + 10 > len) {
+            break;
+        }
+        std::uint16_t type = read_u16(buf + off);
+        std::uint32_t ttl = read_u32(buf + off + 4);
+        std::uint16_t rdlength = read_u16(buf + off + 8);
+        off += 10;
+        if (off + rdlength > len) {
+            break;
+        }
+        std::size_t rdata_off = off;
+        off += rdlength;
+        if (type != dns_type_soa) {
+            continue;
+        }
+        // mname, rname, serial, refresh, retry, expire, minimum
+        if (skip_name(buf, len, rdata_off) && skip_name(buf, len, rdata_off) && rdata_off + 20 <= off) {
+            negative_ttl = std::min(ttl, read_u32(buf + rdata_off + 16));
+        }
+        break;
+    }
+
+    q->status = DnsStatus::NotFound;
+    q->ttl = negative_ttl;
+}
+
+void DnsQuery::on_timer(std::chrono::steady_clock::time_point now)
+{
+    if (done()) {
+        return;
+    }
+    if (now >= deadline) {
+        for (Question &q : questions) {
+            if (q.status == DnsStatus::Pending) {
+                q.status = DnsStatus::Failed;
+            }
+        }
+        return;
+    }
+    if (!retransmitted && now >= retransmit_at) {
+        // one retransmission covers a lost datagram without waiting for the deadline
+        retransmitted = true;
+        send_questions(true);
+    }
+}
+
+bool DnsQuery::done() const
+{
+    return std::none_of(questions.begin(), questions.end(), [](const Question &q) { return q.status == DnsStatus::Pending; });
+}
+
+std::chrono::steady_clock::time_point DnsQuery::next_timeout() const
+{
+    return retransmitted ? deadline : retransmit_at;
+}
+
+int DnsQuery::result(std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl, int family) const
+{
+    bool found = false;
+    bool all_not_found = true;
+    bool any_question = false;
+    std::uint32_t found_ttl = UINT32_MAX;
+    std::uint32_t not_found_ttl = UINT32_MAX;
+    for (const Question &q : questions) {
+        if (family != AF_UNSPEC && family != (q.qtype == dns_type_a ? AF_INET : AF_INET6)) {
+            continue;
+        }
+        any_question = true;
+        switch (q.status) {
+        case DnsStatus::Ok:
+            found = true;
+            all_not_found = false;
+            found_ttl = std::min(found_ttl, q.ttl);
+            break;
+        case DnsStatus::NotFound:
+            not_found_ttl = std::min(not_found_ttl, q.ttl);
+            break;
+        default:
+            all_not_found = false;
+            break;
+        }
+    }
+
+    addresses.clear();
+    if (found) {
+        auto sockaddr_storage_less = [](const sockaddr_storage &a, const sockaddr_storage &b) { return std::memcmp(&a, &b, sizeof(a)) < 0; };
+        auto sockaddr_storage_equal = [](const sockaddr_storage &a, const sockaddr_storage &b) { return std::memcmp(&a, &b, sizeof(a)) == 0; };
+        std::copy_if(answers.begin(), answers.end(), std::back_inserter(addresses), [family](const sockaddr_storage &addr) { return family == AF_UNSPEC || addr.ss_family == family; });
+        std::sort(addresses.begin(), addresses.end(), sockaddr_storage_less);
+        addresses.erase(std::unique(addresses.begin(), addresses.end(), sockaddr_storage_equal), addresses.end());
+        ttl = found_ttl;
+        return 0;
+    }
+    if (all_not_found && any_question) {
+        ttl = not_found_ttl;
+        return -254;
+    }
+    ttl = 0;
+    return -255;
+}
+
+DnsResolver::DnsResolver(std::uint64_t timeout_ms)
+    : timeout(timeout_ms)
+    , want_v4(true)
+    , want_v6(true)
+{
+}
+
+int DnsResolver::load_resolv_conf(const char *path)
+{
+    std::ifstream file(path);
+    if (!file) {
+        return -errno;
+    }
+
+    int loaded = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string keyword;
+        std::string address;
+        if (!(iss >> keyword >> address) || keyword != "nameserver") {
+            continue;
+        }
+        if (add_nameserver(address) == 0) {
+            ++loaded;
+        } else {
+            async_log(LOG_WARNING, "Ignoring invalid name server %s in %s", address.c_str(), path);
+        }
+    }
+    return loaded;
+}
+
+int DnsResolver::add_nameserver(const std::string &address)
+{
+    if (servers.size() >= max_nameservers) {
+        return -ENOSPC;
+    }
+
+    std::string host(address);
+    std::string port_str;
+    std::string scope;
+
+    if (!host.empty() && host.front() == '[') {
+        // [ip6]:port
+        std::size_t close = host.find(']');
+        if (close == std::string::npos || (close + 1 < host.size() && host[close + 1] != ':')) {
+            return -EINVAL;
+        }
+        port_str = close + 2 < host.size() ? host.substr(close + 2) : std::string();
+        host = host.substr(1, close - 1);
+    } else if (host.find('#') != std::string::npos) {
+        // ip#port
+        port_str = host.substr(host.find('#') + 1);
+        host.erase(host.find('#'));
+    } else if (std::count(host.begin(), host.end(), ':') == 1) {
+        // ip4:port
+        port_str = host.substr(host.find(':') + 1);
+        host.erase(host.find(':'));
+    }
+
+    std::uint16_t port = 53;
+    if (!port_str.empty()) {
+        char *end = nullptr;
+        unsigned long p = std::strtoul(port_str.c_str(), &end, 10);
+        if (*end != '\0' || p == 0 || p > 65535) {
+            return -EINVAL;
+        }
+        port = static_cast<std::uint16_t>(p);
+    }
+
+    std::size_t scope_sep = host.find('%');
+    if (scope_sep != std::string::npos) {
+        scope = host.substr(scope_sep + 1);
+        host.erase(scope_sep);
+    }
+
+    sockaddr_storage addr;
+    if (!parse_ip_literal(host, addr)) {
+        return -EINVAL;
+    }
+    if (addr.ss_family == AF_INET) {
+        reinterpret_cast<sockaddr_in &>(addr).sin_port = htons(port);
+    } else {
+        sockaddr_in6 &addr6 = reinterpret_cast<sockaddr_in6 &>(addr);
+        addr6.sin6_port = htons(port);
+        if (!scope.empty()) {
+            addr6.sin6_scope_id = if_nametoindex(scope.c_str());
+            if (!addr6.sin6_scope_id) {
+                addr6.sin6_scope_id = std::strtoul(scope.c_str(), nullptr, 10);
+            }
+        }
+    }
+    servers.push_back(addr);
+    return 0;
+}
+
+void DnsResolver::refresh_address_families()
+{
+    ifaddrs *ifaddr;
+    if (getifaddrs(&ifaddr) < 0) {
+        want_v4 = true;
+        want_v6 = true;
+        return;
+    }
+
+    // stored once done, so a concurrent should_query never sees neither family
+    bool has_v4 = false;
+    bool has_v6 = false;
+    for (const ifaddrs *ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || (ifa->ifa_flags & IFF_LOOPBACK)) {
+            continue;
+        }
+        if (ifa->ifa_addr->sa_family == AF_INET) {
+            has_v4 = true;
+        } else if (ifa->ifa_addr->sa_family == AF_INET6) {
+            const in6_addr &addr6 = reinterpret_cast<const sockaddr_in6 *>(ifa->ifa_addr)->sin6_addr;
+            if (!IN6_IS_ADDR_LINKLOCAL(&addr6)) {
+                has_v6 = true;
+            }
+        }
+    }
+    freeifaddrs(ifaddr);
+    want_v4 = has_v4;
+    want_v6 = has_v6;
+}
+
+bool DnsResolver::should_query(int family) const
+{
+    // no global address at all. ask for both and let the caller decide
+    bool v4 = want_v4;
+    bool v6 = want_v6;
+    if (!v4 && !v6) {
+        return true;
+    }
+    return family == AF_INET ? v4 : v6;
+}
+
+std::uint16_t DnsResolver::next_id() const
+{
+    thread_local std::mt19937 rng(std::random_device {}());
+    return static_cast<std::uint16_t>(rng());
+}
+
+int DnsResolver::resolve(const std::string &hostname, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl) const
+{
+    sockaddr_storage literal;
+    if (parse_ip_literal(hostname, literal)) {
+        addresses.assign(1, literal);
+        ttl = 0;
+        return 0;
+    }
+
+    DnsQuery query(*this, hostname);
+    query.start(std::chrono::steady_clock::now());
+    wait(query);
+    return query.result(addresses, ttl);
+}
+
+void DnsResolver::wait(DnsQuery &query) const
+{
+    std::vector<pollfd> pfds;
+    for (int fd : query.fds()) {
+        pfds.push_back({ fd, POLLIN, 0 });
+    }
+
+    while (!query.done()) {
+        auto now = std::chrono::steady_clock::now();
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(query.next_timeout() - now).count();
+        int rc = poll(pfds.data(), pfds.size(), wait > 0 ? static_cast<int>(wait) + 1 : 0);
+        if (rc < 0 && errno != EINTR) {
+            async_log(LOG_ERR, "DNS poll: %s", std::strerror(errno));
+            break;
+        }
+        for (const pollfd &pfd : pfds) {
+            if (pfd.revents & POLLIN) {
+                query.on_readable(pfd.fd);
+            }
+        }
+        query.on_timer(std::chrono::steady_clock::now());
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+enum class DnsStatus {
+    Pending,
+    // at least one address is returned
+    Ok,
+    // NXDOMAIN, or NOERROR without any address (NODATA)
+    NotFound,
+    // timeout, SERVFAIL, REFUSED, malformed responses...
+    Failed,
+};
+
+class DnsResolver;
+
+// A single hostname lookup. A and AAAA questions are sent to every name server in parallel,
+// and the first usable answer of each question wins.
+// The query never blocks: the caller polls fds(), then feeds on_readable() and on_timer().
+class DnsQuery {
+public:
+    /// @param family AF_INET or AF_INET6 to ask for one family only. AF_UNSPEC for both as the resolver suggests
+    DnsQuery(const DnsResolver &resolver, const std::string &hostname, int family = AF_UNSPEC);
+    ~DnsQuery();
+    DnsQuery(const DnsQuery &) = delete;
+    DnsQuery &operator=(const DnsQuery &) = delete;
+
+    int start(std::chrono::steady_clock::time_point now);
+    void on_readable(int fd);
+    void on_timer(std::chrono::steady_clock::time_point now);
+
+    bool done() const;
+    std::chrono::steady_clock::time_point next_timeout() const;
+    const std::vector<int> &fds() const { return sockets; }
+
+    /// @brief
+    /// @param addresses sorted and deduplicated
+    /// @param ttl min TTL of the answer, or the negative caching TTL from SOA. 0 if unknown
+    /// @param family only consider the answer of this family. AF_UNSPEC for all
+    /// @return 0 if found. -254 if no host found. -255 other failures.
+    int result(std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl, int family = AF_UNSPEC) const;
+
+private:
+    struct Question {
+        std::uint16_t qtype;
+        std::uint16_t id;
+        DnsStatus status;
+        // bit per name server that answered with failure
+        std::uint32_t failed_servers;
+        std::uint32_t ttl;
+    };
+
+    void send_questions(bool only_pending);
+    void handle_response(const std::uint8_t *buf, std::size_t len, std::size_t server);
+    void mark_failed(Question &q, std::size_t server);
+    int nameserver_index(const sockaddr_storage &from) const;
+
+    const DnsResolver &resolver;
+    std::string hostname;
+    std::vector<Question> questions;
+    std::vector<int> sockets;
+    int socket_v4;
+    int socket_v6;
+    std::vector<sockaddr_storage> answers;
+    std::chrono::steady_clock::time_point retransmit_at;
+    std::chrono::steady_clock::time_point deadline;
+    bool retransmitted;
+};
+
+class DnsResolver {
+public:
+    /// @param timeout_ms per query deadline
+    explicit DnsResolver(std::uint64_t timeout_ms);
+
+    /// @brief load name servers from resolv.conf
+    /// @return number of name servers loaded, or negative errno
+    int load_resolv_conf(const char *path);
+    /// @brief add a name server. Accepts "ip", "ip%scope", "ip#port", "ip4:port" and "[ip6]:port"
+    /// @return 0 on success, -EINVAL on invalid address
+    int add_nameserver(const std::string &address);
+    // Only ask for A/AAAA when the host has an address of that family, like AI_ADDRCONFIG.
+    void refresh_address_families();
+
+    const std::vector<sockaddr_storage> &nameservers() const { return servers; }
+    std::uint64_t timeout_ms() const { return timeout; }
+    // whether a lookup of AF_UNSPEC asks for the family
+    bool should_query(int family) const;
+
+    // Blocking resolution bounded by the query deadline. Same return convention as DnsQuery::result.
+    int resolve(const std::string &hostname, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl) const;
+    // Drive a started query to completion, blocking.
+    void wait(DnsQuery &query) const;
+
+    std::uint16_t next_id() const;
+
+private:
+    std::vector<sockaddr_storage> servers;
+    std::uint64_t timeout;
+    // written by the main thread, read by the refresher of DnsCache too
+    std::atomic<bool> want_v4;
+    std::atomic<bool> want_v6;
+};
+
+// Parse an IPv4 or IPv6 literal. The port is left 0.
+bool parse_ip_literal(const std::string &str, sockaddr_storage &addr);
+
+#endif
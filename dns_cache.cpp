@@ -0,0 +1,251 @@
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+
+#include "dns_cache.h"
+#include "async_log.h"
+
+DnsCache::DnsCache(const DnsResolver &resolver, std::uint64_t max_stale_ms)
+    : resolver(resolver)
+    , max_stale(max_stale_ms)
+    , counters { 0, 0, 0, 0 }
+    , generation(0)
+    , stopping(false)
+    , refresher(&DnsCache::refresh_worker, this)
+{
+}
+
+DnsCache::~DnsCache()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    refresh_cv.notify_all();
+    refresher.join();
+}
+
+void DnsCache::store(const Key &key, int rc, const std::vector<sockaddr_storage> &addresses, std::uint32_t ttl, std::chrono::steady_clock::time_point now)
+{
+    if (rc != 0 && rc != -254) {
+        // failures aren't cached. A stale entry, if any, stays
+        return;
+    }
+    if (ttl == 0) {
+        // TTL 0 is not to be cached, RFC 1035. So is a negative answer without SOA, RFC 2308
+        entries.erase(key);
+        return;
+    }
+
+    Entry &entry = entries[key];
+    entry.rc = rc;
+    entry.addresses = addresses;
+    entry.expires = now + std::chrono::seconds(ttl);
+}
+
+void DnsCache::make_parts(std::vector<Part> &parts) const
+{
+    parts.clear();
+    for (int family : { AF_INET, AF_INET6 }) {
+        if (resolver.should_query(family)) {
+            parts.push_back({ family, -255, {}, 0, false });
+        }
+    }
+}
+
+void DnsCache::read_parts(const std::string &hostname, std::vector<Part> &parts, std::chrono::steady_clock::time_point now, bool &stale)
+{
+    stale = false;
+    for (Part &part : parts) {
+        Key key(hostname, part.family);
+        auto it = entries.find(key);
+        if (it != entries.end() && now >= it->second.expires + max_stale) {
+            entries.erase(it);
+            it = entries.end();
+        }
+        if (it == entries.end()) {
+            continue;
+        }
+
+        const Entry &entry = it->second;
+        part.rc = entry.rc;
+        part.addresses = entry.addresses;
+        part.cached = true;
+        if (now < entry.expires) {
+            part.ttl = static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(entry.expires - now).count());
+            // don't hand out a TTL 0 which reads as unknown
+            part.ttl = std::max<std::uint32_t>(part.ttl, 1);
+        } else {
+            part.ttl = 0;
+            stale = true;
+            if (!entry.refreshing) {
+                it->second.refreshing = true;
+                refresh_queue.push_back(key);
+                refresh_cv.notify_one();
+            }
+        }
+    }
+}
+
+int DnsCache::lookup_cached(const std::string &hostname, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl, int &query_family)
+{
+    sockaddr_storage literal;
+    if (parse_ip_literal(hostname, literal)) {
+        addresses.assign(1, literal);
+        ttl = 0;
+        return 0;
+    }
+
+    std::vector<Part> parts;
+    make_parts(parts);
+    bool stale;
+    std::size_t missing = 0;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        read_parts(hostname, parts, std::chrono::steady_clock::now(), stale);
+        for (const Part &part : parts) {
+            if (!part.cached) {
+                query_family = part.family;
+                ++missing;
+            }
+        }
+
+        if (missing) {
+            ++counters.misses;
+        } else if (stale) {
+            ++counters.stale_served;
+        } else {
+            ++counters.hits;
+        }
+    }
+
+    if (missing) {
+        // one query for whatever isn't cached. Both families if neither is
+        if (missing == parts.size()) {
+            query_family = AF_UNSPEC;
+        }
+        return -EAGAIN;
+    }
+    return combine(parts, addresses, ttl);
+}
+
+int DnsCache::complete(const std::string &hostname, const DnsQuery &query, int query_family, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl)
+{
+    std::vector<Part> parts;
+    make_parts(parts);
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        bool stale;
+        read_parts(hostname, parts, now, stale);
+        for (Part &part : parts) {
+            if (query_family != AF_UNSPEC && query_family != part.family) {
+                continue;
+            }
+            // the fresh answer wins over whatever was cached meanwhile
+            part.rc = query.result(part.addresses, part.ttl, part.family);
+            store(Key(hostname, part.family), part.rc, part.addresses, part.ttl, now);
+        }
+    }
+    return combine(parts, addresses, ttl);
+}
+
+int DnsCache::lookup(const std::string &hostname, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl)
+{
+    int query_family;
+    int rc = lookup_cached(hostname, addresses, ttl, query_family);
+    if (rc != -EAGAIN) {
+        return rc;
+    }
+
+    DnsQuery query(resolver, hostname, query_family);
+    query.start(std::chrono::steady_clock::now());
+    resolver.wait(query);
+    return complete(hostname, query, query_family, addresses, ttl);
+}
+
+int DnsCache::combine(const std::vector<Part> &parts, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl)
+{
+    bool found = false;
+    bool all_not_found = !parts.empty();
+    std::uint32_t found_ttl = UINT32_MAX;
+    std::uint32_t not_found_ttl = UINT32_MAX;
+    addresses.clear();
+    for (const Part &part : parts) {
+        if (part.rc == 0) {
+            found = true;
+            all_not_found = false;
+            found_ttl = std::min(found_ttl, part.ttl);
+            addresses.insert(addresses.end(), part.addresses.begin(), part.addresses.end());
+        } else if (part.rc == -254) {
+            not_found_ttl = std::min(not_found_ttl, part.ttl);
+        } else {
+            all_not_found = false;
+        }
+    }
+
+    if (found) {
+        std::sort(addresses.begin(), addresses.end(), [](const sockaddr_storage &a, const sockaddr_storage &b) { return std::memcmp(&a, &b, sizeof(a)) < 0; });
+        ttl = found_ttl;
+        return 0;
+    }
+    if (all_not_found) {
+        ttl = not_found_ttl;
+        return -254;
+    }
+    ttl = 0;
+    return -255;
+}
+
+void DnsCache::refresh_worker()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        refresh_cv.wait(guard, [this] { return stopping || !refresh_queue.empty(); });
+        if (stopping) {
+            return;
+        }
+        Key key = refresh_queue.front();
+        refresh_queue.pop_front();
+        std::uint64_t started_generation = generation;
+
+        guard.unlock();
+        DnsQuery query(resolver, key.first, key.second);
+        query.start(std::chrono::steady_clock::now());
+        resolver.wait(query);
+        std::vector<sockaddr_storage> addresses;
+        std::uint32_t ttl;
+        int rc = query.result(addresses, ttl, key.second);
+        guard.lock();
+
+        ++counters.refreshes;
+        if (generation != started_generation) {
+            // resolved before the cache was cleared
+            continue;
+        }
+        if (rc < 0 && rc != -254) {
+            async_log(LOG_DEBUG, "Background refresh of %s failed, serving stale answer", key.first.c_str());
+        }
+        store(key, rc, addresses, ttl, std::chrono::steady_clock::now());
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            it->second.refreshing = false;
+        }
+    }
+}
+
+void DnsCache::clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    // entries being refreshed are dropped as well, and so is the result of their refresh
+    entries.clear();
+    refresh_queue.clear();
+    ++generation;
+}
+
+DnsCacheStats DnsCache::stats() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return counters;
+}
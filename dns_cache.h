@@ -0,0 +1,91 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include "dns.h"
+
+struct DnsCacheStats {
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::uint64_t stale_served;
+    std::uint64_t refreshes;
+};
+
+// Positive and negative answers of the built-in resolver keyed by (hostname, family).
+// An expired entry keeps being served for up to max_stale_ms while a single background
+// refresh runs, so a resolver outage doesn't wipe out known endpoints.
+class DnsCache {
+public:
+    DnsCache(const DnsResolver &resolver, std::uint64_t max_stale_ms);
+    ~DnsCache();
+    DnsCache(const DnsCache &) = delete;
+    DnsCache &operator=(const DnsCache &) = delete;
+
+    /// @brief same convention as resolve_dns. Blocks on a query if anything isn't cached
+    /// @param ttl remaining TTL in seconds. 0 if a stale answer is served
+    int lookup(const std::string &hostname, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl);
+    /// @brief non-blocking half of lookup
+    /// @param query_family set if -EAGAIN: the family to start a DnsQuery for, then pass it to complete()
+    /// @return -EAGAIN if a family isn't cached, otherwise as lookup
+    int lookup_cached(const std::string &hostname, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl, int &query_family);
+    /// @brief store the finished query asked for by lookup_cached and answer as lookup
+    int complete(const std::string &hostname, const DnsQuery &query, int query_family, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl);
+    void clear();
+    DnsCacheStats stats() const;
+
+private:
+    typedef std::pair<std::string, int> Key;
+
+    struct Entry {
+        // 0 or -254
+        int rc;
+        std::vector<sockaddr_storage> addresses;
+        std::chrono::steady_clock::time_point expires;
+        bool refreshing;
+    };
+
+    struct Part {
+        int family;
+        int rc;
+        std::vector<sockaddr_storage> addresses;
+        std::uint32_t ttl;
+        bool cached;
+    };
+
+    // the families lookup answers for, uncached
+    void make_parts(std::vector<Part> &parts) const;
+    // caller holds the lock. Fills the parts found in the cache
+    void read_parts(const std::string &hostname, std::vector<Part> &parts, std::chrono::steady_clock::time_point now, bool &stale);
+    // combine the families the way DnsQuery::result does
+    static int combine(const std::vector<Part> &parts, std::vector<sockaddr_storage> &addresses, std::uint32_t &ttl);
+    // caller holds the lock
+    void store(const Key &key, int rc, const std::vector<sockaddr_storage> &addresses, std::uint32_t ttl, std::chrono::steady_clock::time_point now);
+    void refresh_worker();
+
+    const DnsResolver &resolver;
+    std::chrono::milliseconds max_stale;
+
+    mutable std::mutex lock;
+    std::condition_variable refresh_cv;
+    std::map<Key, Entry> entries;
+    std::deque<Key> refresh_queue;
+    DnsCacheStats counters;
+    // bumped by clear(), so a refresh started before it is dropped
+    std::uint64_t generation;
+    bool stopping;
+    std::thread refresher;
+};
+
+#endif
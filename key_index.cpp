@@ -0,0 +1,82 @@
+#include <cstring>
+
+#include "key_index.h"
+
+KeyIndex::KeyIndex()
+    : mask(0)
+    , count(0)
+{
+}
+
+std::uint64_t KeyIndex::hash_of(const wg_key key)
+{
+    std::uint64_t hash;
+    std::memcpy(&hash, key, sizeof(hash));
+    return hash;
+}
+
+void KeyIndex::reset(std::size_t expected)
+{
+    // at most half full, so probes stay short
+    std::size_t capacity = 8;
+    while (capacity < expected * 2) {
+        capacity *= 2;
+    }
+    if (slots.size() < capacity) {
+        slots.resize(capacity);
+        keys.resize(capacity);
+    }
+    for (std::size_t i = 0; i < capacity; ++i) {
+        slots[i].value = npos;
+    }
+    mask = capacity - 1;
+    count = 0;
+}
+
+bool KeyIndex::insert(const wg_key key, std::uint32_t value)
+{
+    std::size_t capacity = slots.empty() ? 0 : mask + 1;
+    if ((count + 1) * 2 > capacity) {
+        // more than reset() was told. Rehash the keys into a table twice as large
+        std::vector<Slot> old_slots(slots.begin(), slots.begin() + capacity);
+        std::vector<const std::uint8_t *> old_keys(keys.begin(), keys.begin() + capacity);
+        reset(capacity);
+        for (std::size_t i = 0; i < old_slots.size(); ++i) {
+            if (old_slots[i].value != npos) {
+                insert(old_keys[i], old_slots[i].value);
+            }
+        }
+    }
+
+    std::uint64_t hash = hash_of(key);
+    for (std::size_t pos = hash & mask;; pos = (pos + 1) & mask) {
+        Slot &slot = slots[pos];
+        if (slot.value == npos) {
+            slot.hash = hash;
+            slot.value = value;
+            keys[pos] = key;
+            ++count;
+            return true;
+        }
+        if (slot.hash == hash && !std::memcmp(keys[pos], key, sizeof(wg_key))) {
+            return false;
+        }
+    }
+}
+
+std::uint32_t KeyIndex::find(const wg_key key) const
+{
+    if (!count) {
+        return npos;
+    }
+    std::uint64_t hash = hash_of(key);
+    for (std::size_t pos = hash & mask;; pos = (pos + 1) & mask) {
+        const Slot &slot = slots[pos];
+        if (slot.value == npos) {
+            return npos;
+        }
+        if (slot.hash == hash && !std::memcmp(keys[pos], key, sizeof(wg_key))) {
+            return slot.value;
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef KEY_INDEX_H
+#define KEY_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "wireguard.h"
+
+// Open addressing map from public keys to small values, filled then only looked up.
+// Keys are curve points, so their first 8 bytes serve as the hash. Linear probing over
+// 16 byte slots holding those bytes: a miss rarely looks at a key itself.
+// Keys aren't copied and must outlive the index.
+class KeyIndex {
+public:
+    static const std::uint32_t npos = UINT32_MAX;
+
+    KeyIndex();
+
+    /// @brief drop every key and size the table for count of them. Keeps the storage when it fits, using
+    ///        and clearing only the part count needs, so a small scan after a large one stays cheap
+    void reset(std::size_t count);
+    /// @param value less than npos
+    /// @return false if the key is in already, keeping the first value
+    bool insert(const wg_key key, std::uint32_t value);
+    /// @return the value of the key, or npos
+    std::uint32_t find(const wg_key key) const;
+    std::size_t size() const { return count; }
+
+private:
+    struct Slot {
+        std::uint64_t hash;
+        // npos if empty
+        std::uint32_t value;
+    };
+
+    static std::uint64_t hash_of(const wg_key key);
+
+    // the first mask + 1 are in use, the rest is storage kept from larger tables
+    std::vector<Slot> slots;
+    // per slot, only read when the hash matches
+    std::vector<const std::uint8_t *> keys;
+    std::size_t mask;
+    std::size_t count;
+};
+
+#endif
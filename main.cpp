@@ -1,4 +1,3 @@
-#include <csignal>
 #include <cstring>
 #include <iostream>
 
@@ -6,15 +5,26 @@
 #include <syslog.h>
 #include <unistd.h>
 
+#include "async_log.h"
+#include "config_file.h"
 #include "core.h"
+#include "device_backend.h"
+#include "dns.h"
 #include "version/git.h"
 
 void print_help_short(const char *me)
 {
     std::fprintf(stderr,
         "Usage: %s -d wg_device -k peer_pubkey -h hostname -p port [-i interval] [-4] [-6]\n"
+        "       %s -F config_file [-i interval] [-4] [-6]\n"
+        "       [-t dns_timeout] [-S | -b [--nameserver address]... [-c [--dns-max-stale ms]]]\n"
+        "       [-T [--ttl-min ms] [--ttl-max ms] [--ttl-early fraction]]\n"
+        "       [-H [--handshake-stale ms] [--healthy-max ms] [--stale-interval ms]]\n"
+        "       [-B [--backoff-max ms] [--start-jitter ms]]\n"
+        "       [--probe udp:port|tcp:port [--probe-timeout ms] [--probe-hysteresis fraction]]\n"
+        "       [-R] [-N [--network-debounce ms]] [--metrics address] [--fake-wireguard options]\n"
         "       [-D] [-f] [-v] [--help]\n",
-        me);
+        me, me);
 }
 
 void print_help_long_and_exit(const char *me)
@@ -27,9 +37,72 @@ void print_help_long_and_exit(const char *me)
         "   -k, --pubkey        the public key of the peer whose endpoint is to be updated\n"
         "   -h, --hostname      the hostname of the peer endpoint, which will be periodically resolved\n"
         "   -p, --port          the port of the endpoint\n"
-        "   -i, --interval      the interval between hostname resolution\n"
-        "   -4, --prefer-ipv4   prefer IPv4\n"
-        "   -6, --prefer-ipv6   prefer IPv6\n"
+        "   -F, --config        track the peers listed in the file, one per line:\n"
+        "                       device pubkey hostname port [prefer-ipv4|prefer-ipv6] [interval=ms]\n"
+        "                       -d, -k, -h and -p add one more peer if given\n"
+        "   -i, --interval      the interval between hostname resolution, or the fallback when no TTL is\n"
+        "                       available with -T\n"
+        "   -4, --prefer-ipv4   prefer IPv4, unless a peer in the config file says otherwise\n"
+        "   -6, --prefer-ipv6   prefer IPv6, unless a peer in the config file says otherwise\n"
+        "   -t, --dns-timeout   the deadline of a DNS query in ms, default 1000\n"
+        "   -S, --system-resolver\n"
+        "                       resolve with getaddrinfo, the default\n"
+        "   -b, --builtin-resolver\n"
+        "                       resolve with the built-in non-blocking DNS client instead, which gives\n"
+        "                       the TTLs -T and -c need. It queries the name servers of /etc/resolv.conf\n"
+        "                       directly: /etc/hosts, nsswitch and the search, domain and ndots\n"
+        "                       options aren't applied, so use fully qualified hostnames\n"
+        "   --nameserver        query this name server instead of those of /etc/resolv.conf with -b.\n"
+        "                       Repeat for more. Accepts ip, ip%%scope, ip#port, ip4:port and [ip6]:port\n"
+        "   -c, --dns-cache     cache positive and negative answers of the built-in resolver with -b\n"
+        "   --dns-max-stale     how long in ms an expired answer is served while refreshing with -c,\n"
+        "                       default 86400000\n"
+        "   -T, --ttl-refresh   schedule the next resolution from the TTL of the answer, with -b\n"
+        "   --ttl-min           the minimum interval in ms with -T, default 1000\n"
+        "   --ttl-max           the maximum interval in ms with -T, default 3600000\n"
+        "   --ttl-early         the fraction of the TTL to refresh ahead of expiry with -T, default 0.1\n"
+        "   -H, --handshake-aware\n"
+        "                       don't resolve a peer while its last handshake is fresh and it keeps\n"
+        "                       receiving. Check it less often the longer it stays so\n"
+        "   --handshake-stale   the age in ms a handshake is stale at with -H, default 135000:\n"
+        "                       REKEY_AFTER_TIME + REKEY_TIMEOUT + 10 s\n"
+        "   --healthy-max       the longest interval in ms between checks of a healthy peer with -H,\n"
+        "                       default 60000\n"
+        "   --stale-interval    the longest interval in ms between resolutions of a peer whose handshake\n"
+        "                       is stale with -H, default 1000\n"
+        "   -B, --backoff       retry a peer whose resolution fails, or whose device can't be read or\n"
+        "                       set, after exponentially longer random delays. Also spread the first\n"
+        "                       resolutions at start\n"
+        "   --backoff-max       the longest delay in ms between attempts with -B, default 300000\n"
+        "   --start-jitter      the longest delay in ms of the first resolution of a peer with -B,\n"
+        "                       at most its interval, default 1000\n"
+        "   --probe             when a hostname has several addresses, probe each on this port, with a\n"
+        "                       datagram to echo back (udp:7) or a TCP handshake (tcp:443), and use the\n"
+        "                       reachable one of the lowest smoothed RTT. A refusal counts as an answer\n"
+        "   --probe-timeout     how long in ms to wait for the answers of a probe, default 1000\n"
+        "   --probe-hysteresis  the fraction a reachable endpoint has to be beaten by to be replaced with\n"
+        "                       --probe, default 0.2\n"
+        "   -R, --rfc6724       order the addresses of a hostname as RFC 6724 destination address\n"
+        "                       selection does, by the route and source address the kernel has for each,\n"
+        "                       under the fwmark of the device. Addresses without a route are skipped\n"
+        "                       unless none has one. Applies before -4, -6 and --probe\n"
+        "   -N, --network-events\n"
+        "                       drop cached answers and resolve every peer again when a local address\n"
+        "                       or a default route changes\n"
+        "   --network-debounce  how long in ms to collect a burst of changes with -N, default 50\n"
+        "   --metrics           serve Prometheus metrics over HTTP on unix:/path, ip:port or [ip6]:port\n"
+        "   --fake-wireguard    simulate the WireGuard devices in memory instead, for tests and load\n"
+        "                       generation. Comma separated options, each optional:\n"
+        "                       peers=N        synthetic peers per device besides the configured ones\n"
+        "                       latency-us=N   the round trip of each netlink request\n"
+        "                       enoent=RATE    chance in [0, 1) that the wireguard family is gone\n"
+        "                       eintr=RATE     chance in [0, 1) that a dump is interrupted and restarted\n"
+        "                       handshake=S|none\n"
+        "                                      the age of the last handshake of every peer\n"
+        "                       missing=DEV[:FROM-UNTIL]\n"
+        "                                      DEV doesn't exist (ENODEV), from and until ms after start\n"
+        "                                      if given. Its link comes and goes as rtnetlink would tell.\n"
+        "                                      Repeatable\n"
         "   -D, --debug         Enable debug logging\n"
         "   -f, --frontend      Run in frontend. Do not daemonize\n"
         "   -v, --version       Print the version info\n"
@@ -47,6 +120,17 @@ void print_version_and_exit()
     exit(EXIT_SUCCESS);
 }
 
+std::uint64_t parse_ms_or_exit(const char *str)
+{
+    char *end_ptr = nullptr;
+    unsigned long long ms = std::strtoull(str, &end_ptr, 10);
+    if (*str == '\0' || *end_ptr != '\0') {
+        std::fprintf(stderr, "%s is not a valid time in ms\n", str);
+        exit(EXIT_FAILURE);
+    }
+    return ms;
+}
+
 void parse_args(int argc, char **argv, ResolvUpdateConfig &config)
 {
     bool device_set = false;
@@ -56,20 +140,50 @@ void parse_args(int argc, char **argv, ResolvUpdateConfig &config)
     bool is_prefer_v4_set = false;
     bool is_prefer_v6_set = false;
     unsigned long interval = 0;
+    unsigned long timeout = 0;
     unsigned long port = 0;
 
     int c;
     char *int_end_ptr = nullptr;
 
     wg_key peer_pubkey;
+    PeerConfig peer;
+    const char *config_file = nullptr;
+    IPVersionPreference ip_version_preference;
     static struct option long_options[] = {
         { "device", required_argument, nullptr, 'd' },
         { "pubkey", required_argument, nullptr, 'k' },
         { "host", required_argument, nullptr, 'h' },
         { "port", required_argument, nullptr, 'p' },
+        { "config", required_argument, nullptr, 'F' },
         { "interval", required_argument, nullptr, 'i' },
         { "prefer-ipv4", no_argument, nullptr, '4' },
         { "prefer-ipv6", no_argument, nullptr, '6' },
+        { "dns-timeout", required_argument, nullptr, 't' },
+        { "system-resolver", no_argument, nullptr, 'S' },
+        { "builtin-resolver", no_argument, nullptr, 'b' },
+        { "dns-cache", no_argument, nullptr, 'c' },
+        { "nameserver", required_argument, nullptr, 0 },
+        { "dns-max-stale", required_argument, nullptr, 0 },
+        { "ttl-refresh", no_argument, nullptr, 'T' },
+        { "ttl-min", required_argument, nullptr, 0 },
+        { "ttl-max", required_argument, nullptr, 0 },
+        { "ttl-early", required_argument, nullptr, 0 },
+        { "handshake-aware", no_argument, nullptr, 'H' },
+        { "handshake-stale", required_argument, nullptr, 0 },
+        { "healthy-max", required_argument, nullptr, 0 },
+        { "stale-interval", required_argument, nullptr, 0 },
+        { "backoff", no_argument, nullptr, 'B' },
+        { "backoff-max", required_argument, nullptr, 0 },
+        { "start-jitter", required_argument, nullptr, 0 },
+        { "probe", required_argument, nullptr, 0 },
+        { "probe-timeout", required_argument, nullptr, 0 },
+        { "probe-hysteresis", required_argument, nullptr, 0 },
+        { "rfc6724", no_argument, nullptr, 'R' },
+        { "network-events", no_argument, nullptr, 'N' },
+        { "network-debounce", required_argument, nullptr, 0 },
+        { "metrics", required_argument, nullptr, 0 },
+        { "fake-wireguard", required_argument, nullptr, 0 },
         { "debug", no_argument, nullptr, 'D' },
         { "frontend", no_argument, nullptr, 'f' },
         { "version", no_argument, nullptr, 'v' },
@@ -79,7 +193,7 @@ void parse_args(int argc, char **argv, ResolvUpdateConfig &config)
 
     while (1) {
         int option_index = 0;
-        c = getopt_long(argc, argv, "vd:k:h:p:i:46Df", long_options, &option_index);
+        c = getopt_long(argc, argv, "vd:k:h:p:F:i:46t:SbcTHBRNDf", long_options, &option_index);
         if (c == -1)
             break;
 
@@ -89,7 +203,11 @@ void parse_args(int argc, char **argv, ResolvUpdateConfig &config)
             break;
 
         case 'd':
-            config.wg_device_name = std::string(optarg);
+            if (std::strlen(optarg) >= IFNAMSIZ) {
+                std::fprintf(stderr, "%s is not a valid device name\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            peer.wg_device_name = std::string(optarg);
             device_set = true;
             break;
 
@@ -98,13 +216,13 @@ void parse_args(int argc, char **argv, ResolvUpdateConfig &config)
                 std::perror("Invalid peer public key");
                 exit(EXIT_FAILURE);
             }
-            std::memcpy(config.wg_peer_pubkey, peer_pubkey, sizeof(wg_key));
-            config.wg_peer_pubkey_base64 = std::string(optarg);
+            std::memcpy(peer.wg_peer_pubkey, peer_pubkey, sizeof(wg_key));
+            peer.wg_peer_pubkey_base64 = std::string(optarg);
             pubkey_set = true;
             break;
 
         case 'h':
-            config.peer_hostname = std::string(optarg);
+            peer.peer_hostname = std::string(optarg);
             host_set = true;
             break;
 
@@ -114,10 +232,14 @@ void parse_args(int argc, char **argv, ResolvUpdateConfig &config)
                 std::fprintf(stderr, "%s is not a valid port\n", optarg);
                 exit(EXIT_FAILURE);
             }
-            config.peer_port = port;
+            peer.peer_port = port;
             port_set = true;
             break;
 
+        case 'F':
+            config_file = optarg;
+            break;
+
         case 'i':
             interval = std::strtoul(optarg, &int_end_ptr, 10);
             if (*int_end_ptr != '\0') {
@@ -127,6 +249,47 @@ void parse_args(int argc, char **argv, ResolvUpdateConfig &config)
             config.refresh_interval_ms = interval;
             break;
 
+        case 't':
+            timeout = std::strtoul(optarg, &int_end_ptr, 10);
+            if (*int_end_ptr != '\0' || timeout == 0) {
+                std::fprintf(stderr, "%s is not a valid timeout\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            config.dns_timeout_ms = timeout;
+            break;
+
+        case 'S':
+            config.builtin_resolver = false;
+            break;
+
+        case 'b':
+            config.builtin_resolver = true;
+            break;
+
+        case 'c':
+            config.dns_cache = true;
+            break;
+
+        case 'T':
+            config.ttl_refresh = true;
+            break;
+
+        case 'H':
+            config.handshake_aware = true;
+            break;
+
+        case 'B':
+            config.backoff = true;
+            break;
+
+        case 'R':
+            config.rfc6724 = true;
+            break;
+
+        case 'N':
+            config.network_events = true;
+            break;
+
         case '4':
             is_prefer_v4_set = true;
             break;
@@ -146,6 +309,79 @@ void parse_args(int argc, char **argv, ResolvUpdateConfig &config)
         case 0:
             if (std::strcmp("help", long_options[option_index].name) == 0) {
                 print_help_long_and_exit(argv[0]);
+            } else if (std::strcmp("nameserver", long_options[option_index].name) == 0) {
+                DnsResolver check(0);
+                if (check.add_nameserver(optarg) < 0) {
+                    std::fprintf(stderr, "%s is not a valid name server address\n", optarg);
+                    goto print_help_and_exit_failure;
+                }
+                config.nameservers.push_back(optarg);
+                break;
+            } else if (std::strcmp("dns-max-stale", long_options[option_index].name) == 0) {
+                config.dns_max_stale_ms = parse_ms_or_exit(optarg);
+                break;
+            } else if (std::strcmp("ttl-min", long_options[option_index].name) == 0) {
+                config.ttl_min_ms = parse_ms_or_exit(optarg);
+                break;
+            } else if (std::strcmp("ttl-max", long_options[option_index].name) == 0) {
+                config.ttl_max_ms = parse_ms_or_exit(optarg);
+                break;
+            } else if (std::strcmp("ttl-early", long_options[option_index].name) == 0) {
+                config.ttl_early_refresh = std::strtod(optarg, &int_end_ptr);
+                if (*int_end_ptr != '\0' || !(config.ttl_early_refresh >= 0 && config.ttl_early_refresh < 1)) {
+                    std::fprintf(stderr, "%s is not a valid fraction in [0, 1)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            } else if (std::strcmp("handshake-stale", long_options[option_index].name) == 0) {
+                config.handshake_stale_ms = parse_ms_or_exit(optarg);
+                break;
+            } else if (std::strcmp("healthy-max", long_options[option_index].name) == 0) {
+                config.healthy_max_ms = parse_ms_or_exit(optarg);
+                break;
+            } else if (std::strcmp("stale-interval", long_options[option_index].name) == 0) {
+                config.stale_interval_ms = parse_ms_or_exit(optarg);
+                break;
+            } else if (std::strcmp("backoff-max", long_options[option_index].name) == 0) {
+                config.backoff_max_ms = parse_ms_or_exit(optarg);
+                break;
+            } else if (std::strcmp("start-jitter", long_options[option_index].name) == 0) {
+                config.start_jitter_ms = parse_ms_or_exit(optarg);
+                break;
+            } else if (std::strcmp("probe", long_options[option_index].name) == 0) {
+                if (!parse_probe_target(optarg, config.probe_protocol, config.probe_port)) {
+                    std::fprintf(stderr, "%s is not a valid probe, udp:port or tcp:port\n", optarg);
+                    goto print_help_and_exit_failure;
+                }
+                break;
+            } else if (std::strcmp("probe-timeout", long_options[option_index].name) == 0) {
+                config.probe_timeout_ms = parse_ms_or_exit(optarg);
+                if (config.probe_timeout_ms == 0) {
+                    std::fprintf(stderr, "%s is not a valid timeout\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            } else if (std::strcmp("probe-hysteresis", long_options[option_index].name) == 0) {
+                config.probe_hysteresis = std::strtod(optarg, &int_end_ptr);
+                if (*int_end_ptr != '\0' || !(config.probe_hysteresis >= 0 && config.probe_hysteresis < 1)) {
+                    std::fprintf(stderr, "%s is not a valid fraction in [0, 1)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            } else if (std::strcmp("network-debounce", long_options[option_index].name) == 0) {
+                config.network_debounce_ms = parse_ms_or_exit(optarg);
+                break;
+            } else if (std::strcmp("metrics", long_options[option_index].name) == 0) {
+                config.metrics_address = optarg;
+                break;
+            } else if (std::strcmp("fake-wireguard", long_options[option_index].name) == 0) {
+                FakeDeviceOptions options;
+                if (parse_fake_device_options(optarg, options) < 0) {
+                    std::fprintf(stderr, "%s is not valid fake WireGuard options\n", optarg);
+                    goto print_help_and_exit_failure;
+                }
+                config.fake_wireguard = optarg;
+                break;
             }
         default:
             fprintf(stderr, "?? getopt returned character code 0%o ??\n", c);
@@ -162,24 +398,32 @@ void parse_args(int argc, char **argv, ResolvUpdateConfig &config)
         fprintf(stderr, "\n");
     }
 
-    if (!device_set) {
-        fprintf(stderr, "wireguard device is required\n");
-        goto print_help_and_exit_failure;
-    }
+    // with a config file the command line peer is optional, but it has to be complete
+    if (!config_file || device_set || pubkey_set || host_set || port_set) {
+        if (!device_set) {
+            fprintf(stderr, "wireguard device is required\n");
+            goto print_help_and_exit_failure;
+        }
 
-    if (!pubkey_set) {
-        fprintf(stderr, "wireguard peer public key is required\n");
-        goto print_help_and_exit_failure;
-    }
+        if (!pubkey_set) {
+            fprintf(stderr, "wireguard peer public key is required\n");
+            goto print_help_and_exit_failure;
+        }
+
+        if (!host_set) {
+            fprintf(stderr, "peer hostname is required\n");
+            goto print_help_and_exit_failure;
+        }
 
-    if (!host_set) {
-        fprintf(stderr, "peer hostname is required\n");
-        goto print_help_and_exit_failure;
+        if (!port_set) {
+            fprintf(stderr, "port is required\n");
+            goto print_help_and_exit_failure;
+        }
     }
 
-    if (!port_set) {
-        fprintf(stderr, "port is required\n");
-        goto print_help_and_exit_failure;
+    if (config.ttl_min_ms > config.ttl_max_ms) {
+        fprintf(stderr, "TTL min interval is larger than max\n");
+        exit(EXIT_FAILURE);
     }
 
     if (is_prefer_v4_set && is_prefer_v6_set) {
@@ -188,11 +432,28 @@ void parse_args(int argc, char **argv, ResolvUpdateConfig &config)
     }
 
     if (is_prefer_v4_set) {
-        config.ip_version_preference = IPVersionPreference::PreferV4;
+        ip_version_preference = IPVersionPreference::PreferV4;
     } else if (is_prefer_v6_set) {
-        config.ip_version_preference = IPVersionPreference::PreferV6;
+        ip_version_preference = IPVersionPreference::PreferV6;
     } else {
-        config.ip_version_preference = IPVersionPreference::NoPreference;
+        ip_version_preference = IPVersionPreference::NoPreference;
+    }
+
+    if (device_set) {
+        peer.ip_version_preference = ip_version_preference;
+        peer.refresh_interval_ms = 0;
+        config.peers.push_back(peer);
+    }
+
+    if (config_file) {
+        int loaded = load_config_file(config_file, ip_version_preference, config.peers);
+        if (loaded < 0) {
+            exit(EXIT_FAILURE);
+        }
+        if (config.peers.empty()) {
+            fprintf(stderr, "%s: no peer configured\n", config_file);
+            exit(EXIT_FAILURE);
+        }
     }
 
     return;
@@ -204,11 +465,29 @@ print_help_and_exit_failure:
 
 int main(int argc, char **argv)
 {
-    std::signal(SIGINT, sigint_handler);
-
     ResolvUpdateConfig config = {
-        .ip_version_preference = IPVersionPreference::NoPreference,
         .refresh_interval_ms = 1000,
+        .ttl_refresh = false,
+        .ttl_min_ms = 1000,
+        .ttl_max_ms = 3600000,
+        .ttl_early_refresh = 0.1,
+        .dns_timeout_ms = 1000,
+        .dns_cache = false,
+        .dns_max_stale_ms = 86400000,
+        .handshake_aware = false,
+        .handshake_stale_ms = 135000,
+        .healthy_max_ms = 60000,
+        .stale_interval_ms = 1000,
+        .backoff = false,
+        .backoff_max_ms = 300000,
+        .start_jitter_ms = 1000,
+        .probe_port = 0,
+        .probe_protocol = ProbeProtocol::Udp,
+        .probe_timeout_ms = 1000,
+        .probe_hysteresis = 0.2,
+        .rfc6724 = false,
+        .network_events = false,
+        .network_debounce_ms = 50,
     };
 
     parse_args(argc, argv, config);
@@ -226,12 +505,17 @@ int main(int argc, char **argv)
     }
 
     if (config.debug) {
-        setlogmask(LOG_UPTO(LOG_DEBUG));
+        async_log_set_mask(LOG_UPTO(LOG_DEBUG));
     } else {
-        setlogmask(LOG_UPTO(LOG_INFO));
+        async_log_set_mask(LOG_UPTO(LOG_INFO));
+    }
+    rc = async_log_start();
+    if (rc < 0) {
+        syslog(LOG_WARNING, "Failed to start the log writer, logging synchronously: %s", std::strerror(-rc));
     }
 
     task_resolve_and_update(config);
+    async_log_stop();
 
     return 0;
 }
@@ -0,0 +1,303 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+// scrapes served at once. A new one beyond this evicts the oldest, so idle connections can't lock out scrapes
+static const std::size_t max_clients = 8;
+
+const double Histogram::bounds[Histogram::bucket_count] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5 };
+
+Histogram::Histogram()
+    : counts {}
+    , sum(0)
+    , count(0)
+{
+}
+
+void Histogram::observe(double seconds)
+{
+    std::size_t i = 0;
+    while (i < bucket_count && seconds > bounds[i]) {
+        ++i;
+    }
+    ++counts[i];
+    sum += seconds;
+    ++count;
+}
+
+MetricsExporter::MetricsExporter(const Metrics &metrics, const std::vector<PeerConfig> &peers, Reactor &reactor)
+    : metrics(metrics)
+    , peers(peers)
+    , reactor(reactor)
+    , listen_fd(-1)
+{
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    while (!clients.empty()) {
+        close_client(*clients.back());
+    }
+    if (listen_fd >= 0) {
+        reactor.remove(listen_fd);
+        close(listen_fd);
+    }
+    if (!unix_path.empty()) {
+        unlink(unix_path.c_str());
+    }
+}
+
+int MetricsExporter::open(const std::string &address)
+{
+    sockaddr_storage addr = {};
+    socklen_t addr_len;
+    std::string path;
+    if (address.compare(0, 5, "unix:") == 0) {
+        path = address.substr(5);
+    } else if (!address.empty() && address[0] == '/') {
+        path = address;
+    }
+
+    if (!path.empty()) {
+        sockaddr_un *un = reinterpret_cast<sockaddr_un *>(&addr);
+        if (path.size() >= sizeof(un->sun_path)) {
+            return -EINVAL;
+        }
+        un->sun_family = AF_UNIX;
+        std::memcpy(un->sun_path, path.c_str(), path.size() + 1);
+        addr_len = sizeof(sockaddr_un);
+
+        // a socket left behind by a previous run
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path.c_str());
+        }
+    } else {
+        std::size_t colon = address.rfind(':');
+        if (colon == std::string::npos) {
+            return -EINVAL;
+        }
+        std::string host = address.substr(0, colon);
+        char *end_ptr = nullptr;
+        unsigned long port = std::strtoul(address.c_str() + colon + 1, &end_ptr, 10);
+        if (colon + 1 == address.size() || *end_ptr != '\0' || port == 0 || port > 65535) {
+            return -EINVAL;
+        }
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+            sockaddr_in6 *in6 = reinterpret_cast<sockaddr_in6 *>(&addr);
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = htons(port);
+            if (inet_pton(AF_INET6, host.substr(1, host.size() - 2).c_str(), &in6->sin6_addr) != 1) {
+                return -EINVAL;
+            }
+            addr_len = sizeof(sockaddr_in6);
+        } else {
+            sockaddr_in *in = reinterpret_cast<sockaddr_in *>(&addr);
+            in->sin_family = AF_INET;
+            in->sin_port = htons(port);
+            if (inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1) {
+                return -EINVAL;
+            }
+            addr_len = sizeof(sockaddr_in);
+        }
+    }
+
+    listen_fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        return -errno;
+    }
+    int one = 1;
+    if (addr.ss_family != AF_UNIX) {
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), addr_len) < 0 || listen(listen_fd, 16) < 0) {
+        return -errno;
+    }
+    unix_path = path;
+    return reactor.add(listen_fd, EPOLLIN, this);
+}
+
+void MetricsExporter::on_event(int, std::uint32_t)
+{
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        if (clients.size() >= max_clients) {
+            // accepted in order, the front one has waited longest
+            close_client(*clients.front());
+        }
+
+        std::unique_ptr<Client> client(new Client);
+        client->exporter = this;
+        client->fd = fd;
+        client->request_len = 0;
+        client->written = 0;
+        if (reactor.add(fd, EPOLLIN, client.get()) < 0) {
+            close(fd);
+            continue;
+        }
+        clients.push_back(std::move(client));
+    }
+}
+
+void MetricsExporter::on_client_event(Client &client, std::uint32_t events)
+{
+    if (client.response.empty()) {
+        ssize_t len = read(client.fd, client.request + client.request_len, sizeof(client.request) - 1 - client.request_len);
+        if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (len <= 0) {
+            close_client(client);
+            return;
+        }
+        client.request_len += len;
+        client.request[client.request_len] = '\0';
+        bool complete = std::strstr(client.request, "\r\n\r\n") || std::strstr(client.request, "\n\n");
+        if (!complete && client.request_len < sizeof(client.request) - 1) {
+            return;
+        }
+
+        std::string body;
+        const char *status = "200 OK";
+        if (std::strncmp(client.request, "GET / ", 6) == 0 || std::strncmp(client.request, "GET /metrics ", 13) == 0) {
+            render(body);
+        } else {
+            status = "404 Not Found";
+        }
+        char header[160];
+        std::snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status, body.size());
+        client.response = header;
+        client.response += body;
+    } else if (!(events & EPOLLOUT)) {
+        return;
+    }
+
+    while (client.written < client.response.size()) {
+        ssize_t len = send(client.fd, client.response.data() + client.written, client.response.size() - client.written, MSG_NOSIGNAL);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0 && errno == EAGAIN) {
+            reactor.modify(client.fd, EPOLLOUT);
+            return;
+        }
+        if (len < 0) {
+            break;
+        }
+        client.written += len;
+    }
+    close_client(client);
+}
+
+void MetricsExporter::close_client(Client &client)
+{
+    reactor.remove(client.fd);
+    close(client.fd);
+    auto it = std::find_if(clients.begin(), clients.end(), [&client](const std::unique_ptr<Client> &c) { return c.get() == &client; });
+    if (it != clients.end()) {
+        clients.erase(it);
+    }
+}
+
+static void append_escaped(std::string &out, const std::string &value)
+{
+    for (char c : value) {
+        switch (c) {
+        case '\\':
+            out += "\\\\";
+            break;
+        case '"':
+            out += "\\\"";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        default:
+            out += c;
+        }
+    }
+}
+
+static void append_counter(std::string &out, const char *name, const char *help, std::uint64_t value)
+{
+    char line[256];
+    std::snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, static_cast<unsigned long long>(value));
+    out += line;
+}
+
+static void append_histogram(std::string &out, const char *name, const char *help, const Histogram &histogram)
+{
+    char line[256];
+    std::snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    out += line;
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i <= Histogram::bucket_count; ++i) {
+        cumulative += histogram.counts[i];
+        if (i < Histogram::bucket_count) {
+            std::snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", name, Histogram::bounds[i], static_cast<unsigned long long>(cumulative));
+        } else {
+            std::snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", name, static_cast<unsigned long long>(cumulative));
+        }
+        out += line;
+    }
+    std::snprintf(line, sizeof(line), "%s_sum %.9g\n%s_count %llu\n", name, histogram.sum, name, static_cast<unsigned long long>(histogram.count));
+    out += line;
+}
+
+void MetricsExporter::render(std::string &out) const
+{
+    append_counter(out, "wg_resolv_resolutions_total", "Hostname resolutions.", metrics.resolutions);
+    append_counter(out, "wg_resolv_resolution_failures_total", "Resolutions without an answer: timeouts, SERVFAIL and the like.", metrics.resolution_failures);
+    append_counter(out, "wg_resolv_nxdomain_total", "Resolutions that found no address.", metrics.nxdomain);
+    append_counter(out, "wg_resolv_endpoint_updates_total", "Peer endpoints set.", metrics.endpoint_updates);
+    append_counter(out, "wg_resolv_netlink_errors_total", "Failed WireGuard netlink requests, missing devices aside.", metrics.netlink_errors);
+    append_histogram(out, "wg_resolv_resolve_duration_seconds", "Time to resolve a hostname.", metrics.resolve_duration);
+    append_histogram(out, "wg_resolv_device_dump_duration_seconds", "Time to dump the devices of a batch, concurrently.", metrics.dump_duration);
+    append_histogram(out, "wg_resolv_endpoint_set_duration_seconds", "Time to set the changed endpoints of a device.", metrics.set_duration);
+    append_histogram(out, "wg_resolv_convergence_seconds", "Time from the start of the resolution seeing a new address to the endpoint set.", metrics.convergence);
+
+    static const struct {
+        const char *name;
+        const char *help;
+    } gauges[] = {
+        { "wg_resolv_peer_resolve_ok", "Whether the last resolution of the peer found an address." },
+        { "wg_resolv_peer_healthy", "Whether the peer is skipped for a fresh handshake." },
+        { "wg_resolv_peer_parked", "Whether the device of the peer is missing." },
+        { "wg_resolv_peer_last_update_timestamp_seconds", "Unix time the endpoint of the peer was last set, 0 if never." },
+    };
+    char line[256];
+    for (std::size_t g = 0; g < sizeof(gauges) / sizeof(gauges[0]); ++g) {
+        std::snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s gauge\n", gauges[g].name, gauges[g].help, gauges[g].name);
+        out += line;
+        for (std::size_t i = 0; i < peers.size() && i < metrics.peers.size(); ++i) {
+            const PeerMetrics &peer = metrics.peers[i];
+            double value = g == 0 ? peer.resolve_ok : g == 1 ? peer.healthy : g == 2 ? peer.parked : peer.last_update;
+            out += gauges[g].name;
+            out += "{device=\"";
+            append_escaped(out, peers[i].wg_device_name);
+            out += "\",peer=\"";
+            append_escaped(out, peers[i].wg_peer_pubkey_base64);
+            out += "\",hostname=\"";
+            append_escaped(out, peers[i].peer_hostname);
+            std::snprintf(line, sizeof(line), "\"} %.17g\n", value);
+            out += line;
+        }
+    }
+}
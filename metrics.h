@@ -0,0 +1,95 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "core.h"
+#include "reactor.h"
+
+// Fixed buckets from 100 us to 5 s. observe() neither allocates nor locks
+class Histogram {
+public:
+    static const std::size_t bucket_count = 15;
+    static const double bounds[bucket_count];
+
+    Histogram();
+    void observe(double seconds);
+
+    // per bucket, not cumulative. The last one is +Inf
+    std::uint64_t counts[bucket_count + 1];
+    double sum;
+    std::uint64_t count;
+};
+
+struct PeerMetrics {
+    // the last resolution found an address
+    bool resolve_ok;
+    // with handshake_aware, skipped for a fresh handshake
+    bool healthy;
+    // the device is missing
+    bool parked;
+    // unix time of the last endpoint set, 0 if never
+    double last_update;
+};
+
+// Everything is updated and read on the reactor thread, hence no atomics
+struct Metrics {
+    std::uint64_t resolutions;
+    std::uint64_t resolution_failures;
+    std::uint64_t nxdomain;
+    std::uint64_t endpoint_updates;
+    std::uint64_t netlink_errors;
+    Histogram resolve_duration;
+    Histogram dump_duration;
+    Histogram set_duration;
+    // from the start of the resolution that saw a new address to its endpoint set
+    Histogram convergence;
+    // by task, sized before the first cycle
+    std::vector<PeerMetrics> peers;
+};
+
+// Serves Metrics in the Prometheus text format over HTTP/1.0, one response per connection.
+// Scrapes format on the reactor thread between cycles; the resolve/update path only bumps numbers
+class MetricsExporter : public Reactor::Handler {
+public:
+    MetricsExporter(const Metrics &metrics, const std::vector<PeerConfig> &peers, Reactor &reactor);
+    ~MetricsExporter();
+    MetricsExporter(const MetricsExporter &) = delete;
+    MetricsExporter &operator=(const MetricsExporter &) = delete;
+
+    /// @param address "unix:/path", "/path", "ip:port" or "[ip6]:port"
+    /// @return 0 or negative errno. -EINVAL if the address can't be parsed
+    int open(const std::string &address);
+
+    void on_event(int fd, std::uint32_t events) override;
+
+private:
+    struct Client : Reactor::Handler {
+        MetricsExporter *exporter;
+        int fd;
+        char request[1024];
+        std::size_t request_len;
+        std::string response;
+        std::size_t written;
+
+        void on_event(int, std::uint32_t events) override { exporter->on_client_event(*this, events); }
+    };
+
+    void on_client_event(Client &client, std::uint32_t events);
+    void close_client(Client &client);
+    void render(std::string &out) const;
+
+    const Metrics &metrics;
+    const std::vector<PeerConfig> &peers;
+    Reactor &reactor;
+    int listen_fd;
+    std::string unix_path;
+    std::vector<std::unique_ptr<Client>> clients;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#include <cerrno>
+#include <cstring>
+
+#include <linux/fib_rules.h>
+#include <linux/if_addr.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "netlink_monitor.h"
+#include "async_log.h"
+
+// a burst of link events, e.g. wg-quick bringing many interfaces up, shouldn't overflow
+static const int receive_buffer_size = 1 << 20;
+
+NetlinkMonitor::NetlinkMonitor()
+    : sock(-1)
+    , buffer(65536)
+{
+}
+
+NetlinkMonitor::~NetlinkMonitor()
+{
+    if (sock >= 0) {
+        close(sock);
+    }
+}
+
+int NetlinkMonitor::open(std::initializer_list<int> groups)
+{
+    sock = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0) {
+        return -errno;
+    }
+
+    sockaddr_nl addr = {};
+    addr.nl_family = AF_NETLINK;
+    if (bind(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        return -errno;
+    }
+    for (int group : groups) {
+        if (setsockopt(sock, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+            return -errno;
+        }
+    }
+    // best effort, capped by net.core.rmem_max
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &receive_buffer_size, sizeof(receive_buffer_size));
+    return 0;
+}
+
+void NetlinkMonitor::read_events(Handler &handler)
+{
+    while (true) {
+        ssize_t len = recv(sock, buffer.data(), buffer.size(), 0);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS) {
+                handler.on_overflow();
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                async_log(LOG_ERR, "rtnetlink recv: %s", std::strerror(errno));
+            }
+            return;
+        }
+        dispatch(buffer.data(), len, handler);
+    }
+}
+
+// nullptr unless a nul terminated string
+static const char *rta_string(const rtattr *rta)
+{
+    const char *str = static_cast<const char *>(RTA_DATA(rta));
+    if (RTA_PAYLOAD(rta) == 0 || str[RTA_PAYLOAD(rta) - 1] != '\0') {
+        return nullptr;
+    }
+    return str;
+}
+
+void NetlinkMonitor::dispatch(const void *buf, std::size_t len, Handler &handler)
+{
+    int remaining = static_cast<int>(len);
+    for (const nlmsghdr *nlh = static_cast<const nlmsghdr *>(buf); NLMSG_OK(nlh, remaining); nlh = NLMSG_NEXT(nlh, remaining)) {
+        switch (nlh->nlmsg_type) {
+        case RTM_NEWLINK:
+        case RTM_DELLINK: {
+            if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg))) {
+                break;
+            }
+            const ifinfomsg *ifi = static_cast<const ifinfomsg *>(NLMSG_DATA(nlh));
+            int attr_len = IFLA_PAYLOAD(nlh);
+            const char *ifname = nullptr;
+            const char *kind = nullptr;
+            for (const rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len)) {
+                if (rta->rta_type == IFLA_IFNAME) {
+                    ifname = rta_string(rta);
+                } else if (rta->rta_type == IFLA_LINKINFO) {
+                    int info_len = RTA_PAYLOAD(rta);
+                    for (const rtattr *info = static_cast<const rtattr *>(RTA_DATA(rta)); RTA_OK(info, info_len); info = RTA_NEXT(info, info_len)) {
+                        if (info->rta_type == IFLA_INFO_KIND) {
+                            kind = rta_string(info);
+                        }
+                    }
+                }
+            }
+            if (ifname) {
+                handler.on_link(nlh->nlmsg_type == RTM_NEWLINK, ifi->ifi_index, ifname, kind);
+            }
+            break;
+        }
+        case RTM_NEWADDR:
+        case RTM_DELADDR: {
+            if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(ifaddrmsg))) {
+                break;
+            }
+            const ifaddrmsg *ifa = static_cast<const ifaddrmsg *>(NLMSG_DATA(nlh));
+            std::uint32_t flags = ifa->ifa_flags;
+            int attr_len = IFA_PAYLOAD(nlh);
+            for (const rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len)) {
+                if (rta->rta_type == IFA_FLAGS && RTA_PAYLOAD(rta) == sizeof(std::uint32_t)) {
+                    std::memcpy(&flags, RTA_DATA(rta), sizeof(flags));
+                }
+            }
+            handler.on_address(nlh->nlmsg_type == RTM_NEWADDR, ifa->ifa_family, ifa->ifa_index, ifa->ifa_scope, flags);
+            break;
+        }
+        case RTM_NEWROUTE:
+        case RTM_DELROUTE: {
+            if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(rtmsg))) {
+                break;
+            }
+            const rtmsg *rtm = static_cast<const rtmsg *>(NLMSG_DATA(nlh));
+            std::uint32_t table = rtm->rtm_table;
+            int attr_len = RTM_PAYLOAD(nlh);
+            for (const rtattr *rta = RTM_RTA(rtm); RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len)) {
+                if (rta->rta_type == RTA_TABLE && RTA_PAYLOAD(rta) == sizeof(std::uint32_t)) {
+                    std::memcpy(&table, RTA_DATA(rta), sizeof(table));
+                }
+            }
+            handler.on_route(nlh->nlmsg_type == RTM_NEWROUTE, rtm->rtm_family, table, rtm->rtm_dst_len);
+            break;
+        }
+        case RTM_NEWRULE:
+        case RTM_DELRULE: {
+            if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(fib_rule_hdr))) {
+                break;
+            }
+            const fib_rule_hdr *frh = static_cast<const fib_rule_hdr *>(NLMSG_DATA(nlh));
+            handler.on_rule(nlh->nlmsg_type == RTM_NEWRULE, frh->family);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
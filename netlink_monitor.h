@@ -0,0 +1,54 @@
+#ifndef NETLINK_MONITOR_H
+#define NETLINK_MONITOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+// rtnetlink multicast subscriber. The socket is non-blocking: watch fd() and call
+// read_events() when it's readable.
+class NetlinkMonitor {
+public:
+    class Handler {
+    public:
+        // RTM_NEWLINK, also sent when an existing link changes, or RTM_DELLINK
+        /// @param kind IFLA_INFO_KIND such as "wireguard", nullptr if not told
+        virtual void on_link(bool /*added*/, int /*ifindex*/, const char * /*ifname*/, const char * /*kind*/) {}
+        // RTM_NEWADDR or RTM_DELADDR
+        /// @param scope RT_SCOPE_*
+        /// @param flags IFA_F_*, from IFA_FLAGS if present
+        virtual void on_address(bool /*added*/, int /*family*/, int /*ifindex*/, unsigned char /*scope*/, std::uint32_t /*flags*/) {}
+        // RTM_NEWROUTE or RTM_DELROUTE
+        /// @param table RT_TABLE_*, from RTA_TABLE if present
+        virtual void on_route(bool /*added*/, int /*family*/, std::uint32_t /*table*/, unsigned char /*dst_len*/) {}
+        // RTM_NEWRULE or RTM_DELRULE, a policy routing rule
+        virtual void on_rule(bool /*added*/, int /*family*/) {}
+        // the socket overflowed and events are lost. Anything may have changed
+        virtual void on_overflow() = 0;
+
+    protected:
+        ~Handler() = default;
+    };
+
+    NetlinkMonitor();
+    ~NetlinkMonitor();
+    NetlinkMonitor(const NetlinkMonitor &) = delete;
+    NetlinkMonitor &operator=(const NetlinkMonitor &) = delete;
+
+    /// @param groups RTNLGRP_* to join
+    /// @return 0 or negative errno
+    int open(std::initializer_list<int> groups);
+    int fd() const { return sock; }
+
+    // dispatch every pending message
+    void read_events(Handler &handler);
+
+private:
+    void dispatch(const void *buf, std::size_t len, Handler &handler);
+
+    int sock;
+    std::vector<char> buffer;
+};
+
+#endif
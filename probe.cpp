@@ -0,0 +1,194 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <random>
+
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "probe.h"
+
+// nonce, then the index of the target
+static const std::size_t probe_payload_len = 12;
+
+static void build_payload(std::uint8_t *buf, std::uint64_t nonce, std::uint32_t target)
+{
+    std::memcpy(buf, &nonce, sizeof(nonce));
+    std::memcpy(buf + sizeof(nonce), &target, sizeof(target));
+}
+
+ProbeRound::ProbeRound(ProbeProtocol protocol, std::uint16_t port, const std::vector<sockaddr_storage> &addresses)
+    : protocol(protocol)
+    , port(port)
+    , targets(addresses)
+    , target_fds(addresses.size(), -1)
+    , rtt_ms(addresses.size(), -1)
+    , pending(addresses.size(), false)
+    , sent_at(addresses.size())
+    , nonce(0)
+{
+}
+
+ProbeRound::~ProbeRound()
+{
+    for (int fd : sockets) {
+        close(fd);
+    }
+}
+
+void ProbeRound::start(std::chrono::steady_clock::time_point now, std::uint64_t timeout_ms)
+{
+    static std::mt19937_64 nonce_rng(std::random_device {}());
+    // an echo of an earlier round arriving late on a reused port doesn't match
+    nonce = nonce_rng();
+    deadline = now + std::chrono::milliseconds(timeout_ms);
+
+    for (std::size_t i = 0; i < targets.size(); ++i) {
+        sockaddr_storage &target = targets[i];
+        socklen_t target_len;
+        if (target.ss_family == AF_INET) {
+            reinterpret_cast<sockaddr_in &>(target).sin_port = htons(port);
+            target_len = sizeof(sockaddr_in);
+        } else if (target.ss_family == AF_INET6) {
+            reinterpret_cast<sockaddr_in6 &>(target).sin6_port = htons(port);
+            target_len = sizeof(sockaddr_in6);
+        } else {
+            continue;
+        }
+
+        int type = protocol == ProbeProtocol::Udp ? SOCK_DGRAM : SOCK_STREAM;
+        int fd = socket(target.ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            async_log(LOG_ERR, "Probe socket: %s", std::strerror(errno));
+            continue;
+        }
+        sockets.push_back(fd);
+        target_fds[i] = fd;
+        if (protocol == ProbeProtocol::Tcp) {
+            // closed with a RST, nothing lingers in TIME_WAIT
+            linger no_linger = { 1, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &no_linger, sizeof(no_linger));
+        }
+
+        pending[i] = true;
+        sent_at[i] = std::chrono::steady_clock::now();
+        int rc = connect(fd, reinterpret_cast<const sockaddr *>(&target), target_len);
+        if (protocol == ProbeProtocol::Tcp) {
+            if (rc == 0 || errno == ECONNREFUSED) {
+                // e.g. over loopback
+                finish(i, true);
+            } else if (errno != EINPROGRESS) {
+                finish(i, false);
+            }
+            continue;
+        }
+
+        std::uint8_t payload[probe_payload_len];
+        build_payload(payload, nonce, static_cast<std::uint32_t>(i));
+        if (rc < 0 || send(fd, payload, sizeof(payload), 0) != static_cast<ssize_t>(sizeof(payload))) {
+            // e.g. ENETUNREACH to an IPv6 address on an IPv4 only host
+            finish(i, false);
+        }
+    }
+}
+
+int ProbeRound::target_of(int fd) const
+{
+    auto it = std::find(target_fds.begin(), target_fds.end(), fd);
+    return it == target_fds.end() ? -1 : static_cast<int>(it - target_fds.begin());
+}
+
+void ProbeRound::on_event(int fd, std::uint32_t)
+{
+    int i = target_of(fd);
+    if (i < 0 || !pending[i]) {
+        return;
+    }
+
+    if (protocol == ProbeProtocol::Tcp) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        finish(i, error == 0 || error == ECONNREFUSED);
+        return;
+    }
+
+    std::uint8_t expected[probe_payload_len];
+    build_payload(expected, nonce, static_cast<std::uint32_t>(i));
+    while (pending[i]) {
+        std::uint8_t buf[64];
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ECONNREFUSED) {
+                // ICMP port unreachable, from the host itself
+                finish(i, true);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // ICMP host or net unreachable
+                finish(i, false);
+            }
+            break;
+        }
+        if (len == static_cast<ssize_t>(sizeof(expected)) && !std::memcmp(buf, expected, sizeof(expected))) {
+            finish(i, true);
+        }
+    }
+}
+
+void ProbeRound::finish(std::size_t target, bool answered)
+{
+    pending[target] = false;
+    if (answered) {
+        rtt_ms[target] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent_at[target]).count();
+    }
+}
+
+void ProbeRound::on_timer(std::chrono::steady_clock::time_point now)
+{
+    if (now < deadline) {
+        return;
+    }
+    // the rest didn't answer in time
+    std::fill(pending.begin(), pending.end(), false);
+}
+
+bool ProbeRound::done() const
+{
+    return std::none_of(pending.begin(), pending.end(), [](bool p) { return p; });
+}
+
+std::uint32_t ProbeRound::events() const
+{
+    // a connect completes once. Level triggered, the writable socket would wake the reactor until the round ends
+    return protocol == ProbeProtocol::Udp ? EPOLLIN : EPOLLOUT | EPOLLONESHOT;
+}
+
+bool parse_probe_target(const std::string &str, ProbeProtocol &protocol, std::uint16_t &port)
+{
+    std::size_t colon = str.find(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    std::string name = str.substr(0, colon);
+    if (name == "udp") {
+        protocol = ProbeProtocol::Udp;
+    } else if (name == "tcp") {
+        protocol = ProbeProtocol::Tcp;
+    } else {
+        return false;
+    }
+    const char *port_str = str.c_str() + colon + 1;
+    char *end = nullptr;
+    unsigned long value = std::strtoul(port_str, &end, 10);
+    if (*port_str == '\0' || *end != '\0' || value == 0 || value > 65535) {
+        return false;
+    }
+    port = static_cast<std::uint16_t>(value);
+    return true;
+}
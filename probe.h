@@ -0,0 +1,65 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <chrono>
+#include <cstdint>
+
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+enum class ProbeProtocol {
+    // a datagram echoed back, as by the echo service or a local responder
+    Udp,
+    // the time to the SYN-ACK
+    Tcp,
+};
+
+// A round of RTT probes, one per address, to the same port. An ICMP port unreachable or a TCP RST
+// still means the host answered, so it counts as reachable with the time it took.
+// Like DnsQuery, it never blocks: the caller polls fds() for events(), then feeds on_event() and on_timer().
+class ProbeRound {
+public:
+    /// @param addresses ports are ignored
+    ProbeRound(ProbeProtocol protocol, std::uint16_t port, const std::vector<sockaddr_storage> &addresses);
+    ~ProbeRound();
+    ProbeRound(const ProbeRound &) = delete;
+    ProbeRound &operator=(const ProbeRound &) = delete;
+
+    void start(std::chrono::steady_clock::time_point now, std::uint64_t timeout_ms);
+    void on_event(int fd, std::uint32_t events);
+    void on_timer(std::chrono::steady_clock::time_point now);
+
+    bool done() const;
+    std::chrono::steady_clock::time_point next_timeout() const { return deadline; }
+    const std::vector<int> &fds() const { return sockets; }
+    // epoll events to watch the fds for
+    std::uint32_t events() const;
+
+    const std::vector<sockaddr_storage> &addresses() const { return targets; }
+    /// @return per address, the RTT in ms, or a negative value if it didn't answer in time
+    const std::vector<double> &rtts() const { return rtt_ms; }
+
+private:
+    void finish(std::size_t target, bool answered);
+    int target_of(int fd) const;
+
+    ProbeProtocol protocol;
+    std::uint16_t port;
+    std::vector<sockaddr_storage> targets;
+    // per target, -1 if it couldn't be sent
+    std::vector<int> target_fds;
+    std::vector<int> sockets;
+    std::vector<double> rtt_ms;
+    std::vector<bool> pending;
+    std::vector<std::chrono::steady_clock::time_point> sent_at;
+    std::uint64_t nonce;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+// "udp:port" or "tcp:port"
+bool parse_probe_target(const std::string &str, ProbeProtocol &protocol, std::uint16_t &port);
+
+#endif
@@ -0,0 +1,148 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "reactor.h"
+
+// events returned by one epoll_wait
+static const int max_events = 64;
+
+Reactor::Reactor()
+    : epoll_fd(-1)
+    , timer_fd(-1)
+    , signal_fd(-1)
+{
+}
+
+Reactor::~Reactor()
+{
+    for (int fd : { signal_fd, timer_fd, epoll_fd }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+int Reactor::open(std::initializer_list<int> signals)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int signo : signals) {
+        sigaddset(&mask, signo);
+    }
+    int rc = pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    if (rc != 0) {
+        return -rc;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        return -errno;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        return -errno;
+    }
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        return -errno;
+    }
+
+    // the reactor's own fds have no handler
+    for (int fd : { timer_fd, signal_fd }) {
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+int Reactor::add(int fd, std::uint32_t events, Handler *handler)
+{
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return -errno;
+    }
+    if (static_cast<std::size_t>(fd) >= handlers.size()) {
+        handlers.resize(fd + 1, nullptr);
+    }
+    handlers[fd] = handler;
+    return 0;
+}
+
+int Reactor::modify(int fd, std::uint32_t events)
+{
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0 ? -errno : 0;
+}
+
+void Reactor::remove(int fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    if (static_cast<std::size_t>(fd) < handlers.size()) {
+        handlers[fd] = nullptr;
+    }
+}
+
+void Reactor::set_deadline(time_point deadline)
+{
+    auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+    // a zero it_value disarms the timer
+    if (wait <= 0) {
+        wait = 1;
+    }
+    itimerspec spec = {};
+    spec.it_value.tv_sec = wait / 1000000000;
+    spec.it_value.tv_nsec = wait % 1000000000;
+    timerfd_settime(timer_fd, 0, &spec, nullptr);
+}
+
+void Reactor::clear_deadline()
+{
+    itimerspec spec = {};
+    timerfd_settime(timer_fd, 0, &spec, nullptr);
+}
+
+int Reactor::run_once(std::uint64_t &signals)
+{
+    signals = 0;
+    epoll_event events[max_events];
+    int count = epoll_wait(epoll_fd, events, max_events, -1);
+    if (count < 0) {
+        return errno == EINTR ? 0 : -errno;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == timer_fd) {
+            std::uint64_t expirations;
+            ssize_t rc = read(timer_fd, &expirations, sizeof(expirations));
+            (void)rc;
+        } else if (fd == signal_fd) {
+            signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo < 64) {
+                    signals |= std::uint64_t(1) << info.ssi_signo;
+                }
+            }
+        } else if (static_cast<std::size_t>(fd) < handlers.size() && handlers[fd]) {
+            // a handler may remove fds, including ones later in this batch
+            handlers[fd]->on_event(fd, events[i].events);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+// Single threaded epoll loop. One timerfd carries the earliest deadline of the owner,
+// and a signalfd turns the given signals into events instead of asynchronous handlers.
+class Reactor {
+public:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    class Handler {
+    public:
+        virtual void on_event(int fd, std::uint32_t events) = 0;
+
+    protected:
+        ~Handler() = default;
+    };
+
+    Reactor();
+    ~Reactor();
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    /// @brief block the signals and open epoll, the timerfd and the signalfd.
+    ///        Call before starting threads, so they inherit the signal mask
+    /// @return 0 or negative errno
+    int open(std::initializer_list<int> signals);
+
+    /// @brief watch a fd until remove(). The handler is called from run_once
+    /// @return 0 or negative errno
+    int add(int fd, std::uint32_t events, Handler *handler);
+    int modify(int fd, std::uint32_t events);
+    void remove(int fd);
+
+    // wake up at the deadline. Replaces the previous one
+    void set_deadline(time_point deadline);
+    void clear_deadline();
+
+    /// @brief wait until a fd is ready, the deadline passes or a signal arrives, and dispatch
+    /// @param signals bit (1 << signo) set per signal received
+    /// @return 0 or negative errno
+    int run_once(std::uint64_t &signals);
+
+private:
+    int epoll_fd;
+    int timer_fd;
+    int signal_fd;
+    // by fd
+    std::vector<Handler *> handlers;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "scheduler.h"
+
+const std::size_t DeadlineScheduler::npos;
+
+DeadlineScheduler::DeadlineScheduler(std::size_t capacity)
+    : positions(capacity, npos)
+{
+    heap.reserve(capacity);
+}
+
+void DeadlineScheduler::place(std::size_t pos, const Node &node)
+{
+    heap[pos] = node;
+    positions[node.task] = pos;
+}
+
+void DeadlineScheduler::sift_up(std::size_t pos)
+{
+    Node node = heap[pos];
+    while (pos > 0) {
+        std::size_t parent = (pos - 1) / 2;
+        if (!(node.due < heap[parent].due)) {
+            break;
+        }
+        place(pos, heap[parent]);
+        pos = parent;
+    }
+    place(pos, node);
+}
+
+void DeadlineScheduler::sift_down(std::size_t pos)
+{
+    Node node = heap[pos];
+    std::size_t size = heap.size();
+    while (true) {
+        std::size_t child = pos * 2 + 1;
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size && heap[child + 1].due < heap[child].due) {
+            ++child;
+        }
+        if (!(heap[child].due < node.due)) {
+            break;
+        }
+        place(pos, heap[child]);
+        pos = child;
+    }
+    place(pos, node);
+}
+
+void DeadlineScheduler::remove_at(std::size_t pos)
+{
+    positions[heap[pos].task] = npos;
+    Node last = heap.back();
+    heap.pop_back();
+    if (pos == heap.size()) {
+        return;
+    }
+    place(pos, last);
+    if (pos > 0 && last.due < heap[(pos - 1) / 2].due) {
+        sift_up(pos);
+    } else {
+        sift_down(pos);
+    }
+}
+
+void DeadlineScheduler::schedule(std::size_t task, time_point due)
+{
+    std::size_t pos = positions[task];
+    if (pos == npos) {
+        heap.push_back({ due, task });
+        positions[task] = heap.size() - 1;
+        sift_up(heap.size() - 1);
+        return;
+    }
+
+    time_point old_due = heap[pos].due;
+    heap[pos].due = due;
+    if (due < old_due) {
+        sift_up(pos);
+    } else {
+        sift_down(pos);
+    }
+}
+
+void DeadlineScheduler::cancel(std::size_t task)
+{
+    std::size_t pos = positions[task];
+    if (pos != npos) {
+        remove_at(pos);
+    }
+}
+
+bool DeadlineScheduler::is_scheduled(std::size_t task) const
+{
+    return positions[task] != npos;
+}
+
+void DeadlineScheduler::pop_due(time_point now, std::vector<std::size_t> &due_tasks)
+{
+    while (!heap.empty() && heap.front().due <= now) {
+        due_tasks.push_back(heap.front().task);
+        remove_at(0);
+    }
+}
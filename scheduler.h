@@ -0,0 +1,47 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+// Min-heap of per task deadlines. Tasks are dense indexes [0, capacity).
+// Each task has at most one deadline; scheduling it again moves the deadline.
+// All operations are O(log N) except next_due() which is O(1).
+class DeadlineScheduler {
+public:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    explicit DeadlineScheduler(std::size_t capacity);
+
+    void schedule(std::size_t task, time_point due);
+    void cancel(std::size_t task);
+    bool is_scheduled(std::size_t task) const;
+    bool empty() const { return heap.empty(); }
+    std::size_t size() const { return heap.size(); }
+    // undefined if empty
+    time_point next_due() const { return heap.front().due; }
+
+    /// @brief remove every task due at or before now
+    /// @param due_tasks appended with the due tasks, earliest first
+    void pop_due(time_point now, std::vector<std::size_t> &due_tasks);
+
+private:
+    struct Node {
+        time_point due;
+        std::size_t task;
+    };
+
+    static const std::size_t npos = static_cast<std::size_t>(-1);
+
+    void sift_up(std::size_t pos);
+    void sift_down(std::size_t pos);
+    void place(std::size_t pos, const Node &node);
+    void remove_at(std::size_t pos);
+
+    std::vector<Node> heap;
+    // task -> position in heap, npos if not scheduled
+    std::vector<std::size_t> positions;
+};
+
+#endif
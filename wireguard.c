@@ -20,6 +20,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <assert.h>
 
 #include "wireguard.h"
@@ -53,7 +54,8 @@ enum wgdevice_attribute {
 
 enum wgpeer_flag {
 	WGPEER_F_REMOVE_ME = 1U << 0,
-	WGPEER_F_REPLACE_ALLOWEDIPS = 1U << 1
+	WGPEER_F_REPLACE_ALLOWEDIPS = 1U << 1,
+	WGPEER_F_UPDATE_ONLY = 1U << 2
 };
 enum wgpeer_attribute {
 	WGPEER_A_UNSPEC,
@@ -677,8 +679,8 @@ static struct nlmsghdr *__mnlg_msg_prepare(struct mnlg_socket *nlg, uint8_t cmd,
 	nlh = mnl_nlmsg_put_header(nlg->buf);
 	nlh->nlmsg_type	= id;
 	nlh->nlmsg_flags = flags;
-	nlg->seq = time(NULL);
-	nlh->nlmsg_seq = nlg->seq;
+	/* Distinct per message, so a long lived socket never matches a stale reply. */
+	nlh->nlmsg_seq = ++nlg->seq;
 
 	genl = mnl_nlmsg_put_extra_header(nlh, sizeof(struct genlmsghdr));
 	genl->cmd = cmd;
@@ -799,6 +801,7 @@ static struct mnlg_socket *mnlg_socket_open(const char *family_name, uint8_t ver
 	if (!nlg)
 		return NULL;
 	nlg->id = 0;
+	nlg->seq = time(NULL);
 
 	err = -ENOMEM;
 	nlg->buf = malloc(mnl_ideal_socket_buffer_size());
@@ -1061,18 +1064,13 @@ cleanup:
 	return ret;
 }
 
-int wg_set_device(wg_device *dev)
+static int __wg_set_device(struct mnlg_socket *nlg, wg_device *dev)
 {
 	int ret = 0;
 	wg_peer *peer = NULL;
 	wg_allowedip *allowedip = NULL;
 	struct nlattr *peers_nest, *peer_nest, *allowedips_nest, *allowedip_nest;
 	struct nlmsghdr *nlh;
-	struct mnlg_socket *nlg;
-
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
-	if (!nlg)
-		return -errno;
 
 again:
 	nlh = mnlg_msg_prepare(nlg, WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
@@ -1190,6 +1188,165 @@ send:
 		goto again;
 
 out:
+	errno = -ret;
+	return ret;
+}
+
+/* Only the endpoint of one peer: no allowed IPs, keys or keepalive. With update_only,
+ * the kernel won't create the peer if it has been removed since it was dumped. */
+static int __wg_set_peer_endpoint(struct mnlg_socket *nlg, const char *device_name, const wg_key public_key,
+				  const wg_endpoint *endpoint, bool update_only)
+{
+	int ret = 0;
+	size_t endpoint_len;
+	struct nlattr *peers_nest, *peer_nest;
+	struct nlmsghdr *nlh;
+
+	if (endpoint->addr.sa_family == AF_INET)
+		endpoint_len = sizeof(endpoint->addr4);
+	else if (endpoint->addr.sa_family == AF_INET6)
+		endpoint_len = sizeof(endpoint->addr6);
+	else
+		return -EAFNOSUPPORT;
+
+	nlh = mnlg_msg_prepare(nlg, WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
+	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, device_name);
+	peers_nest = mnl_attr_nest_start(nlh, WGDEVICE_A_PEERS);
+	peer_nest = mnl_attr_nest_start(nlh, 0);
+	mnl_attr_put(nlh, WGPEER_A_PUBLIC_KEY, sizeof(wg_key), public_key);
+	if (update_only)
+		mnl_attr_put_u32(nlh, WGPEER_A_FLAGS, WGPEER_F_UPDATE_ONLY);
+	mnl_attr_put(nlh, WGPEER_A_ENDPOINT, endpoint_len, endpoint);
+	mnl_attr_nest_end(nlh, peer_nest);
+	mnl_attr_nest_end(nlh, peers_nest);
+
+	if (mnlg_socket_send(nlg, nlh) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	errno = 0;
+	if (mnlg_socket_recv_run(nlg, NULL, NULL) < 0)
+		ret = errno ? -errno : -EINVAL;
+
+out:
+	errno = -ret;
+	return ret;
+}
+
+/* The updates whose ret is -EAGAIN, in as few messages as they fit, each acked before the next is
+ * built. A message that doesn't fit one more peer is cut as __wg_set_device cuts it. The outcome of
+ * a message is that of every update it carried; on error the kernel may have applied the peers before
+ * the failing one. The first error ends the batch and is given to the updates not sent. */
+static int __wg_set_peer_endpoints(struct mnlg_socket *nlg, const char *device_name, wg_endpoint_update *updates,
+				   size_t count, bool update_only)
+{
+	int ret = 0;
+	size_t first = 0, i, carried, endpoint_len;
+	struct nlattr *peers_nest, *peer_nest;
+	struct nlmsghdr *nlh;
+
+again:
+	nlh = mnlg_msg_prepare(nlg, WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
+	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, device_name);
+	peers_nest = mnl_attr_nest_start(nlh, WGDEVICE_A_PEERS);
+	peer_nest = NULL;
+	carried = 0;
+	for (i = first; i < count; ++i) {
+		wg_endpoint_update *update = &updates[i];
+
+		if (update->ret != -EAGAIN)
+			continue;
+		if (update->endpoint.addr.sa_family == AF_INET)
+			endpoint_len = sizeof(update->endpoint.addr4);
+		else if (update->endpoint.addr.sa_family == AF_INET6)
+			endpoint_len = sizeof(update->endpoint.addr6);
+		else {
+			update->ret = -EAFNOSUPPORT;
+			continue;
+		}
+		peer_nest = mnl_attr_nest_start_check(nlh, mnl_ideal_socket_buffer_size(), 0);
+		if (!peer_nest)
+			goto toobig_peers;
+		if (!mnl_attr_put_check(nlh, mnl_ideal_socket_buffer_size(), WGPEER_A_PUBLIC_KEY, sizeof(wg_key), update->public_key))
+			goto toobig_peers;
+		if (update_only && !mnl_attr_put_u32_check(nlh, mnl_ideal_socket_buffer_size(), WGPEER_A_FLAGS, WGPEER_F_UPDATE_ONLY))
+			goto toobig_peers;
+		if (!mnl_attr_put_check(nlh, mnl_ideal_socket_buffer_size(), WGPEER_A_ENDPOINT, endpoint_len, &update->endpoint))
+			goto toobig_peers;
+		mnl_attr_nest_end(nlh, peer_nest);
+		peer_nest = NULL;
+		++carried;
+	}
+	mnl_attr_nest_end(nlh, peers_nest);
+	goto send;
+toobig_peers:
+	if (peer_nest)
+		mnl_attr_nest_cancel(nlh, peer_nest);
+	mnl_attr_nest_end(nlh, peers_nest);
+	goto send;
+send:
+	if (!carried && i == count)
+		goto out;
+	if (!carried) {
+		/* not even one peer fits a message */
+		ret = -EMSGSIZE;
+		updates[i].ret = ret;
+	} else if (mnlg_socket_send(nlg, nlh) < 0) {
+		ret = -errno;
+	} else {
+		errno = 0;
+		if (mnlg_socket_recv_run(nlg, NULL, NULL) < 0)
+			ret = errno ? -errno : -EINVAL;
+	}
+	/* updates from i on haven't been sent, unless failed */
+	for (; first < (ret ? count : i); ++first) {
+		if (updates[first].ret == -EAGAIN)
+			updates[first].ret = ret;
+	}
+	if (!ret && first < count)
+		goto again;
+
+out:
+	errno = -ret;
+	return ret;
+}
+
+static void endpoint_updates_replace_ret(wg_endpoint_update *updates, size_t count, int from, int to)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		if (updates[i].ret == from)
+			updates[i].ret = to;
+	}
+}
+
+int wg_set_peer_endpoint(const char *device_name, const wg_key public_key, const wg_endpoint *endpoint)
+{
+	int ret;
+	struct mnlg_socket *nlg;
+
+	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	if (!nlg)
+		return -errno;
+	ret = __wg_set_peer_endpoint(nlg, device_name, public_key, endpoint, true);
+	/* WGPEER_F_UPDATE_ONLY is since Linux 5.9. Older kernels reject unknown flags */
+	if (ret == -EOPNOTSUPP)
+		ret = __wg_set_peer_endpoint(nlg, device_name, public_key, endpoint, false);
+	mnlg_socket_close(nlg);
+	errno = -ret;
+	return ret;
+}
+
+int wg_set_device(wg_device *dev)
+{
+	int ret;
+	struct mnlg_socket *nlg;
+
+	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	if (!nlg)
+		return -errno;
+	ret = __wg_set_device(nlg, dev);
 	mnlg_socket_close(nlg);
 	errno = -ret;
 	return ret;
@@ -1407,24 +1564,146 @@ static void coalesce_peers(wg_device *device)
 	}
 }
 
-int wg_get_device(wg_device **device, const char *device_name)
+/* streaming peer scan: */
+
+struct peer_scan {
+	wg_peer_scan_cb cb;
+	void *data;
+	wg_peer_status peer;
+	/* the kernel splits a peer with many allowed IPs over several messages.
+	 * The continuations only carry the key and more allowed IPs */
+	wg_key last_key;
+	bool has_last_key;
+	bool stopped;
+	int ret;
+	/* of the device, ahead of its peers */
+	uint32_t fwmark;
+};
+
+static int scan_peer(const struct nlattr *attr, void *data)
+{
+	wg_peer_status *peer = data;
+
+	switch (mnl_attr_get_type(attr)) {
+	case WGPEER_A_PUBLIC_KEY:
+		if (mnl_attr_get_payload_len(attr) == sizeof(peer->public_key)) {
+			memcpy(peer->public_key, mnl_attr_get_payload(attr), sizeof(peer->public_key));
+			peer->has_public_key = true;
+		}
+		break;
+	case WGPEER_A_ENDPOINT: {
+		struct sockaddr *addr;
+
+		if (mnl_attr_get_payload_len(attr) < sizeof(*addr))
+			break;
+		addr = mnl_attr_get_payload(attr);
+		if (addr->sa_family == AF_INET && mnl_attr_get_payload_len(attr) == sizeof(peer->endpoint.addr4))
+			memcpy(&peer->endpoint.addr4, addr, sizeof(peer->endpoint.addr4));
+		else if (addr->sa_family == AF_INET6 && mnl_attr_get_payload_len(attr) == sizeof(peer->endpoint.addr6))
+			memcpy(&peer->endpoint.addr6, addr, sizeof(peer->endpoint.addr6));
+		break;
+	}
+	case WGPEER_A_LAST_HANDSHAKE_TIME:
+		if (mnl_attr_get_payload_len(attr) == sizeof(peer->last_handshake_time))
+			memcpy(&peer->last_handshake_time, mnl_attr_get_payload(attr), sizeof(peer->last_handshake_time));
+		break;
+	case WGPEER_A_RX_BYTES:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U64))
+			peer->rx_bytes = mnl_attr_get_u64(attr);
+		break;
+	case WGPEER_A_TX_BYTES:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U64))
+			peer->tx_bytes = mnl_attr_get_u64(attr);
+		break;
+	/* WGPEER_A_ALLOWEDIPS and the rest are skipped without being walked */
+	}
+
+	return MNL_CB_OK;
+}
+
+static int scan_peers(const struct nlattr *attr, void *data)
+{
+	struct peer_scan *scan = data;
+	int ret;
+
+	if (scan->stopped)
+		return MNL_CB_OK;
+
+	memset(&scan->peer, 0, sizeof(scan->peer));
+	ret = mnl_attr_parse_nested(attr, scan_peer, &scan->peer);
+	if (!ret)
+		return ret;
+	if (!scan->peer.has_public_key) {
+		errno = ENXIO;
+		return MNL_CB_ERROR;
+	}
+	if (scan->has_last_key && !memcmp(scan->last_key, scan->peer.public_key, sizeof(wg_key)))
+		return MNL_CB_OK;
+	memcpy(scan->last_key, scan->peer.public_key, sizeof(wg_key));
+	scan->has_last_key = true;
+
+	ret = scan->cb(&scan->peer, scan->data);
+	if (ret) {
+		/* the rest of the dump is still read, so the socket stays usable */
+		scan->stopped = true;
+		scan->ret = ret < 0 ? ret : 0;
+	}
+	return MNL_CB_OK;
+}
+
+static int scan_device(const struct nlattr *attr, void *data)
+{
+	struct peer_scan *scan = data;
+
+	switch (mnl_attr_get_type(attr)) {
+	case WGDEVICE_A_FWMARK:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U32))
+			scan->fwmark = mnl_attr_get_u32(attr);
+		break;
+	case WGDEVICE_A_PEERS:
+		return mnl_attr_parse_nested(attr, scan_peers, data);
+	}
+	return MNL_CB_OK;
+}
+
+static int scan_device_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct peer_scan *scan = data;
+
+	if (scan->stopped)
+		return MNL_CB_OK;
+	return mnl_attr_parse(nlh, sizeof(struct genlmsghdr), scan_device, data);
+}
+
+static int __wg_scan_peers(struct mnlg_socket *nlg, const char *device_name, struct peer_scan *scan)
+{
+	int ret = 0;
+	struct nlmsghdr *nlh;
+
+	nlh = mnlg_msg_prepare(nlg, WG_CMD_GET_DEVICE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
+	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, device_name);
+	if (mnlg_socket_send(nlg, nlh) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	errno = 0;
+	if (mnlg_socket_recv_run(nlg, scan_device_cb, scan) < 0)
+		ret = errno ? -errno : -EINVAL;
+
+out:
+	errno = -ret;
+	return ret;
+}
+
+static int __wg_get_device(struct mnlg_socket *nlg, wg_device **device, const char *device_name)
 {
 	int ret = 0;
 	struct nlmsghdr *nlh;
-	struct mnlg_socket *nlg;
 
-try_again:
 	*device = calloc(1, sizeof(wg_device));
 	if (!*device)
 		return -errno;
 
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
-	if (!nlg) {
-		wg_free_device(*device);
-		*device = NULL;
-		return -errno;
-	}
-
 	nlh = mnlg_msg_prepare(nlg, WG_CMD_GET_DEVICE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
 	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, device_name);
 	if (mnlg_socket_send(nlg, nlh) < 0) {
@@ -1439,18 +1718,399 @@ try_again:
 	coalesce_peers(*device);
 
 out:
-	if (nlg)
-		mnlg_socket_close(nlg);
 	if (ret) {
 		wg_free_device(*device);
-		if (ret == -EINTR)
-			goto try_again;
 		*device = NULL;
 	}
 	errno = -ret;
 	return ret;
 }
 
+int wg_get_device(wg_device **device, const char *device_name)
+{
+	int ret;
+	struct mnlg_socket *nlg;
+
+	do {
+		nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+		if (!nlg) {
+			*device = NULL;
+			return -errno;
+		}
+		ret = __wg_get_device(nlg, device, device_name);
+		mnlg_socket_close(nlg);
+	} while (ret == -EINTR);
+	errno = -ret;
+	return ret;
+}
+
+/* long lived netlink context: */
+
+/* A netlink socket runs one dump at a time (EBUSY), so concurrent dumps need one socket each */
+#define WG_NL_MAX_CONCURRENT_DUMPS 8
+
+struct wg_nl_context {
+	/* also the first socket of the concurrent dumps */
+	struct mnlg_socket *nlg;
+	/* the others, opened on first use */
+	struct mnlg_socket *dump_nlg[WG_NL_MAX_CONCURRENT_DUMPS - 1];
+	/* the kernel rejected WGPEER_F_UPDATE_ONLY */
+	bool no_update_only;
+};
+
+wg_nl_context *wg_nl_open(void)
+{
+	return calloc(1, sizeof(wg_nl_context));
+}
+
+void wg_nl_close(wg_nl_context *ctx)
+{
+	size_t i;
+
+	if (!ctx)
+		return;
+	if (ctx->nlg)
+		mnlg_socket_close(ctx->nlg);
+	for (i = 0; i < WG_NL_MAX_CONCURRENT_DUMPS - 1; ++i) {
+		if (ctx->dump_nlg[i])
+			mnlg_socket_close(ctx->dump_nlg[i]);
+	}
+	free(ctx);
+}
+
+/* Opens the socket and resolves the family ID on first use, or after a reset. */
+static int wg_nl_ensure(wg_nl_context *ctx)
+{
+	if (ctx->nlg)
+		return 0;
+	ctx->nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	return ctx->nlg ? 0 : -errno;
+}
+
+/* After a failed request, the socket is only reusable if the kernel answered the
+ * request with an error ack. Anything else may leave a half read dump behind.
+ * ENOENT is genetlink not knowing the family ID: the module has been reloaded. */
+static void wg_nl_after_error(wg_nl_context *ctx, int ret)
+{
+	if (ret == -ENODEV || ret == -EOPNOTSUPP || ret == -EPERM)
+		return;
+	mnlg_socket_close(ctx->nlg);
+	ctx->nlg = NULL;
+}
+
+int wg_nl_get_device(wg_nl_context *ctx, wg_device **device, const char *device_name)
+{
+	int ret;
+	bool retried_family = false;
+
+	while (true) {
+		ret = wg_nl_ensure(ctx);
+		if (ret) {
+			*device = NULL;
+			break;
+		}
+		ret = __wg_get_device(ctx->nlg, device, device_name);
+		if (!ret)
+			break;
+		wg_nl_after_error(ctx, ret);
+		if (ret == -EINTR)
+			continue;
+		if (ret == -ENOENT && !retried_family) {
+			retried_family = true;
+			continue;
+		}
+		break;
+	}
+	errno = -ret;
+	return ret;
+}
+
+int wg_nl_scan_peers(wg_nl_context *ctx, const char *device_name, wg_peer_scan_cb cb, void *data)
+{
+	int ret;
+	bool retried_family = false;
+	struct peer_scan scan;
+
+	while (true) {
+		ret = wg_nl_ensure(ctx);
+		if (ret)
+			break;
+		memset(&scan, 0, sizeof(scan));
+		scan.cb = cb;
+		scan.data = data;
+		ret = __wg_scan_peers(ctx->nlg, device_name, &scan);
+		if (!ret) {
+			ret = scan.ret;
+			break;
+		}
+		wg_nl_after_error(ctx, ret);
+		if (ret == -EINTR) {
+			/* a peer changed while the dump went on. It doesn't matter if the callback is done already */
+			if (scan.stopped) {
+				ret = scan.ret;
+				break;
+			}
+			continue;
+		}
+		if (ret == -ENOENT && !retried_family) {
+			retried_family = true;
+			continue;
+		}
+		break;
+	}
+	errno = -ret;
+	return ret;
+}
+
+/* concurrent dumps: */
+
+/* a socket of wg_nl_scan_devices, and the scan it runs */
+struct dump_slot {
+	struct mnlg_socket **nlg;
+	/* NULL when idle */
+	wg_device_scan *request;
+	struct peer_scan scan;
+	bool retried_family;
+};
+
+static void dump_slot_reset(struct dump_slot *slot, int ret)
+{
+	if (ret == -ENODEV || ret == -EOPNOTSUPP || ret == -EPERM)
+		return;
+	/* the rest of the failed dump may still be queued on the socket */
+	mnlg_socket_close(*slot->nlg);
+	*slot->nlg = NULL;
+}
+
+/* Send the dump request of the scan of slot. On failure, the scan is done with the error. */
+static bool dump_slot_start(struct dump_slot *slot)
+{
+	struct nlmsghdr *nlh;
+	int ret;
+
+	if (!*slot->nlg) {
+		*slot->nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+		if (!*slot->nlg) {
+			slot->request->ret = -errno;
+			return false;
+		}
+	}
+	memset(&slot->scan, 0, sizeof(slot->scan));
+	slot->scan.cb = slot->request->cb;
+	slot->scan.data = slot->request->data;
+	nlh = mnlg_msg_prepare(*slot->nlg, WG_CMD_GET_DEVICE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
+	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, slot->request->device_name);
+	if (mnlg_socket_send(*slot->nlg, nlh) < 0) {
+		ret = -errno;
+		dump_slot_reset(slot, ret);
+		slot->request->ret = ret;
+		return false;
+	}
+	return true;
+}
+
+/* Give the slot the next scan that could be sent, if any. */
+static void dump_slot_take(struct dump_slot *slot, wg_device_scan *scans, size_t count, size_t *next)
+{
+	slot->request = NULL;
+	while (*next < count) {
+		slot->request = &scans[(*next)++];
+		slot->retried_family = false;
+		if (dump_slot_start(slot))
+			return;
+		slot->request = NULL;
+	}
+}
+
+/* Read one datagram of the dump of slot. Returns 1 while more are to come, also once the dump is
+ * sent again after a restart or a new lookup of the wireguard family, and 0 once the scan is done. */
+static int dump_slot_read(struct dump_slot *slot)
+{
+	struct mnlg_socket *nlg = *slot->nlg;
+	wg_device_scan *request = slot->request;
+	ssize_t len;
+	int ret;
+
+	errno = 0;
+	len = mnl_socket_recvfrom(nlg->nl, nlg->buf, mnl_ideal_socket_buffer_size());
+	if (len > 0) {
+		/* the sequence number tells this dump from what came before on the socket */
+		ret = mnl_cb_run2(nlg->buf, len, nlg->seq, nlg->portid, scan_device_cb, &slot->scan,
+				  mnlg_cb_array, MNL_ARRAY_SIZE(mnlg_cb_array));
+		if (ret > 0)
+			return 1;
+		if (!ret) {
+			request->ret = slot->scan.ret;
+			request->fwmark = slot->scan.fwmark;
+			return 0;
+		}
+	}
+	ret = errno ? -errno : -EIO;
+
+	dump_slot_reset(slot, ret);
+	if (ret == -EINTR && slot->scan.stopped) {
+		/* a peer changed while the dump went on. As in wg_nl_scan_peers, it doesn't matter now */
+		request->ret = slot->scan.ret;
+		request->fwmark = slot->scan.fwmark;
+		return 0;
+	}
+	if (ret == -EINTR || (ret == -ENOENT && !slot->retried_family)) {
+		slot->retried_family |= ret == -ENOENT;
+		return dump_slot_start(slot) ? 1 : 0;
+	}
+	request->ret = ret;
+	return 0;
+}
+
+int wg_nl_scan_devices(wg_nl_context *ctx, wg_device_scan *scans, size_t count)
+{
+	struct dump_slot slots[WG_NL_MAX_CONCURRENT_DUMPS];
+	struct pollfd pfds[WG_NL_MAX_CONCURRENT_DUMPS];
+	size_t slot_count, active, next = 0, i, p;
+	int ret = 0;
+
+	for (i = 0; i < count; ++i)
+		scans[i].fwmark = 0;
+	slot_count = count < WG_NL_MAX_CONCURRENT_DUMPS ? count : WG_NL_MAX_CONCURRENT_DUMPS;
+	for (i = 0; i < slot_count; ++i) {
+		slots[i].nlg = i ? &ctx->dump_nlg[i - 1] : &ctx->nlg;
+		dump_slot_take(&slots[i], scans, count, &next);
+	}
+
+	/* Every request is out before the first reply is read. The kernel makes the next part of a
+	 * dump as the previous one is read, so a dump that has begun is read to its end. */
+	while (true) {
+		active = 0;
+		for (i = 0; i < slot_count; ++i) {
+			if (!slots[i].request)
+				continue;
+			pfds[active].fd = (*slots[i].nlg)->nl->fd;
+			pfds[active].events = POLLIN;
+			pfds[active].revents = 0;
+			++active;
+		}
+		if (!active)
+			break;
+		if (active == 1)
+			pfds[0].revents = POLLIN;
+		else if (poll(pfds, active, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+		for (i = 0, p = 0; i < slot_count; ++i) {
+			if (!slots[i].request)
+				continue;
+			if (!pfds[p++].revents)
+				continue;
+			while (dump_slot_read(&slots[i]))
+				;
+			dump_slot_take(&slots[i], scans, count, &next);
+		}
+	}
+	if (ret) {
+		for (i = 0; i < slot_count; ++i) {
+			if (slots[i].request) {
+				dump_slot_reset(&slots[i], ret);
+				slots[i].request->ret = ret;
+			}
+		}
+		for (; next < count; ++next)
+			scans[next].ret = ret;
+	}
+
+	for (i = 0; i < count && !ret; ++i)
+		ret = scans[i].ret;
+	errno = -ret;
+	return ret;
+}
+
+int wg_nl_set_device(wg_nl_context *ctx, wg_device *dev)
+{
+	int ret;
+	bool retried_family = false;
+
+	while (true) {
+		ret = wg_nl_ensure(ctx);
+		if (ret)
+			break;
+		ret = __wg_set_device(ctx->nlg, dev);
+		if (!ret)
+			break;
+		wg_nl_after_error(ctx, ret);
+		if (ret == -ENOENT && !retried_family) {
+			retried_family = true;
+			continue;
+		}
+		break;
+	}
+	errno = -ret;
+	return ret;
+}
+
+int wg_nl_set_peer_endpoint(wg_nl_context *ctx, const char *device_name, const wg_key public_key, const wg_endpoint *endpoint)
+{
+	int ret;
+	bool retried_family = false;
+
+	while (true) {
+		ret = wg_nl_ensure(ctx);
+		if (ret)
+			break;
+		ret = __wg_set_peer_endpoint(ctx->nlg, device_name, public_key, endpoint, !ctx->no_update_only);
+		if (ret == -EOPNOTSUPP && !ctx->no_update_only) {
+			/* WGPEER_F_UPDATE_ONLY is since Linux 5.9. Older kernels reject unknown flags */
+			ctx->no_update_only = true;
+			continue;
+		}
+		if (!ret)
+			break;
+		wg_nl_after_error(ctx, ret);
+		if (ret == -ENOENT && !retried_family) {
+			retried_family = true;
+			continue;
+		}
+		break;
+	}
+	errno = -ret;
+	return ret;
+}
+
+int wg_nl_set_peer_endpoints(wg_nl_context *ctx, const char *device_name, wg_endpoint_update *updates, size_t count)
+{
+	int ret;
+	bool retried_family = false;
+	size_t i;
+
+	for (i = 0; i < count; ++i)
+		updates[i].ret = -EAGAIN;
+	while (true) {
+		ret = wg_nl_ensure(ctx);
+		if (ret)
+			break;
+		ret = __wg_set_peer_endpoints(ctx->nlg, device_name, updates, count, !ctx->no_update_only);
+		if (ret == -EOPNOTSUPP && !ctx->no_update_only) {
+			ctx->no_update_only = true;
+			/* sent again, from the first message that failed */
+			endpoint_updates_replace_ret(updates, count, ret, -EAGAIN);
+			continue;
+		}
+		if (!ret)
+			break;
+		wg_nl_after_error(ctx, ret);
+		if (ret == -ENOENT && !retried_family) {
+			retried_family = true;
+			endpoint_updates_replace_ret(updates, count, ret, -EAGAIN);
+			continue;
+		}
+		break;
+	}
+	endpoint_updates_replace_ret(updates, count, -EAGAIN, ret);
+	errno = -ret;
+	return ret;
+}
+
 /* first\0second\0third\0forth\0last\0\0 */
 char *wg_list_device_names(void)
 {
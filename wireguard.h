@@ -93,7 +93,42 @@ typedef struct wg_device {
 #define wg_for_each_peer(__dev, __peer) for ((__peer) = (__dev)->first_peer; (__peer); (__peer) = (__peer)->next_peer)
 #define wg_for_each_allowedip(__peer, __allowedip) for ((__allowedip) = (__peer)->first_allowedip; (__allowedip); (__allowedip) = (__allowedip)->next_allowedip)
 
+typedef struct wg_nl_context wg_nl_context;
+
+/* What a streaming dump reports of a peer. Allowed IPs are not parsed. */
+typedef struct wg_peer_status {
+	wg_key public_key;
+	bool has_public_key;
+	wg_endpoint endpoint;
+	struct timespec64 last_handshake_time;
+	uint64_t rx_bytes, tx_bytes;
+} wg_peer_status;
+
+/* One peer of a batch of endpoint changes, and how it went: 0, or the negative errno of the message
+ * that carried it. -EAFNOSUPPORT if the endpoint is neither IPv4 nor IPv6. */
+typedef struct wg_endpoint_update {
+	wg_key public_key;
+	wg_endpoint endpoint;
+	int ret;
+} wg_endpoint_update;
+
+/* Called once per peer. Return 0 to go on, 1 to stop once every wanted peer has
+ * been seen, or a negative errno to stop and fail the scan with it. */
+typedef int (*wg_peer_scan_cb)(const wg_peer_status *peer, void *data);
+
+/* One device of wg_nl_scan_devices, and how its scan went: what wg_nl_scan_peers would return.
+ * fwmark is that of the device, 0 if none or the scan failed. */
+typedef struct wg_device_scan {
+	const char *device_name;
+	wg_peer_scan_cb cb;
+	void *data;
+	int ret;
+	uint32_t fwmark;
+} wg_device_scan;
+
 int wg_set_device(wg_device *dev);
+/* Set the endpoint of one existing peer, leaving the rest of the device alone. */
+int wg_set_peer_endpoint(const char *device_name, const wg_key public_key, const wg_endpoint *endpoint);
 int wg_get_device(wg_device **dev, const char *device_name);
 int wg_add_device(const char *device_name);
 int wg_del_device(const char *device_name);
@@ -106,6 +141,24 @@ void wg_generate_public_key(wg_key public_key, const wg_key private_key);
 void wg_generate_private_key(wg_key private_key);
 void wg_generate_preshared_key(wg_key preshared_key);
 
+/* A long lived generic netlink socket. The wireguard family ID is resolved once
+ * and again when the module is reloaded; the receive buffer is reused. */
+wg_nl_context *wg_nl_open(void);
+void wg_nl_close(wg_nl_context *ctx);
+int wg_nl_get_device(wg_nl_context *ctx, wg_device **dev, const char *device_name);
+/* Dump the peers of a device without building a wg_device. If the kernel restarts
+ * the dump, the callback sees the peers from the beginning again. */
+int wg_nl_scan_peers(wg_nl_context *ctx, const char *device_name, wg_peer_scan_cb cb, void *data);
+/* wg_nl_scan_peers for several devices at once. The dumps are requested back to back, on a
+ * socket each as a socket runs one dump at a time, and their replies read in one loop. Every ret
+ * is set. Returns 0, or the ret of the first scan that failed. */
+int wg_nl_scan_devices(wg_nl_context *ctx, wg_device_scan *scans, size_t count);
+int wg_nl_set_device(wg_nl_context *ctx, wg_device *dev);
+int wg_nl_set_peer_endpoint(wg_nl_context *ctx, const char *device_name, const wg_key public_key, const wg_endpoint *endpoint);
+/* Like wg_nl_set_peer_endpoint for each update, in as few WG_CMD_SET_DEVICE messages as they fit.
+ * Every ret is set. Returns 0, or the error that ended the batch. */
+int wg_nl_set_peer_endpoints(wg_nl_context *ctx, const char *device_name, wg_endpoint_update *updates, size_t count);
+
 #ifdef __cplusplus
 };
 #endif